@@ -0,0 +1,216 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <sstream>
+#include <chrono>
+#include <limits>
+#include <csignal>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <unistd.h>
+
+const int DEFAULT_TIMEOUT_MS = 200; // per-shard budget of one query
+const size_t TOP_K = 10;
+
+struct SearchResult
+{
+    int doc_id;
+    double score;
+};
+
+// Shard struct, connection to one `search --serve` process
+struct Shard
+{
+    std::string socket_path;
+    int fd = -1;
+    std::string reply; // reply bytes received for the current query
+    bool done = false;
+};
+
+bool connectShard(Shard &shard)
+{
+    if (shard.fd >= 0)
+        return true;
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    if (shard.socket_path.size() >= sizeof(addr.sun_path))
+        return false;
+    std::copy(shard.socket_path.begin(), shard.socket_path.end(), addr.sun_path);
+    shard.fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (shard.fd < 0 || connect(shard.fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0)
+    {
+        if (shard.fd >= 0)
+            close(shard.fd);
+        shard.fd = -1;
+        return false;
+    }
+    return true;
+}
+
+// a late reply would be read as the answer to the next query, so the connection is dropped
+void dropShard(Shard &shard)
+{
+    if (shard.fd >= 0)
+        close(shard.fd);
+    shard.fd = -1;
+}
+
+// Send the query to every shard and collect replies until all answered or the timeout passed,
+// returns the number of shards that answered
+int fanOut(std::vector<Shard> &shards, const std::string &query, bool conjunctive, int timeout_ms)
+{
+    std::string request = std::string(conjunctive ? "1 " : "0 ") + query + "\n";
+    for (auto &shard : shards)
+    {
+        shard.reply.clear();
+        shard.done = false;
+        if (!connectShard(shard) || write(shard.fd, request.data(), request.size()) != (ssize_t)request.size())
+        {
+            dropShard(shard);
+        }
+    }
+
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+    int answered = 0;
+    while (true)
+    {
+        std::vector<pollfd> fds;
+        std::vector<Shard *> pending;
+        for (auto &shard : shards)
+        {
+            if (shard.fd >= 0 && !shard.done)
+            {
+                fds.push_back({shard.fd, POLLIN, 0});
+                pending.push_back(&shard);
+            }
+        }
+        int wait_ms = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now()).count();
+        if (fds.empty() || wait_ms <= 0 || poll(fds.data(), fds.size(), wait_ms) <= 0)
+            break;
+
+        for (size_t i = 0; i < fds.size(); ++i)
+        {
+            if (!(fds[i].revents & (POLLIN | POLLHUP | POLLERR)))
+                continue;
+            Shard &shard = *pending[i];
+            char data[4096];
+            ssize_t n = read(shard.fd, data, sizeof(data));
+            if (n <= 0) // shard server died
+            {
+                dropShard(shard);
+                continue;
+            }
+            shard.reply.append(data, n);
+            // the reply ends with an empty line
+            if (shard.reply == "\n" || (shard.reply.size() >= 2 && shard.reply.compare(shard.reply.size() - 2, 2, "\n\n") == 0))
+            {
+                shard.done = true;
+                answered++;
+            }
+        }
+    }
+
+    for (auto &shard : shards)
+    {
+        if (!shard.done)
+            dropShard(shard);
+    }
+    return answered;
+}
+
+// merge the local top-k lists of the shards, scores use global stats so they are comparable.
+// truncated counts the shards whose query budget ran out
+std::vector<SearchResult> mergeResults(const std::vector<Shard> &shards, int &truncated)
+{
+    std::vector<SearchResult> results;
+    truncated = 0;
+    for (const auto &shard : shards)
+    {
+        if (!shard.done)
+            continue;
+        std::istringstream reply(shard.reply);
+        SearchResult result;
+        while (reply >> result.doc_id >> result.score)
+        {
+            results.push_back(result);
+        }
+        // results end at the "truncated <fraction processed>" line of a shard that ran out of budget
+        reply.clear();
+        std::string word;
+        if (reply >> word && word == "truncated")
+            truncated++;
+    }
+    std::sort(results.begin(), results.end(),
+              [](const SearchResult &a, const SearchResult &b)
+              { return a.score > b.score; });
+    if (results.size() > TOP_K)
+        results.resize(TOP_K);
+    return results;
+}
+
+int main(int argc, char *argv[])
+{
+    // aggregator [--timeout <ms>] <shard socket>...
+    int timeout_ms = DEFAULT_TIMEOUT_MS;
+    std::vector<Shard> shards;
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+        if (arg == "--timeout" && i + 1 < argc)
+        {
+            timeout_ms = std::atoi(argv[++i]);
+        }
+        else
+        {
+            Shard shard;
+            shard.socket_path = arg;
+            shards.push_back(shard);
+        }
+    }
+    if (shards.empty())
+    {
+        std::cerr << "Usage: " << argv[0] << " [--timeout <ms>] <shard socket>..." << std::endl;
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN); // writes to a dead shard fail instead
+
+    std::string query;
+    bool conjunctive;
+    while (true)
+    {
+        std::cout << "Enter your search query (or 'q' to exit): ";
+        if (!std::getline(std::cin, query) || query == "q")
+            break;
+
+        std::cout << "Enter search mode (0 for disjunctive, 1 for conjunctive): ";
+        std::cin >> conjunctive;
+        std::cin.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+
+        std::replace(query.begin(), query.end(), '\n', ' ');
+        int answered = fanOut(shards, query, conjunctive, timeout_ms);
+        int truncated;
+        std::vector<SearchResult> results = mergeResults(shards, truncated);
+
+        std::cout << "Top 10 results:" << std::endl;
+        for (const auto &result : results)
+        {
+            std::cout << "Doc ID: " << result.doc_id << ", Score: " << result.score << std::endl;
+        }
+        if (answered < (int)shards.size())
+        {
+            std::cout << "[partial] " << answered << " of " << shards.size() << " shards answered" << std::endl;
+        }
+        if (truncated > 0)
+        {
+            std::cout << "[truncated] " << truncated << " of " << answered << " shards ran out of query budget" << std::endl;
+        }
+    }
+
+    for (auto &shard : shards)
+    {
+        dropShard(shard);
+    }
+    return 0;
+}
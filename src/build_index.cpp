@@ -10,14 +10,74 @@
 #include <chrono>
 #include <filesystem>
 #include <queue>
+#include <array>
+#include <map>
+#include <tuple>
+#include <numeric>
+#include <thread>
+#include <cmath>
+#include <memory>
+#include <cstring>
+#include <functional>
+#include <future>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <sys/resource.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#ifdef HAVE_LIBARCHIVE
 #include "archive.h"
 #include "archive_entry.h"
+#endif
 #include <regex>
+#include "index_format.h"
 
 const int CHUNK_SIZE = 1024 * 64;              // 64KB
 const std::string TEMP_DIR = "temp_index";     // temp directory
 const size_t MEMORY_LIMIT = 500 * 1024 * 1024; // 500MB, leave space for lexicon and other operations
 const int SMALL_DOC_TEST = 9000000;
+const double PROGRESS_INTERVAL_SECONDS = 5.0;          // how often progress lines are emitted
+const std::string BUILD_REPORT_FILE = "build_report.json"; // final build report
+const int64_t ENCODE_BATCH_POSTINGS = 1 << 18; // merged postings per batch of the final encoding workers
+const size_t WRITE_BUFFER_SIZE = 4 * 1024 * 1024; // final index bytes buffered before a write
+const int64_t WRITE_ALIGNMENT = 4096;             // buffered writes end on multiples of this file offset
+
+// debug copies of the index files, relative to the output directory
+const std::string BLOCK_INFO_TEXT_FILE = "final_sorted_block_info2.txt"; // --debug-dumps text copy of the block info
+const std::string INDEX_TEXT_FILE = "final_sorted_index2.txt";           // --debug-dumps merged postings as text
+
+// segments
+const std::string MANIFEST_LOCK = "manifest.lock";
+const std::string MERGE_LOCK = "merge.lock";
+const int MERGE_FACTOR = 4;           // segments of the same tier merged at once
+const int MIN_SEGMENT_DOCS = 100000; // segments below this size are in tier 0
+const double COMPACT_THRESHOLD = 0.2;  // default deleted ratio above which a segment is compacted
+
+// doc reordering
+const int BP_ITERATIONS = 20; // swap rounds per bisection
+const int BP_LEAF_SIZE = 16;  // partitions this small keep their input order
+
+// term-pair index of frequent conjunctions
+const int PAIR_MIN_POSTINGS = 4 * POSTING_PER_BLOCK;  // pairs with a rarer term are cheap to intersect at query time
+const int64_t PAIR_BUDGET = 64 * 1024 * 1024;         // default bytes of all pair lists
+
+// inflate checkpoints for parallel ingestion, cached next to the archive
+const std::string ZRAN_INDEX_SUFFIX = ".zran";
+const int ZRAN_WINDOW = 32768;            // deflate window, restored at every checkpoint
+const int64_t ZRAN_SPAN = 4 * 1024 * 1024; // uncompressed bytes between checkpoints
+
+// inputs read concurrently
+const size_t LINE_BATCH_SIZE = 4096;  // lines handed from a reader thread at once
+const size_t READ_AHEAD_BATCHES = 16; // batches an input may read ahead
+
+// checkpoints of an interrupted build, next to its runs
+const std::string CHECKPOINT_FILE = "build_checkpoint.txt"; // inputs, counters, run CRC32s, resume position and a dictionary snapshot
+const std::string CHECKPOINT_DOCS_FILE = "build_docs.txt";  // "doc_id length line_pos" of the docs indexed so far
 
 // forward declarations
 struct Posting;
@@ -33,23 +93,26 @@ size_t estimateMemoryUsage(const std::unordered_map<int, std::vector<std::pair<i
 
 // Varbyte encode function
 std::vector<uint8_t> varbyteEncode(uint32_t number);
-// Varbyte decode function
-uint32_t varbyteDecode(const std::vector<uint8_t> &bytes);
 
-// write to file
-void writeIndexToFile(const std::unordered_map<int, std::vector<std::pair<int, int>>> &index,
-                      const std::unordered_map<int, std::string> &term_id_to_word,
-                      int file_number);
+// Varbyte decode from a buffer, advances pos
+uint32_t varbyteDecode(const uint8_t *data, size_t &pos);
+
+// write a run to file, returns its CRC32
+uint32_t writeIndexToFile(const std::unordered_map<int, std::vector<std::pair<int, int>>> &index,
+                          const std::unordered_map<int, std::string> &term_id_to_word,
+                          int file_number, const std::string &output_dir);
 
 // write document info to file
-void writeDocumentInfoToFile(const std::unordered_map<int, std::pair<int, int64_t>> &document_info);
+void writeDocumentInfoToFile(const std::unordered_map<int, std::pair<int, int64_t>> &document_info,
+                             const std::string &output_dir);
 
 // external sort
 void externalSort(int num_files, std::unordered_map<std::string, LexiconInfo> &lexicon,
-                  const std::unordered_map<int, std::string> &term_id_to_word);
+                  const std::unordered_map<int, std::string> &term_id_to_word,
+                  const std::string &output_dir);
 
 // read next entry
-IndexEntry readNextEntry(std::ifstream &file, int file_index, const std::unordered_map<int, std::string> &term_id_to_word);
+IndexEntry readNextEntry(std::ifstream &file, int file_index);
 
 // Posting struct
 struct Posting
@@ -66,6 +129,7 @@ struct LexiconInfo
     int posting_number;
     int64_t start_position;
     int64_t bytes_size;
+    int list_type = LIST_BLOCKS;
 };
 
 // IndexEntry struct
@@ -90,10 +154,193 @@ struct CompareIndexEntry
 
     bool operator()(const IndexEntry &a, const IndexEntry &b) const
     {
-        return term_id_to_word->at(a.term_id) > term_id_to_word->at(b.term_id);
+        const std::string &word_a = term_id_to_word->at(a.term_id);
+        const std::string &word_b = term_id_to_word->at(b.term_id);
+        if (word_a != word_b)
+            return word_a > word_b;
+        return a.file_index > b.file_index; // a term's runs merge in order, its gaps continue from run to run
+    }
+};
+
+// build phases tracked by BuildStats
+enum BuildPhase
+{
+    PHASE_INFLATE,
+    PHASE_TOKENIZE,
+    PHASE_INVERT,
+    PHASE_SPILL,
+    PHASE_MERGE,
+    PHASE_ENCODE,
+    PHASE_REORDER,
+    PHASE_COUNT
+};
+
+const char *PHASE_NAMES[PHASE_COUNT] = {"inflate", "tokenize", "invert", "spill", "merge", "encode", "reorder"};
+
+// BuildStats struct, collects timers and counters for the whole build
+struct BuildStats
+{
+    using Clock = std::chrono::steady_clock;
+
+    Clock::time_point start_time = Clock::now();
+    Clock::time_point last_progress = Clock::now();
+    std::array<std::atomic<double>, PHASE_COUNT> phase_seconds{}; // inflate time is also added by reader threads
+    const char *current_stage = "ingest";
+
+    std::atomic<int64_t> compressed_bytes = 0;   // bytes consumed from the inputs
+    std::atomic<int64_t> uncompressed_bytes = 0; // bytes produced by inflate, or read from uncompressed inputs
+    int64_t docs = 0;
+    int64_t postings = 0;
+    int64_t terms_merged = 0;
+    int64_t index_bytes = 0; // bytes written to final_sorted_index.bin
+    int64_t blocks = 0;
+    size_t peak_index_memory = 0; // peak of the estimated in-memory index size
+
+    std::vector<int64_t> run_sizes;           // bytes of every temp_index_N.bin
+    std::array<int64_t, 64> run_size_hist{};  // log2 buckets of run sizes
+    std::array<int64_t, 64> block_size_hist{}; // log2 buckets of final block sizes
+
+    // a pass rewriting the final index replaces what was counted for it
+    void resetIndexStats()
+    {
+        index_bytes = 0;
+        blocks = 0;
+        block_size_hist.fill(0);
+    }
+
+    double elapsed() const
+    {
+        return std::chrono::duration<double>(Clock::now() - start_time).count();
     }
 };
 
+BuildStats build_stats;
+bool debug_dumps = false; // --debug-dumps, write text copies of the postings and block info
+IndexFormat build_format; // --block-size, format of the lists of new indexes, segments and shards
+
+// add time since start to one phase, return now so consecutive phases can be chained
+BuildStats::Clock::time_point addPhaseTime(BuildPhase phase, BuildStats::Clock::time_point start)
+{
+    auto now = BuildStats::Clock::now();
+    build_stats.phase_seconds[phase] += std::chrono::duration<double>(now - start).count();
+    return now;
+}
+
+// PhaseTimer struct, adds the lifetime of the object to one phase
+struct PhaseTimer
+{
+    BuildPhase phase;
+    BuildStats::Clock::time_point start;
+
+    PhaseTimer(BuildPhase p) : phase(p), start(BuildStats::Clock::now()) {}
+    ~PhaseTimer() { addPhaseTime(phase, start); }
+};
+
+// log2 bucket of a value, bucket i holds [2^i, 2^(i+1))
+int log2Bucket(int64_t value)
+{
+    int bucket = 0;
+    while (value > 1 && bucket < 63)
+    {
+        value >>= 1;
+        bucket++;
+    }
+    return bucket;
+}
+
+// peak resident memory in bytes
+int64_t peakResidentMemory()
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+    return usage.ru_maxrss; // bytes on macOS
+#else
+    return static_cast<int64_t>(usage.ru_maxrss) * 1024; // kilobytes on Linux
+#endif
+}
+
+// Print progress line if the interval has passed
+void reportProgress(bool force = false)
+{
+    auto now = BuildStats::Clock::now();
+    if (!force && std::chrono::duration<double>(now - build_stats.last_progress).count() < PROGRESS_INTERVAL_SECONDS)
+        return;
+    build_stats.last_progress = now;
+
+    double elapsed = build_stats.elapsed();
+    std::cout << "[progress] stage: " << build_stats.current_stage
+              << ", elapsed: " << elapsed << "s"
+              << ", docs: " << build_stats.docs
+              << " (" << static_cast<int64_t>(build_stats.docs / std::max(elapsed, 1e-9)) << " docs/s)"
+              << ", input: " << build_stats.uncompressed_bytes / (1024 * 1024) << "MB"
+              << " (" << build_stats.uncompressed_bytes / (1024.0 * 1024.0) / std::max(elapsed, 1e-9) << " MB/s)"
+              << ", runs: " << build_stats.run_sizes.size()
+              << ", terms merged: " << build_stats.terms_merged
+              << ", peak rss: " << peakResidentMemory() / (1024 * 1024) << "MB";
+    for (int i = 0; i < PHASE_COUNT; ++i)
+    {
+        std::cout << ", " << PHASE_NAMES[i] << ": " << build_stats.phase_seconds[i] << "s";
+    }
+    std::cout << std::endl;
+}
+
+// Write histogram as json object, only non-empty buckets
+void writeHistogramJson(std::ofstream &out, const std::array<int64_t, 64> &hist)
+{
+    out << "{";
+    bool first = true;
+    for (int i = 0; i < 64; ++i)
+    {
+        if (hist[i] == 0)
+            continue;
+        out << (first ? "" : ", ") << "\"" << (int64_t(1) << i) << "\": " << hist[i];
+        first = false;
+    }
+    out << "}";
+}
+
+// Write final build report as json
+void writeBuildReport(const std::string &filename)
+{
+    double elapsed = build_stats.elapsed();
+    std::ofstream out(filename);
+    out << "{\n";
+    out << "  \"elapsed_seconds\": " << elapsed << ",\n";
+    out << "  \"phases\": {";
+    for (int i = 0; i < PHASE_COUNT; ++i)
+    {
+        out << (i ? ", " : "") << "\"" << PHASE_NAMES[i] << "\": " << build_stats.phase_seconds[i];
+    }
+    out << "},\n";
+    out << "  \"docs\": " << build_stats.docs << ",\n";
+    out << "  \"postings\": " << build_stats.postings << ",\n";
+    out << "  \"terms\": " << build_stats.terms_merged << ",\n";
+    out << "  \"compressed_bytes\": " << build_stats.compressed_bytes << ",\n";
+    out << "  \"uncompressed_bytes\": " << build_stats.uncompressed_bytes << ",\n";
+    out << "  \"docs_per_second\": " << build_stats.docs / std::max(elapsed, 1e-9) << ",\n";
+    out << "  \"input_mb_per_second\": " << build_stats.uncompressed_bytes / (1024.0 * 1024.0) / std::max(elapsed, 1e-9) << ",\n";
+    out << "  \"runs\": " << build_stats.run_sizes.size() << ",\n";
+    out << "  \"run_sizes\": [";
+    for (size_t i = 0; i < build_stats.run_sizes.size(); ++i)
+    {
+        out << (i ? ", " : "") << build_stats.run_sizes[i];
+    }
+    out << "],\n";
+    out << "  \"run_size_histogram\": ";
+    writeHistogramJson(out, build_stats.run_size_hist);
+    out << ",\n";
+    out << "  \"index_bytes\": " << build_stats.index_bytes << ",\n";
+    out << "  \"blocks\": " << build_stats.blocks << ",\n";
+    out << "  \"block_size_histogram\": ";
+    writeHistogramJson(out, build_stats.block_size_hist);
+    out << ",\n";
+    out << "  \"peak_index_memory_bytes\": " << build_stats.peak_index_memory << ",\n";
+    out << "  \"peak_rss_bytes\": " << peakResidentMemory() << "\n";
+    out << "}\n";
+    out.close();
+}
+
 // Process sentence part
 std::vector<std::string> processSentencePart(const std::string &sentence_part)
 {
@@ -134,13 +381,23 @@ size_t processLine(const std::string &line,
                    std::unordered_map<std::string, LexiconInfo> &lexicon,
                    std::unordered_map<int, std::string> &term_id_to_word,
                    int &last_doc_id, int &term_id,
-                   std::streamoff &line_position)
+                   std::streamoff &line_position, int &doc_base)
 {
     std::istringstream iss(line);
     int doc_id;
-    if (!(iss >> doc_id) || doc_id < last_doc_id)
+    if (!(iss >> doc_id))
+    {
+        std::cerr << "Invalid doc_id in line: " << line.substr(0, 32) << std::endl;
+        return 0;
+    }
+    if (doc_base < 0)
+    {
+        doc_base = doc_id; // first doc of a segment, doc_ids are stored relative to it
+    }
+    doc_id -= doc_base;
+    if (doc_id < last_doc_id)
     {
-        std::cerr << "Invalid doc_id: " << doc_id << ", last_doc_id: " << last_doc_id << std::endl;
+        std::cerr << "Invalid doc_id: " << doc_id + doc_base << ", last_doc_id: " << last_doc_id + doc_base << std::endl;
         return 0;
     }
 
@@ -152,15 +409,18 @@ size_t processLine(const std::string &line,
     // update document info of position of doc_id
     document_info[doc_id] = {0, line_position};
 
-    while (iss >> sentence_part)
     {
-        std::vector<std::string> words = processSentencePart(sentence_part);
-        for (const std::string &word : words)
+        PhaseTimer timer(PHASE_TOKENIZE);
+        while (iss >> sentence_part)
         {
-            if (!word.empty())
+            std::vector<std::string> words = processSentencePart(sentence_part);
+            for (const std::string &word : words)
             {
-                word_counts[word]++;
-                document_info[doc_id].first++;
+                if (!word.empty())
+                {
+                    word_counts[word]++;
+                    document_info[doc_id].first++;
+                }
             }
         }
     }
@@ -172,6 +432,7 @@ size_t processLine(const std::string &line,
         exit(1);
     }
 
+    PhaseTimer timer(PHASE_INVERT);
     for (const auto &[word, count] : word_counts)
     {
         if (lexicon.find(word) == lexicon.end())
@@ -194,19 +455,564 @@ size_t processLine(const std::string &line,
             memory_increment += sizeof(int) + sizeof(std::vector<std::pair<int, int>>);
         }
     }
-    if (doc_id % 100000 == 0)
-    {
-        std::cout << "Processed line: " << doc_id << ", memory increment: " << memory_increment
-                  << ", words: " << word_counts.size() << std::endl;
-    }
+    build_stats.docs++;
+    build_stats.postings += word_counts.size();
     last_doc_id = doc_id;
 
     return memory_increment;
 }
 
-// Process tar.gz file
-void processTarGz(const std::string &filename, int chunk_size)
+// ZranPoint struct, a deflate block boundary where inflate can restart without the data before it
+struct ZranPoint
+{
+    int64_t in;                  // compressed offset of the first full byte of the block
+    int bits;                    // bits of the byte before in that belong to the block
+    int64_t out;                 // uncompressed offset of the block
+    std::vector<uint8_t> window; // the ZRAN_WINDOW uncompressed bytes before out
+};
+
+// ZranIndex struct, inflate checkpoints of a .tar.gz and where the regular files of the tar are
+struct ZranIndex
+{
+    int64_t gz_size = 0;
+    int64_t gz_mtime = 0; // cached checkpoints are only used for the same archive
+    int64_t total_out = 0;
+    std::vector<ZranPoint> points;
+    std::vector<std::pair<int64_t, int64_t>> files; // uncompressed data offset and size of every regular file
+};
+
+// ArchivePoint struct, an inflate checkpoint of a .tar.gz with the tar state at its offset, enough to
+// restart reading the archive there
+struct ArchivePoint
+{
+    ZranPoint point;
+    int64_t next_header = -1; // TarScanner state at point.out, -1 once every file is known
+    std::string header;
+    std::shared_ptr<const std::vector<std::pair<int64_t, int64_t>>> files; // at least the files ending after point.out
+};
+
+// InputPosition struct, where the line after a fed line starts, so a resumed build seeks there. The
+// default position is the start of the first input
+struct InputPosition
+{
+    int input = 0;      // index of the input
+    int64_t offset = 0; // byte offset in a text file, file text bytes after point in a .tar.gz, lines in a .gz
+    std::shared_ptr<const ArchivePoint> point; // last checkpoint of a .tar.gz, null before the first one
+};
+
+// called with every line of the inputs and the position after it, returns false to stop reading
+using LineHandler = std::function<bool(const std::string &, const InputPosition &)>;
+
+// TextRegion struct, text of one region of an input (file data between two checkpoints, or a
+// chunk of a stream), split where its complete lines begin and end
+struct TextRegion
+{
+    std::string text;
+    size_t head_end = std::string::npos; // after the end of the line begun in an earlier region, npos if no line ends here
+    size_t tail_start = 0;               // start of the line continued in the next region
+    int64_t compressed_end = 0;
+    std::shared_ptr<const ArchivePoint> point; // checkpoint of a .tar.gz before the region
+    int64_t offset = 0;                        // file text bytes between point and text
+};
+
+// TarScanner struct, follows the tar headers through the uncompressed stream to find file data
+struct TarScanner
+{
+    int64_t next_header = 0; // uncompressed offset of the next header, -1 after the end of archive
+    std::string header;
+
+    void scan(const uint8_t *data, size_t size, int64_t offset, std::vector<std::pair<int64_t, int64_t>> &files)
+    {
+        int64_t pos = offset;
+        int64_t end = offset + size;
+        while (next_header >= 0 && pos < end)
+        {
+            if (pos < next_header)
+            {
+                pos = std::min(end, next_header); // file data and padding
+                continue;
+            }
+            size_t take = std::min<int64_t>(512 - header.size(), end - pos);
+            header.append(reinterpret_cast<const char *>(data + (pos - offset)), take);
+            pos += take;
+            if (header.size() < 512)
+                break;
+
+            if (header[0] == '\0') // zero block, end of archive
+            {
+                next_header = -1;
+                break;
+            }
+            int64_t file_size = std::strtoll(header.substr(124, 12).c_str(), nullptr, 8);
+            char type = header[156];
+            if ((type == '0' || type == '\0') && file_size > 0)
+            {
+                files.emplace_back(next_header + 512, file_size);
+            }
+            next_header += 512 + (file_size + 511) / 512 * 512;
+            header.clear();
+        }
+    }
+};
+
+// first of the files whose data ends after the uncompressed offset
+std::vector<std::pair<int64_t, int64_t>>::const_iterator fileAfter(const std::vector<std::pair<int64_t, int64_t>> &files,
+                                                                   int64_t offset)
+{
+    return std::lower_bound(files.begin(), files.end(), offset,
+                            [](const std::pair<int64_t, int64_t> &file, int64_t pos)
+                            { return file.first + file.second <= pos; });
+}
+
+// Append the file data in the uncompressed bytes [offset, offset + size) to text, the last line of
+// a file always ends with '\n'
+void appendFileData(const std::vector<std::pair<int64_t, int64_t>> &files, int64_t offset, const uint8_t *data,
+                    size_t size, std::string &text)
+{
+    for (auto it = fileAfter(files, offset); it != files.end() && it->first < offset + int64_t(size); ++it)
+    {
+        int64_t begin = std::max(it->first, offset);
+        int64_t end = std::min(it->first + it->second, offset + int64_t(size));
+        text.append(reinterpret_cast<const char *>(data + (begin - offset)), end - begin);
+        if (end == it->first + it->second && text.back() != '\n')
+        {
+            text.push_back('\n');
+        }
+    }
+}
+
+// realign a region on line boundaries
+void splitRegion(TextRegion &region)
+{
+    size_t first = region.text.find('\n');
+    region.head_end = first == std::string::npos ? first : first + 1;
+    region.tail_start = region.text.rfind('\n') + 1; // 0 without a line end
+}
+
+// drop the text of a region indexed before a restart, skip counts the bytes left to drop
+void skipText(TextRegion &region, int64_t &skip)
+{
+    if (skip == 0)
+        return;
+    size_t drop = std::min<int64_t>(skip, region.text.size());
+    region.text.erase(0, drop);
+    region.offset += drop;
+    skip -= drop;
+    splitRegion(region);
+}
+
+// LineFeeder struct, joins the lines cut by region boundaries and hands complete lines on in order
+struct LineFeeder
+{
+    const LineHandler &on_line; // returns false to stop reading
+    bool count_lines;           // positions count lines, for streams that cannot seek
+    std::string carry;
+    std::string line;
+    InputPosition next; // position after the line handed on
+    InputPosition fed;  // position after the text fed so far
+
+    explicit LineFeeder(const LineHandler &on_line, bool count_lines = false) : on_line(on_line), count_lines(count_lines) {}
+
+    // hand on a line ending before the text offset of its region
+    bool handLine(const std::string &text, const TextRegion &region, size_t offset)
+    {
+        if (count_lines)
+            next.offset++;
+        else
+            next.offset = region.offset + offset;
+        return on_line(text, next);
+    }
+
+    bool feed(const TextRegion &region)
+    {
+        const std::string &text = region.text;
+        fed.point = region.point;
+        fed.offset = count_lines ? next.offset : region.offset + text.size();
+        if (region.head_end == std::string::npos)
+        {
+            carry += text;
+            return true;
+        }
+        next.point = region.point;
+        carry.append(text, 0, region.head_end - 1);
+        if (!carry.empty() && !handLine(carry, region, region.head_end))
+            return false;
+        for (size_t start = region.head_end; start < region.tail_start;)
+        {
+            size_t end = text.find('\n', start);
+            if (end > start)
+            {
+                line.assign(text, start, end - start);
+                if (!handLine(line, region, end + 1))
+                    return false;
+            }
+            start = end + 1;
+        }
+        carry.assign(text, region.tail_start);
+        return true;
+    }
+
+    bool finish()
+    {
+        if (carry.empty())
+            return true;
+        next = fed;
+        if (count_lines)
+            next.offset++;
+        return on_line(carry, next);
+    }
+};
+
+int64_t fileMtime(const std::string &path)
+{
+    return std::filesystem::last_write_time(path).time_since_epoch().count();
+}
+
+// Load the cached checkpoints of an archive, false if there are none or the archive changed
+bool loadZranIndex(const std::string &filename, ZranIndex &index)
+{
+    std::ifstream file(filename + ZRAN_INDEX_SUFFIX, std::ios::binary);
+    int64_t header[4]; // gz size, gz mtime, total out, point count
+    if (!file.read(reinterpret_cast<char *>(header), sizeof(header)) ||
+        header[0] != int64_t(std::filesystem::file_size(filename)) || header[1] != fileMtime(filename))
+        return false;
+    index.gz_size = header[0];
+    index.gz_mtime = header[1];
+    index.total_out = header[2];
+    index.points.resize(header[3]);
+    for (auto &point : index.points)
+    {
+        point.window.resize(ZRAN_WINDOW);
+        file.read(reinterpret_cast<char *>(&point.in), sizeof(point.in));
+        file.read(reinterpret_cast<char *>(&point.bits), sizeof(point.bits));
+        file.read(reinterpret_cast<char *>(&point.out), sizeof(point.out));
+        file.read(reinterpret_cast<char *>(point.window.data()), ZRAN_WINDOW);
+    }
+    int64_t file_count = 0;
+    file.read(reinterpret_cast<char *>(&file_count), sizeof(file_count));
+    index.files.resize(file_count);
+    file.read(reinterpret_cast<char *>(index.files.data()), file_count * sizeof(index.files[0]));
+    return bool(file) && !index.points.empty();
+}
+
+void saveZranIndex(const std::string &filename, const ZranIndex &index)
+{
+    std::string tmp_path = filename + ZRAN_INDEX_SUFFIX + ".tmp";
+    std::ofstream file(tmp_path, std::ios::binary);
+    int64_t header[4] = {index.gz_size, index.gz_mtime, index.total_out, int64_t(index.points.size())};
+    file.write(reinterpret_cast<const char *>(header), sizeof(header));
+    for (const auto &point : index.points)
+    {
+        file.write(reinterpret_cast<const char *>(&point.in), sizeof(point.in));
+        file.write(reinterpret_cast<const char *>(&point.bits), sizeof(point.bits));
+        file.write(reinterpret_cast<const char *>(&point.out), sizeof(point.out));
+        file.write(reinterpret_cast<const char *>(point.window.data()), ZRAN_WINDOW);
+    }
+    int64_t file_count = index.files.size();
+    file.write(reinterpret_cast<const char *>(&file_count), sizeof(file_count));
+    file.write(reinterpret_cast<const char *>(index.files.data()), file_count * sizeof(index.files[0]));
+    file.close();
+    if (!file)
+    {
+        std::cerr << "Cannot write inflate checkpoints next to " << filename << std::endl;
+        std::filesystem::remove(tmp_path);
+        return;
+    }
+    std::filesystem::rename(tmp_path, filename + ZRAN_INDEX_SUFFIX);
+}
+
+// Inflate an archive with zlib from start, reading chunk_size compressed bytes at a time, and feed its
+// lines. A checkpoint is taken at the first block boundary after every ZRAN_SPAN uncompressed bytes and
+// handed on with the positions of the lines after it, with checkpoints it is also added to index.
+// Returns false on a corrupt archive, index is only complete for a single member gzip read to the end
+// from its beginning
+bool inflateSequential(const std::string &filename, int chunk_size, ZranIndex &index, LineFeeder &feeder, bool checkpoints,
+                       bool &complete, const InputPosition &start = InputPosition())
+{
+    const ArchivePoint *resume = start.point.get();
+    std::ifstream file(filename, std::ios::binary);
+    z_stream strm{};
+    bool raw = resume != nullptr; // restarted at a checkpoint, after the gzip header
+    if (!file.is_open() || inflateInit2(&strm, raw ? -15 : 47) != Z_OK) // 47: gzip or zlib header, 32KB window
+    {
+        std::cerr << "Cannot open file: " << filename << std::endl;
+        return false;
+    }
+    std::vector<uint8_t> input(chunk_size);
+    std::vector<uint8_t> window(ZRAN_WINDOW);
+    TarScanner tar;
+    TextRegion region;
+    int64_t gz_size = std::filesystem::file_size(filename);
+    int64_t total_in = 0;
+    int64_t total_out = 0;
+    int64_t counted_in = 0; // part of total_in already added to build_stats
+    int64_t last_point = -ZRAN_SPAN;
+    int64_t text_after_point = 0; // file text since the last checkpoint
+    int64_t skip = start.offset;   // file text indexed before a restart
+    int trailer = 0;               // bytes of a gzip trailer left to pass over
+    if (resume)
+    {
+        const ZranPoint &point = resume->point;
+        file.seekg(point.in - (point.bits ? 1 : 0));
+        if (point.bits)
+        {
+            inflatePrime(&strm, point.bits, file.get() >> (8 - point.bits));
+        }
+        if (point.out > 0)
+        {
+            inflateSetDictionary(&strm, point.window.data(), ZRAN_WINDOW);
+        }
+        total_in = counted_in = point.in;
+        total_out = last_point = point.out;
+        tar.next_header = resume->next_header;
+        tar.header = resume->header;
+        index.files = *resume->files;
+        region.point = start.point;
+    }
+    complete = !resume;
+    int ret = Z_OK;
+    do
+    {
+        {
+            PhaseTimer timer(PHASE_INFLATE);
+            file.read(reinterpret_cast<char *>(input.data()), input.size());
+        }
+        strm.avail_in = file.gcount();
+        strm.next_in = input.data();
+        if (strm.avail_in == 0)
+        {
+            std::cerr << "Unexpected end of file: " << filename << std::endl;
+            ret = Z_DATA_ERROR;
+            break;
+        }
+        do
+        {
+            if (trailer > 0)
+            {
+                int passed = std::min<int>(trailer, strm.avail_in);
+                strm.next_in += passed;
+                strm.avail_in -= passed;
+                total_in += passed;
+                trailer -= passed;
+                if (strm.avail_in == 0)
+                    continue;
+            }
+            if (strm.avail_out == 0)
+            {
+                strm.avail_out = ZRAN_WINDOW;
+                strm.next_out = window.data();
+            }
+            size_t out_start = ZRAN_WINDOW - strm.avail_out;
+            total_in += strm.avail_in;
+            total_out += strm.avail_out;
+            {
+                PhaseTimer timer(PHASE_INFLATE);
+                ret = inflate(&strm, Z_BLOCK);
+            }
+            total_in -= strm.avail_in;
+            total_out -= strm.avail_out;
+            if (ret == Z_NEED_DICT || ret == Z_DATA_ERROR || ret == Z_MEM_ERROR)
+                break;
+
+            size_t produced = ZRAN_WINDOW - strm.avail_out - out_start;
+            build_stats.uncompressed_bytes += produced;
+            build_stats.compressed_bytes += total_in - counted_in;
+            counted_in = total_in;
+            tar.scan(window.data() + out_start, produced, total_out - produced, index.files);
+            region.text.clear();
+            appendFileData(index.files, total_out - produced, window.data() + out_start, produced, region.text);
+            region.offset = text_after_point;
+            text_after_point += region.text.size();
+            splitRegion(region);
+            skipText(region, skip);
+            if (!feeder.feed(region))
+            {
+                inflateEnd(&strm);
+                complete = false;
+                return true;
+            }
+
+            // end of a deflate block that is not the last one
+            if ((strm.data_type & 128) && !(strm.data_type & 64) && total_out - last_point >= ZRAN_SPAN)
+            {
+                auto archive = std::make_shared<ArchivePoint>();
+                archive->point = {total_in, strm.data_type & 7, total_out, std::vector<uint8_t>(ZRAN_WINDOW)};
+                size_t older = strm.avail_out; // the window is circular, bytes after the write position are older
+                std::memcpy(archive->point.window.data(), window.data() + ZRAN_WINDOW - older, older);
+                std::memcpy(archive->point.window.data() + older, window.data(), ZRAN_WINDOW - older);
+                archive->next_header = tar.next_header;
+                archive->header = tar.header;
+                archive->files = std::make_shared<const std::vector<std::pair<int64_t, int64_t>>>(
+                    fileAfter(index.files, total_out), index.files.cend());
+                if (checkpoints)
+                {
+                    index.points.push_back(archive->point);
+                }
+                region.point = std::move(archive);
+                text_after_point = 0;
+                last_point = total_out;
+            }
+
+            // a restarted raw stream leaves the 8 byte gzip trailer to us
+            if (ret == Z_STREAM_END && total_in + (raw ? 8 : 0) < gz_size)
+            {
+                complete = false; // another gzip member follows, cached regions cannot inflate across its header
+                trailer = raw ? 8 : 0;
+                raw = false;
+                inflateReset2(&strm, 47);
+                ret = Z_OK;
+            }
+        } while (strm.avail_in != 0 && ret != Z_STREAM_END);
+    } while (ret != Z_STREAM_END);
+    inflateEnd(&strm);
+    if (ret != Z_STREAM_END)
+    {
+        std::cerr << "Corrupt gzip data in " << filename << std::endl;
+        return false;
+    }
+    index.total_out = total_out;
+    index.gz_size = gz_size;
+    index.gz_mtime = fileMtime(filename);
+    feeder.finish();
+    return true;
+}
+
+// Inflate the region from checkpoint i to the next one and keep its file data
+TextRegion inflateRegion(const std::string &filename, const ZranIndex &index, size_t i)
+{
+    const ZranPoint &point = index.points[i];
+    int64_t end_out = i + 1 < index.points.size() ? index.points[i + 1].out : index.total_out;
+    std::ifstream file(filename, std::ios::binary);
+    file.seekg(point.in - (point.bits ? 1 : 0));
+
+    z_stream strm{};
+    inflateInit2(&strm, -15); // raw deflate, the gzip header is behind us
+    if (point.bits)
+    {
+        inflatePrime(&strm, point.bits, file.get() >> (8 - point.bits));
+    }
+    if (point.out > 0)
+    {
+        inflateSetDictionary(&strm, point.window.data(), ZRAN_WINDOW);
+    }
+
+    std::vector<uint8_t> input(CHUNK_SIZE);
+    std::vector<uint8_t> output(end_out - point.out);
+    strm.next_out = output.data();
+    strm.avail_out = output.size();
+    while (strm.avail_out > 0)
+    {
+        if (strm.avail_in == 0)
+        {
+            file.read(reinterpret_cast<char *>(input.data()), input.size());
+            strm.avail_in = file.gcount();
+            strm.next_in = input.data();
+            if (strm.avail_in == 0)
+                break;
+        }
+        int ret = inflate(&strm, Z_NO_FLUSH);
+        if (ret != Z_OK && ret != Z_BUF_ERROR)
+            break;
+    }
+    if (strm.avail_out > 0)
+    {
+        std::cerr << "Checkpoint " << i << " of " << filename << " does not inflate, remove "
+                  << filename + ZRAN_INDEX_SUFFIX << std::endl;
+        exit(1);
+    }
+    inflateEnd(&strm);
+
+    TextRegion region;
+    region.text.reserve(output.size());
+    appendFileData(index.files, point.out, output.data(), output.size(), region.text);
+    splitRegion(region);
+    region.compressed_end = i + 1 < index.points.size() ? index.points[i + 1].in : index.gz_size;
+    return region;
+}
+
+// Feed the lines of a .tar.gz from start with threads inflating regions between cached checkpoints.
+// Without cached checkpoints the archive is read once sequentially and its checkpoints are saved
+bool inflateTarGzParallel(const std::string &filename, int threads, const LineHandler &on_line, const InputPosition &start)
+{
+    LineFeeder feeder(on_line);
+    ZranIndex index;
+    bool cached = loadZranIndex(filename, index);
+    size_t next_region = 0;
+    if (cached && start.point)
+    {
+        auto it = std::lower_bound(index.points.begin(), index.points.end(), start.point->point.out,
+                                   [](const ZranPoint &point, int64_t out)
+                                   { return point.out < out; });
+        cached = it != index.points.end() && it->out == start.point->point.out;
+        next_region = it - index.points.begin();
+    }
+    if (!cached)
+    {
+        std::cout << "Building inflate checkpoints for " << filename << std::endl;
+        bool complete = false;
+        if (!inflateSequential(filename, CHUNK_SIZE, index, feeder, true, complete, start))
+            return false;
+        if (complete)
+        {
+            saveZranIndex(filename, index);
+            std::cout << "Saved " << index.points.size() << " inflate checkpoints" << std::endl;
+        }
+        return true;
+    }
+
+    std::cout << "Inflating " << index.points.size() - next_region << " regions with " << threads << " threads" << std::endl;
+    std::deque<std::future<TextRegion>> pending; // regions in doc order, at most threads in flight
+    auto files = std::make_shared<const std::vector<std::pair<int64_t, int64_t>>>(index.files);
+    size_t region_index = next_region;
+    int64_t skip = start.offset;
+    int64_t counted_in = next_region > 0 ? index.points[next_region].in : 0;
+    auto launch = [&]()
+    {
+        pending.push_back(std::async(std::launch::async, inflateRegion, std::cref(filename), std::cref(index), next_region++));
+    };
+    while (next_region < index.points.size() && pending.size() < size_t(threads))
+        launch();
+    while (!pending.empty())
+    {
+        TextRegion region;
+        {
+            PhaseTimer timer(PHASE_INFLATE); // time the tokenizer waits for inflate
+            region = pending.front().get();
+        }
+        pending.pop_front();
+        if (next_region < index.points.size())
+            launch();
+        build_stats.uncompressed_bytes += region.text.size();
+        build_stats.compressed_bytes += region.compressed_end - counted_in;
+        counted_in = region.compressed_end;
+        region.point = std::make_shared<const ArchivePoint>(ArchivePoint{index.points[region_index++], -1, "", files});
+        skipText(region, skip);
+        if (!feeder.feed(region))
+        {
+            for (auto &future : pending)
+                future.wait();
+            return true;
+        }
+    }
+    feeder.finish();
+    return true;
+}
+
+// Feed the lines of the regular files in a .tar.gz inflated with zlib from start
+bool inflateTarGz(const std::string &filename, int chunk_size, const LineHandler &on_line, const InputPosition &start)
+{
+    ZranIndex index;
+    LineFeeder feeder(on_line);
+    bool complete;
+    return inflateSequential(filename, chunk_size, index, feeder, false, complete, start);
+}
+
+#ifdef HAVE_LIBARCHIVE
+// Feed the lines of the regular files in a .tar.gz read with libarchive, false if it cannot be opened.
+// libarchive cannot restart inside an archive, the positions handed on are not resumable
+bool readTarGz(const std::string &filename, int chunk_size, const LineHandler &on_line)
 {
+    const InputPosition unknown;
     struct archive *a;
     struct archive_entry *entry;
     int r;
@@ -220,22 +1026,19 @@ void processTarGz(const std::string &filename, int chunk_size)
     if (r != ARCHIVE_OK)
     {
         std::cerr << "Cannot open file: " << filename << ", error info: " << archive_error_string(a) << std::endl;
-        return;
+        return false;
     }
 
-    std::unordered_map<int, std::vector<std::pair<int, int>>> index;
-    std::unordered_map<std::string, LexiconInfo> lexicon;
-    std::unordered_map<int, std::pair<int, int64_t>> document_info;
-    std::unordered_map<int, std::string> term_id_to_word;
-    size_t current_memory_usage = 0;
-    int file_counter = 0;
-    int last_doc_id = 0;
-    int term_id = 0;
-    std::streamoff line_position = 0;
-
-    while (archive_read_next_header(a, &entry) == ARCHIVE_OK)
+    bool reading = true; // on_line wants more lines
+    int64_t counted_in = 0;
+    while (reading)
     {
-        if (archive_entry_filetype(entry) == AE_IFREG && last_doc_id < SMALL_DOC_TEST)
+        {
+            PhaseTimer timer(PHASE_INFLATE);
+            if (archive_read_next_header(a, &entry) != ARCHIVE_OK)
+                break;
+        }
+        if (archive_entry_filetype(entry) == AE_IFREG)
         {
             const char *currentFile = archive_entry_pathname(entry);
             size_t size = archive_entry_size(entry);
@@ -246,22 +1049,30 @@ void processTarGz(const std::string &filename, int chunk_size)
             size_t total_bytes_read = 0;
             std::string leftover; // for storing the remaining part of the last block
 
-            while (total_bytes_read < size && last_doc_id < SMALL_DOC_TEST)
+            while (total_bytes_read < size && reading)
             {
-                size_t bytesRead = archive_read_data(a, buffer.get(), chunk_size);
-                if (bytesRead < 0)
+                ssize_t bytesRead;
+                {
+                    PhaseTimer timer(PHASE_INFLATE);
+                    bytesRead = archive_read_data(a, buffer.get(), chunk_size);
+                }
+                if (bytesRead <= 0)
                 {
-                    std::cerr << "Error reading data from archive: " << archive_error_string(a) << std::endl;
+                    if (bytesRead < 0)
+                        std::cerr << "Error reading data from archive: " << archive_error_string(a) << std::endl;
                     break;
                 }
                 total_bytes_read += bytesRead;
+                build_stats.uncompressed_bytes += bytesRead;
+                build_stats.compressed_bytes += archive_filter_bytes(a, -1) - counted_in;
+                counted_in = archive_filter_bytes(a, -1);
 
                 std::string chunk(buffer.get(), bytesRead);
                 std::istringstream content(leftover + chunk);
                 std::string line;
                 leftover.clear();
 
-                while (std::getline(content, line) && last_doc_id < SMALL_DOC_TEST)
+                while (reading && std::getline(content, line))
                 {
                     if (content.eof() && line.back() != '\n')
                     {
@@ -269,57 +1080,598 @@ void processTarGz(const std::string &filename, int chunk_size)
                         leftover = line;
                         break;
                     }
-
-                    size_t memory_increment = processLine(line, document_info, index, lexicon, term_id_to_word, last_doc_id, term_id, line_position);
-                    line_position += line.size() + 1; // +1 for '\n'
-                    current_memory_usage += memory_increment;
-
-                    if (current_memory_usage > MEMORY_LIMIT || last_doc_id >= SMALL_DOC_TEST)
-                    {
-                        writeIndexToFile(index, term_id_to_word, file_counter++);
-                        index.clear();
-                        current_memory_usage = estimateMemoryUsage(index, lexicon, term_id_to_word, document_info);
-                    }
+                    reading = on_line(line, unknown);
                 }
             }
 
             // process the last incomplete line
-            if (!leftover.empty() && last_doc_id < SMALL_DOC_TEST)
+            if (!leftover.empty() && reading)
             {
-                size_t memory_increment = processLine(leftover, document_info, index, lexicon, term_id_to_word, last_doc_id, term_id, line_position);
-                current_memory_usage += memory_increment;
+                reading = on_line(leftover, unknown);
             }
 
             buffer.reset();
         }
     }
 
-    // process remaining data in index
-    if (!index.empty())
-    {
-        writeIndexToFile(index, term_id_to_word, file_counter++);
-    }
-
-    // write document info to file after processing all lines
-    writeDocumentInfoToFile(document_info);
-    std::cout << "document_info size: " << document_info.size() << std::endl;
-    document_info.clear();
-    index.clear();
-    current_memory_usage = estimateMemoryUsage(index, lexicon, term_id_to_word, document_info);
-
     archive_read_close(a);
     archive_read_free(a);
-
-    // external sort
-    std::cout << "total_term: " << term_id_to_word.size() << std::endl;
-    externalSort(file_counter, lexicon, term_id_to_word);
+    return true;
 }
 
-// Estimate memory usage
-size_t estimateMemoryUsage(const std::unordered_map<int, std::vector<std::pair<int, int>>> &index,
-                           const std::unordered_map<std::string, LexiconInfo> &lexicon,
-                           const std::unordered_map<int, std::string> &term_id_to_word,
-                           const std::unordered_map<int, std::pair<int, int64_t>> &document_info)
+#else
+// Feed the lines of the regular files in a .tar.gz, without libarchive the zlib reader is used
+bool readTarGz(const std::string &filename, int chunk_size, const LineHandler &on_line)
+{
+    return inflateTarGz(filename, chunk_size, on_line, InputPosition());
+}
+#endif
+
+// Feed the lines of a stream read in chunks, read_chunk returns 0 at the end and < 0 on errors.
+// Positions count lines, a stream cannot seek
+bool readChunked(const std::function<int64_t(char *, size_t)> &read_chunk, int chunk_size, const LineHandler &on_line)
+{
+    LineFeeder feeder(on_line, true);
+    TextRegion region;
+    std::vector<char> buffer(chunk_size);
+    while (true)
+    {
+        int64_t bytes_read;
+        {
+            PhaseTimer timer(PHASE_INFLATE);
+            bytes_read = read_chunk(buffer.data(), buffer.size());
+        }
+        if (bytes_read < 0)
+            return false;
+        if (bytes_read == 0)
+            break;
+        build_stats.uncompressed_bytes += bytes_read;
+        region.text.assign(buffer.data(), bytes_read);
+        splitRegion(region);
+        if (!feeder.feed(region))
+            return true;
+    }
+    feeder.finish();
+    return true;
+}
+
+// Feed the lines of a gzip compressed text file after the start.offset lines indexed before a restart.
+// gzread cannot seek without inflating, so the lines before are read again but not handed on
+bool readGz(const std::string &filename, int chunk_size, const LineHandler &on_line, const InputPosition &start)
+{
+    gzFile gz = gzopen(filename.c_str(), "rb");
+    if (gz == nullptr)
+    {
+        std::cerr << "Cannot open file: " << filename << std::endl;
+        return false;
+    }
+    gzbuffer(gz, chunk_size);
+    int64_t counted_in = 0;
+    bool read_ok = readChunked([&](char *buffer, size_t size)
+                               {
+                                   int64_t bytes_read = gzread(gz, buffer, size);
+                                   build_stats.compressed_bytes += gzoffset(gz) - counted_in;
+                                   counted_in = gzoffset(gz);
+                                   return bytes_read; },
+                               chunk_size, [&](const std::string &line, const InputPosition &next)
+                               { return next.offset <= start.offset || on_line(line, next); });
+    if (!read_ok)
+        std::cerr << "Error reading gzip data from " << filename << std::endl;
+    gzclose(gz);
+    return read_ok;
+}
+
+// Feed the lines of stdin
+bool readStdin(int chunk_size, const LineHandler &on_line)
+{
+    return readChunked([](char *buffer, size_t size)
+                       {
+                           size_t bytes_read = std::fread(buffer, 1, size, stdin);
+                           build_stats.compressed_bytes += bytes_read;
+                           return bytes_read == 0 && std::ferror(stdin) ? int64_t(-1) : int64_t(bytes_read); },
+                       chunk_size, on_line);
+}
+
+// Feed the lines of an uncompressed file from the byte offset of start. The file is mapped instead of
+// read, so data staged on a fast local disk goes straight from the page cache to the tokenizer
+bool readMapped(const std::string &filename, const LineHandler &on_line, const InputPosition &start)
+{
+    int fd = open(filename.c_str(), O_RDONLY);
+    struct stat file_stat;
+    if (fd < 0 || fstat(fd, &file_stat) != 0)
+    {
+        std::cerr << "Cannot open file: " << filename << std::endl;
+        if (fd >= 0)
+            close(fd);
+        return false;
+    }
+    size_t size = file_stat.st_size;
+    if (size == 0)
+    {
+        close(fd);
+        return true;
+    }
+    void *mapped = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapped == MAP_FAILED)
+    {
+        std::cerr << "Cannot map file: " << filename << std::endl;
+        return false;
+    }
+    madvise(mapped, size, MADV_SEQUENTIAL);
+
+    const char *data = static_cast<const char *>(mapped);
+    std::string line;
+    InputPosition next;
+    size_t begin = std::min<size_t>(start.offset, size);
+    size_t pos = begin;
+    while (pos < size)
+    {
+        const char *newline = static_cast<const char *>(std::memchr(data + pos, '\n', size - pos));
+        size_t end = newline ? newline - data : size;
+        next.offset = end + 1;
+        if (end > pos)
+        {
+            line.assign(data + pos, end - pos);
+            if (!on_line(line, next))
+                break;
+        }
+        pos = end + 1;
+    }
+    build_stats.compressed_bytes += std::min(pos, size) - begin;
+    build_stats.uncompressed_bytes += std::min(pos, size) - begin;
+    munmap(mapped, size);
+    return true;
+}
+
+// Feed the lines of one input from start: a .tar.gz (or .tgz), a gzip compressed text file, "-" for
+// stdin, or else an uncompressed text file. When the positions must be resumable a .tar.gz is read
+// with zlib, whose state can be restored
+bool readInput(const std::string &input, int chunk_size, int inflate_threads, const LineHandler &on_line,
+               const InputPosition &start, bool resumable)
+{
+    if (input == "-")
+        return readStdin(chunk_size, on_line);
+    if (input.ends_with(".tar.gz") || input.ends_with(".tgz"))
+    {
+        if (inflate_threads > 0)
+            return inflateTarGzParallel(input, inflate_threads, on_line, start);
+        return resumable ? inflateTarGz(input, chunk_size, on_line, start) : readTarGz(input, chunk_size, on_line);
+    }
+    if (input.ends_with(".gz"))
+        return readGz(input, chunk_size, on_line, start);
+    return readMapped(input, on_line, start);
+}
+
+// lines of one input with the positions after them
+using LineBatch = std::vector<std::pair<std::string, InputPosition>>;
+
+// LineQueue struct, batches of lines read ahead by the reader thread of one input
+struct LineQueue
+{
+    std::mutex mutex;
+    std::condition_variable changed;
+    std::deque<LineBatch> batches;
+    bool done = false;    // the reader finished
+    bool read_ok = true;  // the input was read without errors
+    bool stopped = false; // the consumer wants no more lines
+
+    // reader side, waits while the queue is full, false once the consumer stopped
+    bool push(LineBatch &&batch)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        changed.wait(lock, [this]()
+                     { return batches.size() < READ_AHEAD_BATCHES || stopped; });
+        if (stopped)
+            return false;
+        batches.push_back(std::move(batch));
+        changed.notify_all();
+        return true;
+    }
+
+    void finish(bool ok)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        done = true;
+        read_ok = ok;
+        changed.notify_all();
+    }
+
+    // consumer side, false once the input is exhausted
+    bool pop(LineBatch &batch)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        changed.wait(lock, [this]()
+                     { return !batches.empty() || done; });
+        if (batches.empty())
+            return false;
+        batch = std::move(batches.front());
+        batches.pop_front();
+        changed.notify_all();
+        return true;
+    }
+
+    void stop()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopped = true;
+        changed.notify_all();
+    }
+};
+
+// Read several inputs at once with one reader thread each, from start on. Lines are still handed on
+// input by input in argument order, so doc_ids are assigned in the same order on every run
+bool readInputs(const std::vector<std::string> &inputs, int chunk_size, int inflate_threads, const LineHandler &on_line,
+                const InputPosition &start, bool resumable)
+{
+    if (inputs.size() == 1)
+        return readInput(inputs[0], chunk_size, inflate_threads, on_line, start, resumable);
+
+    std::vector<LineQueue> queues(inputs.size());
+    std::vector<std::thread> readers;
+    for (size_t i = start.input; i < inputs.size(); ++i)
+    {
+        readers.emplace_back([&, i]()
+                             {
+                                 LineBatch batch;
+                                 LineHandler enqueue = [&](const std::string &line, const InputPosition &next)
+                                 {
+                                     batch.emplace_back(line, next);
+                                     if (batch.size() < LINE_BATCH_SIZE)
+                                         return true;
+                                     bool more = queues[i].push(std::move(batch));
+                                     batch.clear();
+                                     return more;
+                                 };
+                                 bool ok = readInput(inputs[i], chunk_size, inflate_threads, enqueue,
+                                                     i == size_t(start.input) ? start : InputPosition(), resumable);
+                                 if (!batch.empty())
+                                     queues[i].push(std::move(batch));
+                                 queues[i].finish(ok); });
+    }
+
+    bool read_ok = true;
+    bool reading = true;
+    LineBatch batch;
+    for (size_t i = start.input; i < inputs.size() && reading; ++i)
+    {
+        while (reading && queues[i].pop(batch))
+        {
+            for (size_t j = 0; j < batch.size() && reading; ++j)
+            {
+                batch[j].second.input = i;
+                reading = on_line(batch[j].first, batch[j].second);
+            }
+        }
+        if (reading)
+            read_ok = read_ok && queues[i].read_ok; // finished, pop saw done under the lock
+    }
+    for (auto &queue : queues)
+        queue.stop();
+    for (auto &reader : readers)
+        reader.join();
+    return read_ok;
+}
+
+// BuildCheckpoint struct, state of the ingestion saved after every spill so a crashed build can resume
+struct BuildCheckpoint
+{
+    std::string inputs;     // names, sizes and mtimes of the inputs, a checkpoint of other inputs is ignored
+    InputPosition position; // where the lines not indexed yet start
+    int last_doc_id = 0;    // doc_id high-water mark
+    int term_id = 0;
+    int doc_base = -1;
+    int64_t line_position = 0;
+    int docs_saved = 0;       // docs written to the docs file
+    int64_t docs_bytes = 0;   // size of the docs file, a longer file was cut short by a crash
+    bool ingest_done = false; // every input was read, only the external sort is left
+    std::vector<std::pair<int64_t, uint32_t>> runs; // size and CRC32 of every temp_index_N.bin
+};
+
+// one "name size mtime" line per input
+std::string inputSignature(const std::vector<std::string> &inputs)
+{
+    std::ostringstream signature;
+    signature << inputs.size() << "\n";
+    for (const auto &input : inputs)
+    {
+        std::error_code ec;
+        int64_t size = std::filesystem::file_size(input, ec);
+        signature << input << "\t" << (ec ? -1 : size) << "\t" << (ec ? -1 : fileMtime(input)) << "\n";
+    }
+    return signature.str();
+}
+
+uint32_t fileCrc32(const std::string &path)
+{
+    std::ifstream file(path, std::ios::binary);
+    std::vector<char> buffer(CHUNK_SIZE);
+    uLong crc = crc32(0L, Z_NULL, 0);
+    while (file.read(buffer.data(), buffer.size()) || file.gcount() > 0)
+    {
+        crc = crc32(crc, reinterpret_cast<const Bytef *>(buffer.data()), file.gcount());
+    }
+    return crc;
+}
+
+// "in bits out next_header header_size file_count" line, the files ending after out, then the window
+// and the partial tar header as raw bytes
+void writeArchivePoint(std::ostream &file, const ArchivePoint &archive)
+{
+    const ZranPoint &point = archive.point;
+    auto first = fileAfter(*archive.files, point.out);
+    file << point.in << " " << point.bits << " " << point.out << " " << archive.next_header << " "
+         << archive.header.size() << " " << archive.files->end() - first << "\n";
+    for (auto it = first; it != archive.files->end(); ++it)
+    {
+        file << it->first << " " << it->second << "\n";
+    }
+    file.write(reinterpret_cast<const char *>(point.window.data()), ZRAN_WINDOW);
+    file << archive.header << "\n";
+}
+
+bool readArchivePoint(std::istream &file, ArchivePoint &archive)
+{
+    ZranPoint &point = archive.point;
+    size_t header_size = 0;
+    size_t file_count = 0;
+    file >> point.in >> point.bits >> point.out >> archive.next_header >> header_size >> file_count;
+    std::vector<std::pair<int64_t, int64_t>> files(file_count);
+    for (auto &[offset, size] : files)
+    {
+        file >> offset >> size;
+    }
+    file.get(); // end of the line before the window
+    point.window.resize(ZRAN_WINDOW);
+    archive.header.resize(header_size);
+    file.read(reinterpret_cast<char *>(point.window.data()), ZRAN_WINDOW);
+    file.read(archive.header.data(), header_size);
+    archive.files = std::make_shared<const std::vector<std::pair<int64_t, int64_t>>>(std::move(files));
+    return bool(file);
+}
+
+// Persist the ingestion state after a spill. Docs indexed since the last checkpoint are appended to
+// the docs file, everything else goes to a new checkpoint file renamed over the old one, so a crash
+// at any point leaves a consistent checkpoint
+void saveCheckpoint(const std::string &output_dir, BuildCheckpoint &checkpoint,
+                    const std::unordered_map<std::string, LexiconInfo> &lexicon,
+                    const std::unordered_map<int, std::pair<int, int64_t>> &document_info)
+{
+    PhaseTimer timer(PHASE_SPILL);
+    std::string docs_path = output_dir + "/" + CHECKPOINT_DOCS_FILE;
+    std::ofstream docs(docs_path, std::ios::app);
+    for (int doc_id = checkpoint.docs_saved; doc_id < int(document_info.size()); ++doc_id)
+    {
+        const auto &[length, line_pos] = document_info.at(doc_id);
+        docs << doc_id << " " << length << " " << line_pos << "\n";
+    }
+    docs.close();
+    checkpoint.docs_saved = document_info.size();
+    checkpoint.docs_bytes = std::filesystem::file_size(docs_path);
+
+    std::string tmp_path = output_dir + "/" + CHECKPOINT_FILE + ".tmp";
+    std::ofstream file(tmp_path, std::ios::binary);
+    file << checkpoint.inputs
+         << checkpoint.last_doc_id << " " << checkpoint.term_id << " "
+         << checkpoint.doc_base << " " << checkpoint.line_position << " " << checkpoint.docs_saved << " "
+         << checkpoint.docs_bytes << " " << checkpoint.ingest_done << "\n";
+    file << checkpoint.runs.size() << "\n";
+    for (const auto &[size, crc] : checkpoint.runs)
+    {
+        file << size << " " << crc << "\n";
+    }
+    const InputPosition &position = checkpoint.position;
+    file << position.input << " " << position.offset << " " << bool(position.point) << "\n";
+    if (position.point)
+    {
+        writeArchivePoint(file, *position.point);
+    }
+    // dictionary snapshot, end_doc_id is where the gaps of the next run continue
+    for (const auto &[word, info] : lexicon)
+    {
+        file << word << " " << info.term_id << " " << info.end_doc_id << " " << info.posting_number << "\n";
+    }
+    file.close();
+    std::filesystem::rename(tmp_path, output_dir + "/" + CHECKPOINT_FILE);
+}
+
+// Load the checkpoint of an interrupted build of the same inputs. False if there is none, or if a
+// run fails its size or CRC32 check, the build then starts over
+bool loadCheckpoint(const std::string &output_dir, BuildCheckpoint &checkpoint,
+                    std::unordered_map<std::string, LexiconInfo> &lexicon,
+                    std::unordered_map<int, std::string> &term_id_to_word,
+                    std::unordered_map<int, std::pair<int, int64_t>> &document_info)
+{
+    std::ifstream file(output_dir + "/" + CHECKPOINT_FILE, std::ios::binary);
+    if (!file.is_open())
+        return false;
+    std::string inputs;
+    std::string line;
+    std::getline(file, line);
+    inputs = line + "\n";
+    for (int i = 0, count = std::atoi(line.c_str()); i < count && std::getline(file, line); ++i)
+    {
+        inputs += line + "\n";
+    }
+    if (inputs != checkpoint.inputs)
+    {
+        std::cout << "Ignoring the checkpoint of a build with other inputs" << std::endl;
+        return false;
+    }
+
+    BuildCheckpoint loaded;
+    loaded.inputs = checkpoint.inputs;
+    size_t run_count = 0;
+    file >> loaded.last_doc_id >> loaded.term_id >> loaded.doc_base >> loaded.line_position >>
+        loaded.docs_saved >> loaded.docs_bytes >> loaded.ingest_done >> run_count;
+    loaded.runs.resize(run_count);
+    for (auto &[size, crc] : loaded.runs)
+    {
+        file >> size >> crc;
+    }
+    bool archive = false;
+    file >> loaded.position.input >> loaded.position.offset >> archive;
+    if (archive)
+    {
+        auto point = std::make_shared<ArchivePoint>();
+        readArchivePoint(file, *point);
+        loaded.position.point = std::move(point);
+    }
+    if (!file)
+        return false;
+    for (size_t i = 0; i < run_count; ++i)
+    {
+        std::string run_path = output_dir + "/temp_index_" + std::to_string(i) + ".bin";
+        std::error_code ec;
+        if (std::filesystem::file_size(run_path, ec) != uint64_t(loaded.runs[i].first) || ec ||
+            fileCrc32(run_path) != loaded.runs[i].second)
+        {
+            std::cerr << "Run " << run_path << " is damaged, starting the build over" << std::endl;
+            return false;
+        }
+    }
+
+    std::string docs_path = output_dir + "/" + CHECKPOINT_DOCS_FILE;
+    std::error_code ec;
+    if (std::filesystem::file_size(docs_path, ec) < uint64_t(loaded.docs_bytes) || ec)
+        return false;
+    std::filesystem::resize_file(docs_path, loaded.docs_bytes); // drop docs written after the checkpoint
+    std::ifstream docs(docs_path);
+    int doc_id, length;
+    int64_t line_pos;
+    while (docs >> doc_id >> length >> line_pos)
+    {
+        document_info[doc_id] = {length, line_pos};
+    }
+
+    std::string word;
+    LexiconInfo info{};
+    while (file >> word >> info.term_id >> info.end_doc_id >> info.posting_number)
+    {
+        lexicon[word] = info;
+        term_id_to_word[info.term_id] = word;
+    }
+    checkpoint = loaded;
+    return true;
+}
+
+// Process the inputs into an index in output_dir, doc_base < 0 takes the first doc_id as base, returns the number of docs.
+// inflate_threads > 0 reads .tar.gz inputs with zlib from cached checkpoints
+int processInputs(const std::vector<std::string> &inputs, int chunk_size, const std::string &output_dir, int &doc_base,
+                  int inflate_threads = 0)
+{
+    std::unordered_map<int, std::vector<std::pair<int, int>>> index;
+    std::unordered_map<std::string, LexiconInfo> lexicon;
+    std::unordered_map<int, std::pair<int, int64_t>> document_info;
+    std::unordered_map<int, std::string> term_id_to_word;
+    size_t current_memory_usage = 0;
+    int file_counter = 0;
+    int last_doc_id = 0;
+    int term_id = 0;
+    std::streamoff line_position = 0;
+
+    // a build reading stdin cannot be resumed, the input is gone
+    bool checkpoints = std::find(inputs.begin(), inputs.end(), "-") == inputs.end();
+    BuildCheckpoint checkpoint;
+    if (checkpoints)
+    {
+        checkpoint.inputs = inputSignature(inputs);
+        if (loadCheckpoint(output_dir, checkpoint, lexicon, term_id_to_word, document_info))
+        {
+            file_counter = checkpoint.runs.size();
+            last_doc_id = checkpoint.last_doc_id;
+            term_id = checkpoint.term_id;
+            doc_base = checkpoint.doc_base;
+            line_position = checkpoint.line_position;
+            for (const auto &[size, crc] : checkpoint.runs)
+            {
+                build_stats.run_sizes.push_back(size);
+                build_stats.run_size_hist[log2Bucket(size)]++;
+            }
+            build_stats.docs += document_info.size();
+            for (const auto &[word, info] : lexicon)
+            {
+                build_stats.postings += info.posting_number;
+            }
+            std::cout << "Resuming from checkpoint: " << file_counter << " runs, "
+                      << (checkpoint.ingest_done ? "input complete" : "at " + inputs[checkpoint.position.input]) << std::endl;
+        }
+        else
+        {
+            std::filesystem::remove(output_dir + "/" + CHECKPOINT_DOCS_FILE);
+        }
+    }
+    InputPosition start = checkpoint.position;
+
+    // write a run, then checkpoint everything indexed up to next, the position after the last line
+    auto spill = [&](const InputPosition &next)
+    {
+        uint32_t crc = writeIndexToFile(index, term_id_to_word, file_counter++, output_dir);
+        checkpoint.runs.emplace_back(build_stats.run_sizes.back(), crc);
+        index.clear();
+        if (checkpoints)
+        {
+            checkpoint.position = next;
+            checkpoint.last_doc_id = last_doc_id;
+            checkpoint.term_id = term_id;
+            checkpoint.doc_base = doc_base;
+            checkpoint.line_position = line_position;
+            saveCheckpoint(output_dir, checkpoint, lexicon, document_info);
+        }
+    };
+
+    // index one line, spilling a run when memory runs out. Returns false once enough docs were read
+    LineHandler handle_line = [&](const std::string &line, const InputPosition &next)
+    {
+        size_t memory_increment = processLine(line, document_info, index, lexicon, term_id_to_word, last_doc_id, term_id, line_position, doc_base);
+        line_position += line.size() + 1; // +1 for '\n'
+        current_memory_usage += memory_increment;
+        build_stats.peak_index_memory = std::max(build_stats.peak_index_memory, current_memory_usage);
+        reportProgress();
+
+        if (current_memory_usage > MEMORY_LIMIT || last_doc_id >= SMALL_DOC_TEST)
+        {
+            spill(next);
+            current_memory_usage = estimateMemoryUsage(index, lexicon, term_id_to_word, document_info);
+        }
+        return last_doc_id < SMALL_DOC_TEST;
+    };
+
+    if (!checkpoint.ingest_done && !readInputs(inputs, chunk_size, inflate_threads, handle_line, start, checkpoints))
+        return 0;
+
+    // process remaining data in index
+    if (!index.empty())
+    {
+        checkpoint.ingest_done = true;
+        spill(checkpoint.position);
+    }
+
+    // write document info to file after processing all lines
+    writeDocumentInfoToFile(document_info, output_dir);
+    int doc_count = document_info.size();
+    std::cout << "document_info size: " << document_info.size() << std::endl;
+    document_info.clear();
+    index.clear();
+    current_memory_usage = estimateMemoryUsage(index, lexicon, term_id_to_word, document_info);
+
+    // external sort
+    std::cout << "total_term: " << term_id_to_word.size() << std::endl;
+    reportProgress(true);
+    build_stats.current_stage = "merge";
+    externalSort(file_counter, lexicon, term_id_to_word, output_dir);
+    std::filesystem::remove(output_dir + "/" + CHECKPOINT_FILE);
+    std::filesystem::remove(output_dir + "/" + CHECKPOINT_DOCS_FILE);
+    build_stats.current_stage = "done";
+    reportProgress(true);
+    return doc_count;
+}
+
+// Estimate memory usage
+size_t estimateMemoryUsage(const std::unordered_map<int, std::vector<std::pair<int, int>>> &index,
+                           const std::unordered_map<std::string, LexiconInfo> &lexicon,
+                           const std::unordered_map<int, std::string> &term_id_to_word,
+                           const std::unordered_map<int, std::pair<int, int64_t>> &document_info)
 {
     size_t usage = 0;
     for (const auto &[term_id, postings] : index)
@@ -330,10 +1682,7 @@ size_t estimateMemoryUsage(const std::unordered_map<int, std::vector<std::pair<i
     {
         usage += word.capacity() + sizeof(LexiconInfo);
     }
-    for (const auto &[doc_id, pair] : document_info)
-    {
-        usage += sizeof(int) + sizeof(std::pair<int, int64_t>);
-    }
+    usage += document_info.size() * (sizeof(int) + sizeof(std::pair<int, int64_t>));
     for (const auto &[term_id, word] : term_id_to_word)
     {
         usage += word.capacity() + sizeof(std::string);
@@ -354,23 +1703,27 @@ std::vector<uint8_t> varbyteEncode(uint32_t number)
     return bytes;
 }
 
-// Varbyte decode function
-uint32_t varbyteDecode(const std::vector<uint8_t> &bytes)
+// Varbyte decode from a buffer, advances pos
+uint32_t varbyteDecode(const uint8_t *data, size_t &pos)
 {
     uint32_t number = 0;
-    for (int i = bytes.size() - 1; i >= 0; --i)
+    int shift = 0;
+    while (data[pos] & 128)
     {
-        number = (number << 7) | (bytes[i] & 127);
+        number |= (data[pos++] & 127) << shift;
+        shift += 7;
     }
+    number |= data[pos++] << shift;
     return number;
 }
 
 // Write index to file
-void writeIndexToFile(const std::unordered_map<int, std::vector<std::pair<int, int>>> &index,
-                      const std::unordered_map<int, std::string> &term_id_to_word,
-                      int file_number)
+uint32_t writeIndexToFile(const std::unordered_map<int, std::vector<std::pair<int, int>>> &index,
+                          const std::unordered_map<int, std::string> &term_id_to_word,
+                          int file_number, const std::string &output_dir)
 {
-    std::string filename = "temp_index_" + std::to_string(file_number) + ".bin";
+    PhaseTimer timer(PHASE_SPILL);
+    std::string filename = output_dir + "/temp_index_" + std::to_string(file_number) + ".bin";
     std::ofstream outfile(filename, std::ios::binary);
 
     std::vector<int> sorted_term_ids;
@@ -385,34 +1738,43 @@ void writeIndexToFile(const std::unordered_map<int, std::vector<std::pair<int, i
                   return term_id_to_word.at(a) < term_id_to_word.at(b);
               });
 
+    uLong crc = crc32(0L, Z_NULL, 0);
+    std::vector<uint8_t> buffer; // encoded entry of one term
     for (const int term_id : sorted_term_ids)
     {
         // encode term_id
-        auto encoded_term_id = varbyteEncode(term_id);
-        outfile.write(reinterpret_cast<const char *>(encoded_term_id.data()), encoded_term_id.size());
+        buffer = varbyteEncode(term_id);
 
         // encode postings count
         const auto &postings = index.at(term_id);
         auto encoded_size = varbyteEncode(postings.size());
-        outfile.write(reinterpret_cast<const char *>(encoded_size.data()), encoded_size.size());
+        buffer.insert(buffer.end(), encoded_size.begin(), encoded_size.end());
 
         // encode postings
         for (const auto &[diff, count] : postings)
         {
             auto encoded_diff = varbyteEncode(diff);
             auto encoded_count = varbyteEncode(count);
-            outfile.write(reinterpret_cast<const char *>(encoded_diff.data()), encoded_diff.size());
-            outfile.write(reinterpret_cast<const char *>(encoded_count.data()), encoded_count.size());
+            buffer.insert(buffer.end(), encoded_diff.begin(), encoded_diff.end());
+            buffer.insert(buffer.end(), encoded_count.begin(), encoded_count.end());
         }
+        outfile.write(reinterpret_cast<const char *>(buffer.data()), buffer.size());
+        crc = crc32(crc, buffer.data(), buffer.size());
     }
     sorted_term_ids.clear();
+    int64_t run_size = outfile.tellp();
     outfile.close();
+
+    build_stats.run_sizes.push_back(run_size);
+    build_stats.run_size_hist[log2Bucket(run_size)]++;
+    return crc;
 }
 
 // Write document info to file
-void writeDocumentInfoToFile(const std::unordered_map<int, std::pair<int, int64_t>> &document_info)
+void writeDocumentInfoToFile(const std::unordered_map<int, std::pair<int, int64_t>> &document_info,
+                             const std::string &output_dir)
 {
-    std::ofstream outfile("document_info.txt");
+    std::ofstream outfile(output_dir + "/" + DOC_INFO_FILE);
     int max_doc_id = document_info.size() - 1;
     for (int doc_id = 0; doc_id <= max_doc_id; ++doc_id)
     {
@@ -422,10 +1784,211 @@ void writeDocumentInfoToFile(const std::unordered_map<int, std::pair<int, int64_
     outfile.close();
 }
 
+// EncodedList struct, one list in its final encoding
+struct EncodedList
+{
+    std::vector<uint8_t> bytes;
+    std::vector<std::pair<int, int64_t>> blocks; // last doc_id and size in bytes of every block
+    int list_type = LIST_BLOCKS;
+};
+
+// a list of at least one block is dense enough for a bitmap once its words take fewer bytes than the gaps
+bool bitmapIsSmaller(const std::vector<std::pair<int, int>> &postings, int block_size)
+{
+    if (postings.size() < size_t(block_size))
+        return false;
+    int64_t gap_bytes = 0;
+    int prev_doc_id = 0;
+    for (const auto &[doc_id, count] : postings)
+    {
+        gap_bytes += varbyteEncodedSize(doc_id - prev_doc_id);
+        prev_doc_id = doc_id;
+    }
+    int64_t words = postings.back().first / 64 - postings.front().first / 64 + 1;
+    return words * int64_t(sizeof(uint64_t)) < gap_bytes;
+}
+
+// Encode the (doc_id, count) postings of one list. Blocks of block_size postings hold all doc_id
+// gaps, then all counts, then the second term's counts of a pair list. A bitmap list is one block:
+// varbyte first word and word count, the 64 bit words covering the doc_ids of the list, then the
+// varbyte counts in doc_id order. Words line up with the live docs words
+EncodedList encodeList(const std::vector<std::pair<int, int>> &postings, const std::vector<int> &pair_counts, int block_size)
+{
+    EncodedList list;
+    if (!pair_counts.empty())
+        list.list_type = LIST_PAIR;
+    else if (bitmapIsSmaller(postings, block_size))
+        list.list_type = LIST_BITMAP;
+
+    if (list.list_type == LIST_BITMAP)
+    {
+        int first_word = postings.front().first / 64;
+        int num_words = postings.back().first / 64 - first_word + 1;
+        appendVarbyte(list.bytes, first_word);
+        appendVarbyte(list.bytes, num_words);
+        size_t words_start = list.bytes.size();
+        list.bytes.resize(words_start + num_words * sizeof(uint64_t));
+        std::vector<uint64_t> words(num_words, 0);
+        for (const auto &[doc_id, count] : postings)
+            words[doc_id / 64 - first_word] |= uint64_t(1) << (doc_id % 64);
+        std::memcpy(list.bytes.data() + words_start, words.data(), num_words * sizeof(uint64_t));
+        for (const auto &[doc_id, count] : postings)
+            appendVarbyte(list.bytes, count);
+        list.blocks.emplace_back(postings.back().first, list.bytes.size());
+        return list;
+    }
+
+    int prev_doc_id = 0;
+    for (size_t first = 0; first < postings.size(); first += block_size)
+    {
+        size_t end = std::min(postings.size(), first + block_size);
+        size_t block_start = list.bytes.size();
+        for (size_t i = first; i < end; ++i)
+        {
+            appendVarbyte(list.bytes, postings[i].first - prev_doc_id);
+            prev_doc_id = postings[i].first;
+        }
+        for (size_t i = first; i < end; ++i)
+            appendVarbyte(list.bytes, postings[i].second);
+        if (!pair_counts.empty())
+        {
+            for (size_t i = first; i < end; ++i)
+                appendVarbyte(list.bytes, pair_counts[i]);
+        }
+        list.blocks.emplace_back(prev_doc_id, list.bytes.size() - block_start);
+    }
+    return list;
+}
+
+// PostingsWriter struct, writes encoded lists together with the lexicon, block info and format
+// header. Index bytes are buffered and written in large pieces that end on WRITE_ALIGNMENT boundaries
+struct PostingsWriter
+{
+    std::string output_dir;
+    IndexFormat format;
+    std::ofstream index_file;
+    std::ofstream lexicon_file;
+    std::ofstream block_info_file;
+    std::ofstream block_info_text;
+    std::vector<std::pair<int, int64_t>> block_info; // store last_doc_id and block size(bytes)
+    std::vector<std::pair<int, int>> term_postings;  // doc_id and count of the current list
+    std::vector<int> term_pair_counts;               // second term's counts of a pair list, empty otherwise
+    std::vector<uint8_t> write_buffer;               // index bytes not written yet
+    int64_t current_position = 0;
+    int last_doc_id = 0;
+
+    PostingsWriter(const std::string &output_dir, const IndexFormat &format)
+        : output_dir(output_dir), format(format), index_file(output_dir + "/" + INDEX_FILE, std::ios::binary),
+          lexicon_file(output_dir + "/" + LEXICON_FILE),
+          block_info_file(output_dir + "/" + BLOCK_INFO_FILE, std::ios::binary)
+    {
+        if (debug_dumps)
+            block_info_text.open(output_dir + "/" + BLOCK_INFO_TEXT_FILE);
+        write_buffer.reserve(WRITE_BUFFER_SIZE + WRITE_ALIGNMENT);
+    }
+
+    // every list starts on its own block
+    void startTerm()
+    {
+        last_doc_id = 0;
+        term_postings.clear();
+        term_pair_counts.clear();
+    }
+
+    // postings are buffered until finishTerm, the list type depends on the whole list
+    void addPosting(int diff, int count)
+    {
+        last_doc_id += diff;
+        term_postings.emplace_back(last_doc_id, count);
+    }
+
+    // posting of a pair list, with the counts of both terms
+    void addPairPosting(int diff, int count, int pair_count)
+    {
+        addPosting(diff, count);
+        term_pair_counts.push_back(pair_count);
+    }
+
+    // write the list and its lexicon entry
+    void finishTerm(const std::string &word, LexiconInfo &info)
+    {
+        writeList(word, info, encodeList(term_postings, term_pair_counts, format.block_size));
+    }
+
+    // write a list encoded elsewhere, lists are laid out in the order they are written
+    void writeList(const std::string &word, LexiconInfo &info, const EncodedList &list)
+    {
+        info.list_type = list.list_type;
+        info.start_position = current_position;
+        info.bytes_size = list.bytes.size();
+        for (const auto &[block_last_doc_id, block_size] : list.blocks)
+        {
+            block_info.emplace_back(block_last_doc_id, block_size);
+            if (debug_dumps)
+                block_info_text << block_last_doc_id << " " << block_size << "\n";
+            build_stats.blocks++;
+            build_stats.block_size_hist[log2Bucket(block_size)]++;
+        }
+        write_buffer.insert(write_buffer.end(), list.bytes.begin(), list.bytes.end());
+        current_position += list.bytes.size();
+        if (write_buffer.size() >= WRITE_BUFFER_SIZE)
+            flushBuffer(false);
+        lexicon_file << word << " "
+                     << info.term_id << " "
+                     << info.posting_number << " "
+                     << info.start_position << " "
+                     << info.bytes_size << " "
+                     << info.list_type << "\n";
+    }
+
+    // write the buffered bytes up to the last alignment boundary, or all of them at the end
+    void flushBuffer(bool all)
+    {
+        int64_t buffered_start = current_position - write_buffer.size();
+        size_t size = all ? write_buffer.size() : (current_position / WRITE_ALIGNMENT * WRITE_ALIGNMENT) - buffered_start;
+        index_file.write(reinterpret_cast<const char *>(write_buffer.data()), size);
+        write_buffer.erase(write_buffer.begin(), write_buffer.begin() + size);
+    }
+
+    void close()
+    {
+        flushBuffer(true);
+        // write the block info into the file
+        block_info_file.write(reinterpret_cast<const char *>(block_info.data()), block_info.size() * sizeof(std::pair<int, int64_t>));
+        build_stats.index_bytes += current_position;
+
+        index_file.close();
+        lexicon_file.close();
+        block_info_file.close();
+        block_info_text.close();
+        writeIndexFormat(output_dir, format);
+    }
+};
+
+// EncodeBatch struct, consecutive merged lists handed to one encoder thread
+struct EncodeBatch
+{
+    std::vector<std::string> words;
+    std::vector<std::vector<std::pair<int, int>>> postings; // doc_id and count, freed once encoded
+    std::vector<EncodedList> lists;
+};
+
+EncodeBatch encodeBatch(EncodeBatch batch)
+{
+    PhaseTimer timer(PHASE_ENCODE);
+    for (auto &postings : batch.postings)
+    {
+        batch.lists.push_back(encodeList(postings, {}, build_format.block_size));
+        std::vector<std::pair<int, int>>().swap(postings);
+    }
+    return batch;
+}
+
 // External sort
 void externalSort(int num_files,
                   std::unordered_map<std::string, LexiconInfo> &lexicon,
-                  const std::unordered_map<int, std::string> &term_id_to_word)
+                  const std::unordered_map<int, std::string> &term_id_to_word,
+                  const std::string &output_dir)
 {
     CompareIndexEntry comparator(&term_id_to_word);
     std::priority_queue<IndexEntry, std::vector<IndexEntry>, CompareIndexEntry> pq(comparator);
@@ -433,10 +1996,10 @@ void externalSort(int num_files,
 
     for (int i = 0; i < num_files; ++i)
     {
-        files[i].open("temp_index_" + std::to_string(i) + ".bin", std::ios::binary);
+        files[i].open(output_dir + "/temp_index_" + std::to_string(i) + ".bin", std::ios::binary);
         if (files[i].is_open())
         {
-            IndexEntry entry = readNextEntry(files[i], i, term_id_to_word);
+            IndexEntry entry = readNextEntry(files[i], i);
             if (entry.term_id != -1)
             {
                 pq.push(std::move(entry));
@@ -444,106 +2007,90 @@ void externalSort(int num_files,
         }
     }
 
-    std::ofstream final_index_file("final_sorted_index.bin", std::ios::binary);
-    std::ofstream final_index_file2("final_sorted_index2.txt"); // for debug
-    std::ofstream final_lexicon_file("final_sorted_lexicon.txt");
-    std::ofstream final_block_info("final_sorted_block_info.bin", std::ios::binary);
-    std::ofstream final_block_info2("final_sorted_block_info2.txt"); // for debug
+    PostingsWriter writer(output_dir, build_format);
+    std::ofstream final_index_file2;
+    if (debug_dumps)
+        final_index_file2.open(output_dir + "/" + INDEX_TEXT_FILE);
+
+    // merged lists are encoded in batches by worker threads and written in term order
+    int encode_threads = std::max(1u, std::thread::hardware_concurrency());
+    std::deque<std::future<EncodeBatch>> pending; // batches in term order, at most encode_threads in flight
+    EncodeBatch batch;
+    int64_t batch_postings = 0;
+    auto writeFront = [&]()
+    {
+        EncodeBatch done;
+        {
+            PhaseTimer timer(PHASE_ENCODE); // time the merge waits for the encoders
+            done = pending.front().get();
+        }
+        pending.pop_front();
+        for (size_t i = 0; i < done.words.size(); ++i)
+            writer.writeList(done.words[i], lexicon[done.words[i]], done.lists[i]);
+    };
+    auto launch = [&]()
+    {
+        if (pending.size() >= size_t(encode_threads))
+            writeFront();
+        pending.push_back(std::async(std::launch::async, encodeBatch, std::move(batch)));
+        batch = EncodeBatch();
+        batch_postings = 0;
+    };
 
-    int64_t current_position = 0;
     int current_term_id = -1;
     int last_doc_id = 0;
 
-    const int POSTING_PER_BLOCK = 128;
-    std::vector<std::pair<int, int64_t>> block_info; // store last_doc_id and block size(bytes)
-    std::vector<uint8_t> merged_doc_ids;
-    std::vector<uint8_t> merged_counts;
-    int postings_in_block = 0; // track number of postings in the current block
-
     while (!pq.empty())
     {
-        auto top = pq.top();
+        auto phase_start = BuildStats::Clock::now();
+        // the top is moved out, pop only moves it to the back of the heap before dropping it
+        IndexEntry top = std::move(const_cast<IndexEntry &>(pq.top()));
         pq.pop();
 
         if (current_term_id != top.term_id) // new term
         {
-            if (current_term_id != -1) // not the first term
-            {
-                lexicon[term_id_to_word.at(current_term_id)].bytes_size =
-                    current_position - lexicon[term_id_to_word.at(current_term_id)].start_position;
-
-                final_lexicon_file << term_id_to_word.at(current_term_id) << " "
-                                   << current_term_id << " "
-                                   << lexicon[term_id_to_word.at(current_term_id)].posting_number << " "
-                                   << lexicon[term_id_to_word.at(current_term_id)].start_position << " "
-                                   << lexicon[term_id_to_word.at(current_term_id)].bytes_size << "\n";
-            }
-
-            lexicon[term_id_to_word.at(top.term_id)].start_position = current_position;
+            if (batch_postings >= ENCODE_BATCH_POSTINGS)
+                launch();
+            batch.words.push_back(term_id_to_word.at(top.term_id));
+            batch.postings.emplace_back();
             current_term_id = top.term_id;
             last_doc_id = 0;
+            build_stats.terms_merged++;
+            reportProgress();
+        }
+        if (debug_dumps)
+        {
+            final_index_file2 << top.term_id << " " << top.postings.size() << " ";
+            for (const auto &[diff, count] : top.postings)
+                final_index_file2 << diff << " " << count << " ";
+            final_index_file2 << "\n";
         }
-        final_index_file2 << top.term_id << " " << top.postings.size() << " ";
+        auto &postings = batch.postings.back();
         for (const auto &[diff, count] : top.postings)
         {
-            final_index_file2 << diff << " " << count << " ";
-            auto encoded_diff = varbyteEncode(diff);
-            auto encoded_count = varbyteEncode(count);
-
-            // add encoded_diff and encoded_count to buffers
-            merged_doc_ids.insert(merged_doc_ids.end(), encoded_diff.begin(), encoded_diff.end());
-            merged_counts.insert(merged_counts.end(), encoded_count.begin(), encoded_count.end());
-
-            // update current position
-            current_position += encoded_diff.size() + encoded_count.size();
             last_doc_id += diff;
-            postings_in_block++; // increment postings count
-
-            // check if need to write new block
-            if (postings_in_block == POSTING_PER_BLOCK)
-            {
-                // add buffer to final_index_file
-                final_index_file.write(reinterpret_cast<const char *>(merged_doc_ids.data()), merged_doc_ids.size()); // writing 128 doc_ids
-                final_index_file.write(reinterpret_cast<const char *>(merged_counts.data()), merged_counts.size());   // writing 128 counts
-                int current_block_size = merged_doc_ids.size() + merged_counts.size();
-                block_info.emplace_back(last_doc_id, current_block_size); // store the last doc_id and the block size
-                final_block_info2 << last_doc_id << " " << current_block_size << "\n";
-
-                // clear buffer and reset postings count
-                merged_doc_ids.clear();
-                merged_counts.clear();
-                postings_in_block = 0;
-            }
+            postings.emplace_back(last_doc_id, count);
         }
-        final_index_file2 << "\n";
+        batch_postings += top.postings.size();
 
         // when need to reposition the file pointer
         files[top.file_index].seekg(top.file_position);
-        IndexEntry entry = readNextEntry(files[top.file_index], top.file_index, term_id_to_word);
+        IndexEntry entry = readNextEntry(files[top.file_index], top.file_index);
         if (entry.term_id != -1)
         {
             pq.push(std::move(entry));
         }
+        addPhaseTime(PHASE_MERGE, phase_start);
     }
 
-    // process the last block
-    if (postings_in_block > 0)
-    {
-        final_index_file.write(reinterpret_cast<const char *>(merged_doc_ids.data()), merged_doc_ids.size());
-        final_index_file.write(reinterpret_cast<const char *>(merged_counts.data()), merged_counts.size());
-        int current_block_size = merged_doc_ids.size() + merged_counts.size();
-        block_info.emplace_back(last_doc_id, current_block_size);
-        final_block_info2 << last_doc_id << " " << current_block_size << "\n";
-    }
-
-    // write the last block info into the file
-    final_block_info.write(reinterpret_cast<const char *>(block_info.data()), block_info.size() * sizeof(std::pair<int, int64_t>));
+    // encode the last batch and write everything still in flight
+    if (!batch.words.empty())
+        launch();
+    while (!pending.empty())
+        writeFront();
 
-    final_index_file.close();
-    final_lexicon_file.close();
-    final_block_info.close();
+    writer.close();
     final_index_file2.close();
-    final_block_info2.close();
     for (auto &file : files)
     {
         file.close();
@@ -552,12 +2099,12 @@ void externalSort(int num_files,
     // delete temp files
     for (int i = 0; i < num_files; ++i)
     {
-        std::remove(("temp_index_" + std::to_string(i) + ".bin").c_str());
+        std::remove((output_dir + "/temp_index_" + std::to_string(i) + ".bin").c_str());
     }
 }
 
 // read next entry
-IndexEntry readNextEntry(std::ifstream &file, int file_index, const std::unordered_map<int, std::string> &term_id_to_word)
+IndexEntry readNextEntry(std::ifstream &file, int file_index)
 {
     std::vector<uint8_t> buffer;
     uint8_t byte;
@@ -614,16 +2161,1286 @@ IndexEntry readNextEntry(std::ifstream &file, int file_index, const std::unorder
     return {term_id, file_index, file.tellg(), std::move(postings)};
 }
 
+// SegmentInfo struct, one line of the segment manifest
+struct SegmentInfo
+{
+    std::string name;
+    int doc_base;
+    int doc_count;
+};
+
+// lock a file in the index directory, returns the fd to close for unlocking, -1 if busy
+int lockFile(const std::string &path, bool wait)
+{
+    int fd = open(path.c_str(), O_CREAT | O_RDWR, 0644);
+    if (fd < 0)
+    {
+        std::cerr << "Cannot open lock file: " << path << std::endl;
+        exit(1);
+    }
+    if (flock(fd, LOCK_EX | (wait ? 0 : LOCK_NB)) != 0)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Read the live segments of an index directory, ordered by doc_base
+std::vector<SegmentInfo> readManifest(const std::string &index_dir)
+{
+    std::vector<SegmentInfo> segments;
+    std::ifstream manifest(index_dir + "/" + SEGMENT_MANIFEST);
+    SegmentInfo info;
+    while (manifest >> info.name >> info.doc_base >> info.doc_count)
+    {
+        segments.push_back(info);
+    }
+    std::sort(segments.begin(), segments.end(),
+              [](const SegmentInfo &a, const SegmentInfo &b)
+              { return a.doc_base < b.doc_base; });
+    return segments;
+}
+
+// Replace the manifest atomically, readers either see the old or the new segment list
+void writeManifest(const std::string &index_dir, const std::vector<SegmentInfo> &segments)
+{
+    std::string tmp_name = index_dir + "/" + SEGMENT_MANIFEST + ".tmp";
+    std::ofstream manifest(tmp_name);
+    for (const auto &segment : segments)
+    {
+        manifest << segment.name << " " << segment.doc_base << " " << segment.doc_count << "\n";
+    }
+    manifest.close();
+    std::filesystem::rename(tmp_name, index_dir + "/" + SEGMENT_MANIFEST);
+}
+
+// Pick an unused segment name and create its "<name>.tmp" build directory
+std::string newSegmentName(const std::string &index_dir)
+{
+    int max_id = -1;
+    for (const auto &dir_entry : std::filesystem::directory_iterator(index_dir))
+    {
+        std::string name = dir_entry.path().filename().string();
+        if (name.rfind("seg_", 0) == 0)
+        {
+            max_id = std::max(max_id, std::atoi(name.c_str() + 4));
+        }
+    }
+    // create_directory fails if a concurrent builder took the name first
+    while (!std::filesystem::create_directory(index_dir + "/seg_" + std::to_string(max_id + 1) + ".tmp"))
+    {
+        max_id++;
+    }
+    return "seg_" + std::to_string(max_id + 1);
+}
+
+// Publish a finished segment directory by adding it to the manifest, the caller holds MANIFEST_LOCK
+void publishSegment(const std::string &index_dir, const std::string &tmp_dir, const SegmentInfo &info,
+                    const std::vector<SegmentInfo> &replaced)
+{
+    std::ofstream segment_info(tmp_dir + "/" + SEGMENT_INFO_FILE);
+    segment_info << info.doc_base << " " << info.doc_count << "\n";
+    segment_info.close();
+    std::filesystem::rename(tmp_dir, index_dir + "/" + info.name);
+
+    std::vector<SegmentInfo> segments;
+    for (const auto &segment : readManifest(index_dir))
+    {
+        bool is_replaced = std::any_of(replaced.begin(), replaced.end(),
+                                       [&segment](const SegmentInfo &r)
+                                       { return r.name == segment.name; });
+        if (!is_replaced)
+            segments.push_back(segment);
+    }
+    segments.push_back(info);
+    writeManifest(index_dir, segments);
+}
+
+// number of docs in the doc table of an index directory
+int countDocs(const std::string &dir)
+{
+    std::ifstream doc_info(dir + "/" + DOC_INFO_FILE);
+    std::string line;
+    int doc_count = 0;
+    while (std::getline(doc_info, line))
+    {
+        doc_count++;
+    }
+    return doc_count;
+}
+
+// Read the live docs bitmap of an index directory, all docs are live if there is none
+std::vector<uint64_t> readLiveDocs(const std::string &dir, int doc_count)
+{
+    std::vector<uint64_t> live_docs((doc_count + 63) / 64, ~uint64_t(0));
+    std::ifstream file(dir + "/" + LIVE_DOCS_FILE, std::ios::binary);
+    if (file.is_open())
+    {
+        file.read(reinterpret_cast<char *>(live_docs.data()), live_docs.size() * sizeof(uint64_t));
+    }
+    return live_docs;
+}
+
+// Replace the live docs bitmap atomically
+void writeLiveDocs(const std::string &dir, const std::vector<uint64_t> &live_docs)
+{
+    std::string tmp_name = dir + "/" + LIVE_DOCS_FILE + ".tmp";
+    std::ofstream file(tmp_name, std::ios::binary);
+    file.write(reinterpret_cast<const char *>(live_docs.data()), live_docs.size() * sizeof(uint64_t));
+    file.close();
+    std::filesystem::rename(tmp_name, dir + "/" + LIVE_DOCS_FILE);
+}
+
+bool isLive(const std::vector<uint64_t> &live_docs, int doc_id)
+{
+    return (live_docs[doc_id / 64] >> (doc_id % 64)) & 1;
+}
+
+// Read the doc map of an index directory, empty if local doc_ids are doc_base + offset
+std::vector<int> readDocMap(const std::string &dir)
+{
+    std::vector<int> doc_map;
+    std::ifstream file(dir + "/" + DOC_MAP_FILE, std::ios::binary);
+    if (file.is_open())
+    {
+        file.seekg(0, std::ios::end);
+        doc_map.resize(file.tellg() / sizeof(int));
+        file.seekg(0);
+        file.read(reinterpret_cast<char *>(doc_map.data()), doc_map.size() * sizeof(int));
+    }
+    return doc_map;
+}
+
+// (global doc_id, local doc_id) pairs of a doc map sorted by global doc_id, reordered segments have unsorted maps
+std::vector<std::pair<int, int>> docLookup(const std::vector<int> &doc_map)
+{
+    std::vector<std::pair<int, int>> doc_lookup(doc_map.size());
+    for (size_t i = 0; i < doc_map.size(); ++i)
+    {
+        doc_lookup[i] = {doc_map[i], static_cast<int>(i)};
+    }
+    std::sort(doc_lookup.begin(), doc_lookup.end());
+    return doc_lookup;
+}
+
+// local doc_id of a global doc_id in a segment, -1 if the segment doesn't hold it
+int localDocId(const SegmentInfo &segment, const std::vector<std::pair<int, int>> &doc_lookup, int doc_count, int doc_id)
+{
+    if (doc_lookup.empty())
+    {
+        int local_id = doc_id - segment.doc_base;
+        return local_id >= 0 && local_id < doc_count ? local_id : -1;
+    }
+    auto it = std::lower_bound(doc_lookup.begin(), doc_lookup.end(), std::make_pair(doc_id, 0));
+    return it != doc_lookup.end() && it->first == doc_id ? it->second : -1;
+}
+
+// one past the largest global doc_id of a segment
+int segmentDocEnd(const std::string &index_dir, const SegmentInfo &segment)
+{
+    std::vector<int> doc_map = readDocMap(index_dir + "/" + segment.name);
+    return doc_map.empty() ? segment.doc_base + segment.doc_count : *std::max_element(doc_map.begin(), doc_map.end()) + 1;
+}
+
+// Read one lexicon line, indexes written before bitmap lists have no list type column
+bool readLexiconEntry(std::istream &lexicon_file, std::string &word, LexiconInfo &info)
+{
+    std::string line;
+    if (!std::getline(lexicon_file, line))
+        return false;
+    std::istringstream fields(line);
+    if (!(fields >> word >> info.term_id >> info.posting_number >> info.start_position >> info.bytes_size))
+        return false;
+    if (!(fields >> info.list_type))
+        info.list_type = LIST_BLOCKS;
+    return true;
+}
+
+// format header of a directory whose lists are read back, exits on a format this build cannot decode
+IndexFormat readListFormat(const std::string &dir)
+{
+    IndexFormat format;
+    if (!readIndexFormat(dir, format))
+    {
+        std::cerr << "Unsupported index format in " << dir << std::endl;
+        exit(1);
+    }
+    return format;
+}
+
+// Read postings of one list of a finished index in format as (doc_id, count) pairs
+std::vector<std::pair<int, int>> readPostings(std::ifstream &index_file, const LexiconInfo &info, const IndexFormat &format)
+{
+    std::vector<uint8_t> bytes(info.bytes_size);
+    index_file.seekg(info.start_position);
+    index_file.read(reinterpret_cast<char *>(bytes.data()), info.bytes_size);
+
+    std::vector<std::pair<int, int>> postings;
+    postings.reserve(info.posting_number);
+    size_t pos = 0;
+    if (info.list_type == LIST_BITMAP)
+    {
+        int first_word = varbyteDecode(bytes.data(), pos);
+        int num_words = varbyteDecode(bytes.data(), pos);
+        std::vector<uint64_t> words(num_words);
+        std::memcpy(words.data(), bytes.data() + pos, num_words * sizeof(uint64_t));
+        pos += num_words * sizeof(uint64_t);
+        for (int i = 0; i < num_words; ++i)
+        {
+            for (uint64_t bits = words[i]; bits != 0; bits &= bits - 1)
+            {
+                int doc_id = (first_word + i) * 64 + __builtin_ctzll(bits);
+                postings.emplace_back(doc_id, varbyteDecode(bytes.data(), pos));
+            }
+        }
+        return postings;
+    }
+
+    visitFormat(format, [&](auto block_size, auto codec)
+                {
+                    constexpr int BlockSize = decltype(block_size)::value;
+                    using Codec = decltype(codec);
+                    int doc_id = 0;
+                    int postings_left = info.posting_number;
+                    int doc_ids[BlockSize];
+                    int counts[BlockSize];
+                    while (postings_left > 0)
+                    {
+                        // a block holds all doc_id gaps first, followed by all counts
+                        int count = std::min(postings_left, BlockSize);
+                        pos += Codec::template decodeBlock<BlockSize, true>(bytes.data() + pos, bytes.size() - pos, count, doc_id, doc_ids);
+                        pos += Codec::template decodeBlock<BlockSize, false>(bytes.data() + pos, bytes.size() - pos, count, 0, counts);
+                        for (int i = 0; i < count; ++i)
+                            postings.emplace_back(doc_ids[i], counts[i]);
+                        doc_id = doc_ids[count - 1];
+                        postings_left -= count;
+                    } });
+    return postings;
+}
+
+// Merge consecutive segments into a new one, deleted docs are dropped and the rest renumbered
+SegmentInfo mergeSegmentGroup(const std::string &index_dir, const std::vector<SegmentInfo> &group)
+{
+    SegmentInfo merged{newSegmentName(index_dir), group.front().doc_base, 0};
+    std::string tmp_dir = index_dir + "/" + merged.name + ".tmp";
+    std::cout << "Merging " << group.size() << " segments into " << merged.name << std::endl;
+
+    // live docs and doc maps of the segments, doc_ids stay doc_base + offset unless docs get dropped
+    std::vector<std::vector<uint64_t>> live_docs(group.size());
+    std::vector<std::vector<int>> doc_maps(group.size());
+    std::vector<int> doc_counts(group.size());
+    bool keep_doc_ids = true;
+    for (size_t i = 0; i < group.size(); ++i)
+    {
+        std::string segment_dir = index_dir + "/" + group[i].name;
+        doc_counts[i] = countDocs(segment_dir);
+        live_docs[i] = readLiveDocs(segment_dir, doc_counts[i]);
+        doc_maps[i] = readDocMap(segment_dir);
+        for (int doc_id = 0; doc_id < doc_counts[i] && keep_doc_ids; ++doc_id)
+        {
+            keep_doc_ids = isLive(live_docs[i], doc_id);
+        }
+        keep_doc_ids = keep_doc_ids && doc_maps[i].empty();
+    }
+
+    // lexicons of all segments, std::map keeps the terms sorted
+    std::map<std::string, std::vector<std::pair<int, LexiconInfo>>> terms;
+    std::vector<std::ifstream> index_files(group.size());
+    std::vector<IndexFormat> formats(group.size()); // segments written with another block size are merged into build_format
+    std::vector<std::vector<int>> new_doc_ids(group.size()); // merged local doc_id of every doc, -1 if dropped
+    std::vector<int> merged_doc_map;
+    std::ofstream doc_info(tmp_dir + "/" + DOC_INFO_FILE);
+    for (size_t i = 0; i < group.size(); ++i)
+    {
+        std::string segment_dir = index_dir + "/" + group[i].name;
+        index_files[i].open(segment_dir + "/" + INDEX_FILE, std::ios::binary);
+        formats[i] = readListFormat(segment_dir);
+
+        std::ifstream lexicon_file(segment_dir + "/" + LEXICON_FILE);
+        std::string word;
+        LexiconInfo info{};
+        while (readLexiconEntry(lexicon_file, word, info))
+        {
+            terms[word].emplace_back(i, info);
+        }
+
+        // doc info of the segments is concatenated in doc_id order, unused doc_ids in between stay empty
+        while (keep_doc_ids && merged.doc_base + merged.doc_count < group[i].doc_base)
+        {
+            doc_info << "0 -1\n";
+            merged.doc_count++;
+        }
+        std::ifstream segment_doc_info(segment_dir + "/" + DOC_INFO_FILE);
+        std::string line;
+        for (int doc_id = 0; std::getline(segment_doc_info, line); ++doc_id)
+        {
+            if (!isLive(live_docs[i], doc_id))
+            {
+                new_doc_ids[i].push_back(-1);
+                continue;
+            }
+            new_doc_ids[i].push_back(merged.doc_count);
+            merged_doc_map.push_back(doc_maps[i].empty() ? group[i].doc_base + doc_id : doc_maps[i][doc_id]);
+            doc_info << line << "\n";
+            merged.doc_count++;
+        }
+    }
+    doc_info.close();
+    if (!keep_doc_ids)
+    {
+        std::ofstream doc_map_file(tmp_dir + "/" + DOC_MAP_FILE, std::ios::binary);
+        doc_map_file.write(reinterpret_cast<const char *>(merged_doc_map.data()), merged_doc_map.size() * sizeof(int));
+        merged.doc_base = merged_doc_map.empty() ? merged.doc_base : *std::min_element(merged_doc_map.begin(), merged_doc_map.end());
+    }
+
+    PostingsWriter writer(tmp_dir, build_format);
+    int term_id = 0;
+    for (const auto &[word, parts] : terms)
+    {
+        LexiconInfo info{term_id, 0, 0, 0, 0};
+        int last_doc_id = 0;
+        writer.startTerm();
+        for (const auto &[segment_index, segment_info] : parts)
+        {
+            for (const auto &[doc_id, count] : readPostings(index_files[segment_index], segment_info, formats[segment_index]))
+            {
+                int new_doc_id = new_doc_ids[segment_index][doc_id];
+                if (new_doc_id < 0)
+                    continue; // deleted
+                writer.addPosting(new_doc_id - last_doc_id, count);
+                last_doc_id = new_doc_id;
+                info.posting_number++;
+            }
+        }
+        if (info.posting_number > 0) // every posting of the term was deleted
+        {
+            writer.finishTerm(word, info);
+            term_id++;
+        }
+        build_stats.terms_merged++;
+    }
+    writer.close();
+
+    // deletions that arrived during the merge are carried over to the merged segment
+    int lock_fd = lockFile(index_dir + "/" + MANIFEST_LOCK, true);
+    std::vector<uint64_t> merged_live_docs((merged.doc_count + 63) / 64, ~uint64_t(0));
+    bool late_deletes = false;
+    for (size_t i = 0; i < group.size(); ++i)
+    {
+        std::vector<uint64_t> current_live_docs = readLiveDocs(index_dir + "/" + group[i].name, doc_counts[i]);
+        for (int doc_id = 0; doc_id < doc_counts[i]; ++doc_id)
+        {
+            int new_doc_id = new_doc_ids[i][doc_id];
+            if (new_doc_id >= 0 && !isLive(current_live_docs, doc_id))
+            {
+                merged_live_docs[new_doc_id / 64] &= ~(uint64_t(1) << (new_doc_id % 64));
+                late_deletes = true;
+            }
+        }
+    }
+    if (late_deletes)
+    {
+        writeLiveDocs(tmp_dir, merged_live_docs);
+    }
+    publishSegment(index_dir, tmp_dir, merged, group);
+    close(lock_fd);
+
+    for (const auto &segment : group)
+    {
+        std::filesystem::remove_all(index_dir + "/" + segment.name);
+    }
+    return merged;
+}
+
+// Mark docs as deleted in the live docs bitmap of the segment holding them
+void deleteDocuments(const std::string &index_dir, const std::vector<int> &doc_ids)
+{
+    int lock_fd = lockFile(index_dir + "/" + MANIFEST_LOCK, true);
+    std::vector<SegmentInfo> segments = readManifest(index_dir);
+    bool segmented = !segments.empty();
+    if (!segmented)
+    {
+        segments.push_back({".", 0, countDocs(index_dir)}); // single index written without --segment
+    }
+
+    int deleted = 0;
+    for (const auto &segment : segments)
+    {
+        std::string segment_dir = index_dir + "/" + segment.name;
+        int doc_count = countDocs(segment_dir);
+        std::vector<uint64_t> live_docs = readLiveDocs(segment_dir, doc_count);
+        std::vector<std::pair<int, int>> doc_lookup = docLookup(readDocMap(segment_dir));
+        bool changed = false;
+        for (int doc_id : doc_ids)
+        {
+            int local_id = localDocId(segment, doc_lookup, doc_count, doc_id);
+            if (local_id >= 0 && isLive(live_docs, local_id))
+            {
+                live_docs[local_id / 64] &= ~(uint64_t(1) << (local_id % 64));
+                changed = true;
+                deleted++;
+            }
+        }
+        if (changed)
+        {
+            writeLiveDocs(segment_dir, live_docs);
+        }
+    }
+
+    // rewriting the manifest tells running searchers to reload live docs
+    if (segmented)
+    {
+        writeManifest(index_dir, segments);
+    }
+    close(lock_fd);
+    std::cout << "Deleted " << deleted << " of " << doc_ids.size() << " docs." << std::endl;
+}
+
+// Rewrite segments whose deleted ratio is above threshold without the deleted docs
+void compactSegments(const std::string &index_dir, double threshold)
+{
+    int merge_lock = lockFile(index_dir + "/" + MERGE_LOCK, true);
+    for (const auto &segment : readManifest(index_dir))
+    {
+        std::string segment_dir = index_dir + "/" + segment.name;
+        int doc_count = countDocs(segment_dir);
+        std::vector<uint64_t> live_docs = readLiveDocs(segment_dir, doc_count);
+        int deleted = 0;
+        for (int doc_id = 0; doc_id < doc_count; ++doc_id)
+        {
+            deleted += !isLive(live_docs, doc_id);
+        }
+        if (doc_count > 0 && static_cast<double>(deleted) / doc_count > threshold)
+        {
+            std::cout << "Compacting " << segment.name << ", " << deleted << " of " << doc_count << " docs deleted" << std::endl;
+            mergeSegmentGroup(index_dir, {segment});
+        }
+    }
+    close(merge_lock);
+}
+
+// tier of a segment, each tier holds MERGE_FACTOR times more docs than the one below
+int segmentTier(int doc_count)
+{
+    int tier = 0;
+    int64_t limit = MIN_SEGMENT_DOCS;
+    while (doc_count >= limit)
+    {
+        limit *= MERGE_FACTOR;
+        tier++;
+    }
+    return tier;
+}
+
+// Tiered merge policy, merge MERGE_FACTOR consecutive segments of the same tier until none are left
+void runMergePolicy(const std::string &index_dir)
+{
+    int merge_lock = lockFile(index_dir + "/" + MERGE_LOCK, false);
+    if (merge_lock < 0)
+    {
+        std::cout << "Another merge is running in " << index_dir << std::endl;
+        return;
+    }
+
+    while (true)
+    {
+        std::vector<SegmentInfo> segments = readManifest(index_dir);
+        int best_start = -1;
+        int best_tier = 0;
+        for (int i = 0; i + MERGE_FACTOR <= static_cast<int>(segments.size()); ++i)
+        {
+            int tier = segmentTier(segments[i].doc_count);
+            bool same_tier = true;
+            for (int j = i + 1; j < i + MERGE_FACTOR; ++j)
+            {
+                if (segmentTier(segments[j].doc_count) != tier)
+                    same_tier = false;
+            }
+            if (same_tier && (best_start < 0 || tier < best_tier)) // smallest tier first
+            {
+                best_start = i;
+                best_tier = tier;
+            }
+        }
+        if (best_start < 0)
+            break;
+
+        std::vector<SegmentInfo> group(segments.begin() + best_start, segments.begin() + best_start + MERGE_FACTOR);
+        mergeSegmentGroup(index_dir, group);
+    }
+    close(merge_lock);
+}
+
+// ForwardIndex struct, terms of every doc in compressed row form, input of the doc reordering
+struct ForwardIndex
+{
+    std::vector<int64_t> offsets; // terms of doc d are terms[offsets[d], offsets[d + 1])
+    std::vector<int> terms;
+    int num_terms = 0;
+    std::vector<double> deg_cost; // deg * log2(deg + 1) for every possible degree
+};
+
+// Recursive graph bisection: split docs in two halves and swap docs between them while that
+// lowers the estimated list size, then recurse. deg_a and deg_b are zeroed workspace of num_terms
+void bisect(const ForwardIndex &forward, int *docs, int n, int parallel_depth,
+            std::vector<int> &deg_a, std::vector<int> &deg_b)
+{
+    if (n <= BP_LEAF_SIZE)
+    {
+        std::sort(docs, docs + n); // keep input order inside a leaf
+        return;
+    }
+    int n_a = n / 2;
+    int n_b = n - n_a;
+    int *a = docs;
+    int *b = docs + n_a;
+    auto forTerms = [&forward](int doc, auto &&fn)
+    {
+        for (int64_t i = forward.offsets[doc]; i < forward.offsets[doc + 1]; ++i)
+            fn(forward.terms[i]);
+    };
+    for (int i = 0; i < n_a; ++i)
+        forTerms(a[i], [&](int term) { deg_a[term]++; });
+    for (int i = 0; i < n_b; ++i)
+        forTerms(b[i], [&](int term) { deg_b[term]++; });
+
+    // gain of moving a doc to the other half. A term of degree deg in n docs costs about
+    // deg * log2(n / (deg + 1)) bits, the log2(n) parts cancel out between two equal halves
+    const std::vector<double> &deg_cost = forward.deg_cost;
+    auto moveGain = [&](int doc, const std::vector<int> &from, const std::vector<int> &to)
+    {
+        double gain = 0;
+        forTerms(doc, [&](int term)
+                 { gain += deg_cost[from[term] - 1] - deg_cost[from[term]] + deg_cost[to[term] + 1] - deg_cost[to[term]]; });
+        return gain;
+    };
+
+    std::vector<std::pair<double, int>> gains_a(n_a), gains_b(n_b);
+    for (int iteration = 0; iteration < BP_ITERATIONS; ++iteration)
+    {
+        for (int i = 0; i < n_a; ++i)
+            gains_a[i] = {moveGain(a[i], deg_a, deg_b), a[i]};
+        for (int i = 0; i < n_b; ++i)
+            gains_b[i] = {moveGain(b[i], deg_b, deg_a), b[i]};
+        std::sort(gains_a.begin(), gains_a.end(), std::greater<>());
+        std::sort(gains_b.begin(), gains_b.end(), std::greater<>());
+
+        // swap the best pairs as long as a pair still gains
+        int swaps = 0;
+        while (swaps < n_a && gains_a[swaps].first + gains_b[swaps].first > 0)
+        {
+            forTerms(gains_a[swaps].second, [&](int term) { deg_a[term]--; deg_b[term]++; });
+            forTerms(gains_b[swaps].second, [&](int term) { deg_b[term]--; deg_a[term]++; });
+            swaps++;
+        }
+        for (int i = 0; i < n_a; ++i)
+            a[i] = i < swaps ? gains_b[i].second : gains_a[i].second;
+        for (int i = 0; i < n_b; ++i)
+            b[i] = i < swaps ? gains_a[i].second : gains_b[i].second;
+        if (swaps == 0)
+            break;
+    }
+    for (int i = 0; i < n; ++i)
+        forTerms(docs[i], [&](int term) { deg_a[term] = 0; deg_b[term] = 0; });
+
+    // the top levels run their halves on separate threads with their own workspace
+    if (parallel_depth > 0)
+    {
+        std::thread left([&forward, a, n_a, parallel_depth]
+                         {
+                             std::vector<int> left_deg_a(forward.num_terms), left_deg_b(forward.num_terms);
+                             bisect(forward, a, n_a, parallel_depth - 1, left_deg_a, left_deg_b);
+                         });
+        bisect(forward, b, n_b, parallel_depth - 1, deg_a, deg_b);
+        left.join();
+    }
+    else
+    {
+        bisect(forward, a, n_a, 0, deg_a, deg_b);
+        bisect(forward, b, n_b, 0, deg_a, deg_b);
+    }
+}
+
+// Renumber the docs of an index directory so docs sharing terms get close doc_ids, which shrinks
+// the gaps. The global doc_id of every new local doc_id is kept in the doc map
+void reorderDocs(const std::string &dir)
+{
+    std::cout << "Reordering docs..." << std::endl;
+    build_stats.current_stage = "reorder";
+    auto phase_start = BuildStats::Clock::now();
+    std::vector<std::pair<std::string, LexiconInfo>> terms;
+    std::ifstream lexicon_file(dir + "/" + LEXICON_FILE);
+    std::string word;
+    LexiconInfo info{};
+    while (readLexiconEntry(lexicon_file, word, info))
+    {
+        terms.emplace_back(word, info);
+    }
+    lexicon_file.close();
+    int doc_count = countDocs(dir);
+    int64_t old_index_bytes = std::filesystem::file_size(dir + "/" + INDEX_FILE);
+    IndexFormat format = readListFormat(dir);
+
+    // forward index over terms in two or more docs, terms of a single doc have no gaps to shrink
+    std::ifstream index_file(dir + "/" + INDEX_FILE, std::ios::binary);
+    ForwardIndex forward;
+    forward.offsets.assign(doc_count + 1, 0);
+    for (const auto &[term_word, term] : terms)
+    {
+        if (term.posting_number < 2)
+            continue;
+        for (const auto &[doc_id, count] : readPostings(index_file, term, format))
+            forward.offsets[doc_id + 1]++;
+    }
+    for (int doc_id = 0; doc_id < doc_count; ++doc_id)
+        forward.offsets[doc_id + 1] += forward.offsets[doc_id];
+    forward.terms.resize(forward.offsets[doc_count]);
+    std::vector<int64_t> fill(forward.offsets.begin(), forward.offsets.end() - 1);
+    for (const auto &[term_word, term] : terms)
+    {
+        if (term.posting_number < 2)
+            continue;
+        for (const auto &[doc_id, count] : readPostings(index_file, term, format))
+            forward.terms[fill[doc_id]++] = forward.num_terms;
+        forward.num_terms++;
+    }
+    forward.deg_cost.resize(doc_count + 2);
+    for (int deg = 0; deg < doc_count + 2; ++deg)
+        forward.deg_cost[deg] = deg * std::log2(deg + 1.0);
+
+    std::vector<int> order(doc_count); // old doc_id at every new doc_id
+    std::iota(order.begin(), order.end(), 0);
+    int parallel_depth = 0;
+    while ((2 << parallel_depth) <= static_cast<int>(std::thread::hardware_concurrency()))
+        parallel_depth++;
+    std::vector<int> deg_a(forward.num_terms), deg_b(forward.num_terms);
+    bisect(forward, order.data(), doc_count, parallel_depth, deg_a, deg_b);
+    forward = ForwardIndex();
+    std::vector<int> new_doc_ids(doc_count);
+    for (int doc_id = 0; doc_id < doc_count; ++doc_id)
+        new_doc_ids[order[doc_id]] = doc_id;
+
+    // rewrite the lists with the new doc_ids
+    std::string tmp_dir = dir + "/reorder.tmp";
+    std::filesystem::create_directories(tmp_dir);
+    build_stats.resetIndexStats();
+    PostingsWriter writer(tmp_dir, format);
+    for (auto &[term_word, term] : terms)
+    {
+        std::vector<std::pair<int, int>> postings = readPostings(index_file, term, format);
+        for (auto &posting : postings)
+            posting.first = new_doc_ids[posting.first];
+        std::sort(postings.begin(), postings.end());
+        int last_doc_id = 0;
+        writer.startTerm();
+        for (const auto &[doc_id, count] : postings)
+        {
+            writer.addPosting(doc_id - last_doc_id, count);
+            last_doc_id = doc_id;
+        }
+        writer.finishTerm(term_word, term);
+    }
+    writer.close();
+    index_file.close();
+
+    // doc table and doc map in the new order
+    std::vector<std::string> doc_lines;
+    std::ifstream doc_info(dir + "/" + DOC_INFO_FILE);
+    std::string line;
+    while (std::getline(doc_info, line))
+        doc_lines.push_back(line);
+    doc_info.close();
+    std::vector<int> old_doc_map = readDocMap(dir);
+    std::vector<int> doc_map(doc_count);
+    std::ofstream new_doc_info(tmp_dir + "/" + DOC_INFO_FILE);
+    for (int doc_id = 0; doc_id < doc_count; ++doc_id)
+    {
+        new_doc_info << doc_lines[order[doc_id]] << "\n";
+        doc_map[doc_id] = old_doc_map.empty() ? order[doc_id] : old_doc_map[order[doc_id]];
+    }
+    new_doc_info.close();
+    std::ofstream doc_map_file(tmp_dir + "/" + DOC_MAP_FILE, std::ios::binary);
+    doc_map_file.write(reinterpret_cast<const char *>(doc_map.data()), doc_map.size() * sizeof(int));
+    doc_map_file.close();
+
+    for (const auto &file : {INDEX_FILE, LEXICON_FILE, BLOCK_INFO_FILE, DOC_INFO_FILE, DOC_MAP_FILE, FORMAT_FILE})
+    {
+        std::filesystem::rename(tmp_dir + "/" + file, dir + "/" + file);
+    }
+    if (debug_dumps)
+        std::filesystem::rename(tmp_dir + "/" + BLOCK_INFO_TEXT_FILE, dir + "/" + BLOCK_INFO_TEXT_FILE);
+    std::filesystem::remove_all(tmp_dir);
+    addPhaseTime(PHASE_REORDER, phase_start);
+    std::cout << "Docs reordered, index bytes: " << old_index_bytes << " -> " << build_stats.index_bytes << std::endl;
+}
+
+// Replace the stored frequencies of an index directory with BM25 impacts quantized to 1..255,
+// the search engine then adds integers instead of evaluating BM25 per posting
+void quantizeImpacts(const std::string &dir)
+{
+    std::cout << "Quantizing impacts..." << std::endl;
+    std::vector<int> doc_lengths;
+    int64_t total_docs = 0;
+    int64_t total_length = 0;
+    std::ifstream doc_info(dir + "/" + DOC_INFO_FILE);
+    int doc_length;
+    std::streamoff line_pos;
+    while (doc_info >> doc_length >> line_pos)
+    {
+        doc_lengths.push_back(doc_length);
+        if (line_pos >= 0) // holes between doc_ids
+        {
+            total_docs++;
+            total_length += doc_length;
+        }
+    }
+    double avg_doc_length = total_docs > 0 ? static_cast<double>(total_length) / total_docs : 1;
+
+    std::vector<std::pair<std::string, LexiconInfo>> terms;
+    std::ifstream lexicon_file(dir + "/" + LEXICON_FILE);
+    std::string word;
+    LexiconInfo info{};
+    while (readLexiconEntry(lexicon_file, word, info))
+    {
+        terms.emplace_back(word, info);
+    }
+    lexicon_file.close();
+
+    auto impact = [&](const LexiconInfo &term, int doc_id, int count)
+    {
+        double idf = std::log((total_docs - term.posting_number + 0.5) / (term.posting_number + 0.5) + 1.0);
+        double norm = BM25_K1 * (1 - BM25_B + BM25_B * doc_lengths[doc_id] / avg_doc_length);
+        return idf * count * (BM25_K1 + 1) / (count + norm);
+    };
+
+    // the largest impact of the index maps to 255
+    std::ifstream index_file(dir + "/" + INDEX_FILE, std::ios::binary);
+    IndexFormat format = readListFormat(dir);
+    double max_impact = 0;
+    for (const auto &[term_word, term] : terms)
+    {
+        for (const auto &[doc_id, count] : readPostings(index_file, term, format))
+        {
+            max_impact = std::max(max_impact, impact(term, doc_id, count));
+        }
+    }
+    double scale = max_impact > 0 ? max_impact / 255 : 1;
+
+    std::string tmp_dir = dir + "/impacts.tmp";
+    std::filesystem::create_directories(tmp_dir);
+    build_stats.resetIndexStats();
+    IndexFormat impact_format = format;
+    impact_format.scoring = SCORING_IMPACT;
+    PostingsWriter writer(tmp_dir, impact_format);
+    for (auto &[term_word, term] : terms)
+    {
+        int last_doc_id = 0;
+        writer.startTerm();
+        for (const auto &[doc_id, count] : readPostings(index_file, term, format))
+        {
+            int quantized = std::clamp(static_cast<int>(std::lround(impact(term, doc_id, count) / scale)), 1, 255);
+            writer.addPosting(doc_id - last_doc_id, quantized);
+            last_doc_id = doc_id;
+        }
+        writer.finishTerm(term_word, term);
+    }
+    writer.close();
+    index_file.close();
+
+    std::ofstream impact_info(tmp_dir + "/" + IMPACT_INFO_FILE);
+    impact_info.precision(17);
+    impact_info << scale << "\n";
+    impact_info.close();
+    for (const auto &file : {INDEX_FILE, LEXICON_FILE, BLOCK_INFO_FILE, IMPACT_INFO_FILE, FORMAT_FILE})
+    {
+        std::filesystem::rename(tmp_dir + "/" + file, dir + "/" + file);
+    }
+    if (debug_dumps)
+        std::filesystem::rename(tmp_dir + "/" + BLOCK_INFO_TEXT_FILE, dir + "/" + BLOCK_INFO_TEXT_FILE);
+    std::filesystem::remove_all(tmp_dir);
+    std::cout << "Impacts quantized, scale: " << scale << std::endl;
+}
+
+// Write the first tier of an index directory: each term keeps its tier_postings best postings by
+// the BM25 term frequency part. The bounds file holds the best part of the whole list and of the
+// pruned postings, which lets the search engine prove when first tier results are complete
+void buildFirstTier(const std::string &dir, int tier_postings)
+{
+    std::cout << "Building first tier..." << std::endl;
+    std::vector<int> doc_lengths;
+    int64_t total_docs = 0;
+    int64_t total_length = 0;
+    std::ifstream doc_info(dir + "/" + DOC_INFO_FILE);
+    int doc_length;
+    std::streamoff line_pos;
+    while (doc_info >> doc_length >> line_pos)
+    {
+        doc_lengths.push_back(doc_length);
+        if (line_pos >= 0) // holes between doc_ids
+        {
+            total_docs++;
+            total_length += doc_length;
+        }
+    }
+    // same arithmetic as the search engine so bounds compare exactly
+    double avg_doc_length = total_docs > 0 ? static_cast<double>(total_length) / total_docs : 0;
+    auto termFrequencyPart = [&](int doc_id, int count)
+    {
+        return (count * (BM25_K1 + 1)) / (count + BM25_K1 * (1 - BM25_B + BM25_B * (doc_lengths[doc_id] / avg_doc_length)));
+    };
+
+    std::vector<std::pair<std::string, LexiconInfo>> terms;
+    std::ifstream lexicon_file(dir + "/" + LEXICON_FILE);
+    std::string word;
+    LexiconInfo info{};
+    while (readLexiconEntry(lexicon_file, word, info))
+    {
+        terms.emplace_back(word, info);
+    }
+    lexicon_file.close();
+
+    std::string tmp_dir = dir + "/" + TIER_DIR + ".tmp";
+    std::filesystem::remove_all(tmp_dir);
+    std::filesystem::create_directories(tmp_dir);
+    std::ofstream bounds(tmp_dir + "/" + TIER_BOUNDS_FILE);
+    bounds.precision(17);
+    bounds << avg_doc_length << "\n";
+    std::ifstream index_file(dir + "/" + INDEX_FILE, std::ios::binary);
+    int64_t tier_size = 0;
+    // the tier is not part of the final index stats
+    int64_t index_bytes = build_stats.index_bytes;
+    int64_t index_blocks = build_stats.blocks;
+    auto block_size_hist = build_stats.block_size_hist;
+    IndexFormat format = readListFormat(dir); // the tier is searched by the cursor of its segment
+    PostingsWriter writer(tmp_dir, format);
+    for (auto &[term_word, term] : terms)
+    {
+        std::vector<std::pair<int, int>> postings = readPostings(index_file, term, format);
+        std::vector<std::pair<double, int>> ranked(postings.size()); // frequency part and posting index
+        for (size_t i = 0; i < postings.size(); ++i)
+        {
+            ranked[i] = {termFrequencyPart(postings[i].first, postings[i].second), i};
+        }
+        size_t keep = std::min<size_t>(tier_postings, ranked.size());
+        std::nth_element(ranked.begin(), ranked.begin() + keep, ranked.end(), std::greater<>());
+        double max_part = 0;
+        double pruned_part = 0;
+        for (size_t i = 0; i < ranked.size(); ++i)
+        {
+            double &part = i < keep ? max_part : pruned_part;
+            part = std::max(part, ranked[i].first);
+        }
+
+        std::vector<int> kept;
+        for (size_t i = 0; i < keep; ++i)
+        {
+            kept.push_back(ranked[i].second);
+        }
+        std::sort(kept.begin(), kept.end()); // back to doc_id order
+        LexiconInfo tier_info{term.term_id, 0, static_cast<int>(keep), 0, 0};
+        int last_doc_id = 0;
+        writer.startTerm();
+        for (int index : kept)
+        {
+            writer.addPosting(postings[index].first - last_doc_id, postings[index].second);
+            last_doc_id = postings[index].first;
+        }
+        writer.finishTerm(term_word, tier_info);
+        bounds << term_word << " " << max_part << " " << pruned_part << "\n";
+        tier_size += keep;
+    }
+    writer.close();
+    bounds.close();
+    build_stats.index_bytes = index_bytes;
+    build_stats.blocks = index_blocks;
+    build_stats.block_size_hist = block_size_hist;
+
+    std::filesystem::remove_all(dir + "/" + TIER_DIR);
+    std::filesystem::rename(tmp_dir, dir + "/" + TIER_DIR);
+    std::cout << "First tier built with " << tier_size << " postings." << std::endl;
+}
+
+// Write the term-pair index of an index directory: for frequent pairs of terms, the intersection
+// of their lists with the counts of both terms. pairs_file is a query log, one query per line, a
+// line of two terms names a pair directly. Every pair of terms in a line counts once, pairs whose
+// terms both have at least PAIR_MIN_POSTINGS postings are materialized most frequent first while
+// their lists fit in budget bytes
+void buildPairIndex(const std::string &dir, const std::string &pairs_file, int64_t budget)
+{
+    std::cout << "Building pair index..." << std::endl;
+    std::unordered_map<std::string, LexiconInfo> lexicon;
+    std::ifstream lexicon_file(dir + "/" + LEXICON_FILE);
+    std::string word;
+    LexiconInfo info{};
+    while (readLexiconEntry(lexicon_file, word, info))
+    {
+        lexicon[word] = info;
+    }
+    lexicon_file.close();
+
+    // count the pairs of the log, queries are tokenized like documents
+    std::map<std::pair<std::string, std::string>, int> pair_counts;
+    std::ifstream log(pairs_file);
+    std::string line;
+    while (std::getline(log, line))
+    {
+        std::vector<std::string> terms = processSentencePart(line);
+        std::sort(terms.begin(), terms.end());
+        terms.erase(std::unique(terms.begin(), terms.end()), terms.end());
+        std::erase_if(terms, [&lexicon](const std::string &term)
+                      {
+                          auto it = lexicon.find(term);
+                          return it == lexicon.end() || it->second.posting_number < PAIR_MIN_POSTINGS; });
+        for (size_t i = 0; i < terms.size(); ++i)
+        {
+            for (size_t j = i + 1; j < terms.size(); ++j)
+                pair_counts[{terms[i], terms[j]}]++;
+        }
+    }
+    std::vector<std::pair<int, std::pair<std::string, std::string>>> ranked;
+    for (const auto &[pair, count] : pair_counts)
+    {
+        ranked.emplace_back(count, pair);
+    }
+    std::stable_sort(ranked.begin(), ranked.end(), [](const auto &a, const auto &b)
+                     { return a.first > b.first; });
+
+    std::string tmp_dir = dir + "/" + PAIR_DIR + ".tmp";
+    std::filesystem::remove_all(tmp_dir);
+    std::filesystem::create_directories(tmp_dir);
+    std::ifstream index_file(dir + "/" + INDEX_FILE, std::ios::binary);
+    // the pair index is not part of the final index stats
+    int64_t index_bytes = build_stats.index_bytes;
+    int64_t index_blocks = build_stats.blocks;
+    auto block_size_hist = build_stats.block_size_hist;
+    IndexFormat format = readListFormat(dir); // the pair lists are searched by the cursor of their segment
+    PostingsWriter writer(tmp_dir, format);
+    int64_t pair_bytes = 0;
+    int pairs = 0;
+    for (const auto &[count, pair] : ranked)
+    {
+        std::vector<std::pair<int, int>> first = readPostings(index_file, lexicon.at(pair.first), format);
+        std::vector<std::pair<int, int>> second = readPostings(index_file, lexicon.at(pair.second), format);
+        std::vector<std::tuple<int, int, int>> both; // doc_id and the counts of both terms
+        for (size_t i = 0, j = 0; i < first.size() && j < second.size();)
+        {
+            if (first[i].first < second[j].first)
+                i++;
+            else if (first[i].first > second[j].first)
+                j++;
+            else
+            {
+                both.emplace_back(first[i].first, first[i].second, second[j].second);
+                i++;
+                j++;
+            }
+        }
+        if (both.empty())
+            continue;
+
+        // skip pairs that do not fit in what is left of the budget, encoded size as written by writeBlocks
+        int64_t list_bytes = 0;
+        int prev_doc_id = 0;
+        for (const auto &[doc_id, first_count, second_count] : both)
+        {
+            list_bytes += varbyteEncodedSize(doc_id - prev_doc_id) + varbyteEncodedSize(first_count) + varbyteEncodedSize(second_count);
+            prev_doc_id = doc_id;
+        }
+        if (pair_bytes + list_bytes > budget)
+            continue;
+
+        LexiconInfo pair_info{pairs, 0, static_cast<int>(both.size()), 0, 0};
+        writer.startTerm();
+        prev_doc_id = 0;
+        for (const auto &[doc_id, first_count, second_count] : both)
+        {
+            writer.addPairPosting(doc_id - prev_doc_id, first_count, second_count);
+            prev_doc_id = doc_id;
+        }
+        writer.finishTerm(pair.first + PAIR_SEPARATOR + pair.second, pair_info);
+        pair_bytes += pair_info.bytes_size;
+        pairs++;
+    }
+    writer.close();
+    build_stats.index_bytes = index_bytes;
+    build_stats.blocks = index_blocks;
+    build_stats.block_size_hist = block_size_hist;
+
+    std::filesystem::remove_all(dir + "/" + PAIR_DIR);
+    std::filesystem::rename(tmp_dir, dir + "/" + PAIR_DIR);
+    std::cout << "Pair index built with " << pairs << " pairs in " << pair_bytes << " bytes." << std::endl;
+}
+
+// Split a built index into doc-partitioned shards, local doc_id % num_shards picks the shard.
+// Every shard is an index directory with one segment whose doc map holds the global doc_ids,
+// plus a copy of the collection wide stats so shard scores stay comparable
+void buildShards(const std::string &index_dir, const std::vector<std::string> &inputs, int num_shards)
+{
+    std::string full_dir = index_dir + "/full.tmp"; // kept on failure, a rerun resumes from its checkpoint
+    std::filesystem::create_directories(full_dir);
+    int doc_base = -1;
+    processInputs(inputs, CHUNK_SIZE, full_dir, doc_base);
+
+    std::vector<std::string> shard_dirs(num_shards);
+    std::vector<std::ofstream> doc_infos(num_shards);
+    std::vector<std::vector<int>> doc_maps(num_shards);
+    for (int shard = 0; shard < num_shards; ++shard)
+    {
+        shard_dirs[shard] = index_dir + "/shard_" + std::to_string(shard);
+        std::filesystem::remove_all(shard_dirs[shard]);
+        std::filesystem::create_directories(shard_dirs[shard] + "/seg_0.tmp");
+        doc_infos[shard].open(shard_dirs[shard] + "/seg_0.tmp/" + DOC_INFO_FILE);
+    }
+
+    // doc table, holes between doc_ids are not counted in the collection stats
+    std::ifstream doc_info(full_dir + "/" + DOC_INFO_FILE);
+    std::string line;
+    int64_t total_docs = 0;
+    int64_t total_length = 0;
+    for (int doc_id = 0; std::getline(doc_info, line); ++doc_id)
+    {
+        int shard = doc_id % num_shards;
+        doc_infos[shard] << line << "\n";
+        doc_maps[shard].push_back(doc_base + doc_id);
+        int doc_length = 0;
+        std::streamoff line_pos = -1;
+        std::istringstream(line) >> doc_length >> line_pos;
+        if (line_pos >= 0)
+        {
+            total_docs++;
+            total_length += doc_length;
+        }
+    }
+
+    // global stats: doc count and length of the whole collection, then the df of every term
+    std::ofstream global_stats(index_dir + "/" + GLOBAL_STATS_FILE);
+    global_stats << total_docs << " " << total_length << "\n";
+
+    build_stats.resetIndexStats();
+    std::vector<std::unique_ptr<PostingsWriter>> writers;
+    for (int shard = 0; shard < num_shards; ++shard)
+    {
+        doc_infos[shard].close();
+        std::ofstream doc_map_file(shard_dirs[shard] + "/seg_0.tmp/" + DOC_MAP_FILE, std::ios::binary);
+        doc_map_file.write(reinterpret_cast<const char *>(doc_maps[shard].data()), doc_maps[shard].size() * sizeof(int));
+        writers.push_back(std::make_unique<PostingsWriter>(shard_dirs[shard] + "/seg_0.tmp", build_format));
+    }
+
+    std::ifstream index_file(full_dir + "/" + INDEX_FILE, std::ios::binary);
+    std::ifstream lexicon_file(full_dir + "/" + LEXICON_FILE);
+    IndexFormat format = readListFormat(full_dir);
+    std::vector<int> term_ids(num_shards, 0);
+    std::vector<LexiconInfo> infos(num_shards);
+    std::vector<int> last_doc_ids(num_shards);
+    std::string word;
+    LexiconInfo info{};
+    while (readLexiconEntry(lexicon_file, word, info))
+    {
+        global_stats << word << " " << info.posting_number << "\n";
+        for (int shard = 0; shard < num_shards; ++shard)
+        {
+            infos[shard] = {term_ids[shard], 0, 0, 0, 0};
+            last_doc_ids[shard] = 0;
+            writers[shard]->startTerm();
+        }
+        for (const auto &[doc_id, count] : readPostings(index_file, info, format))
+        {
+            int shard = doc_id % num_shards;
+            int local_doc_id = doc_id / num_shards;
+            writers[shard]->addPosting(local_doc_id - last_doc_ids[shard], count);
+            last_doc_ids[shard] = local_doc_id;
+            infos[shard].posting_number++;
+        }
+        for (int shard = 0; shard < num_shards; ++shard)
+        {
+            if (infos[shard].posting_number > 0)
+            {
+                writers[shard]->finishTerm(word, infos[shard]);
+                term_ids[shard]++;
+            }
+        }
+    }
+    global_stats.close();
+
+    for (int shard = 0; shard < num_shards; ++shard)
+    {
+        writers[shard]->close();
+        std::filesystem::copy_file(index_dir + "/" + GLOBAL_STATS_FILE, shard_dirs[shard] + "/" + GLOBAL_STATS_FILE);
+        SegmentInfo segment{"seg_0", doc_maps[shard].empty() ? 0 : doc_maps[shard].front(), (int)doc_maps[shard].size()};
+        int lock_fd = lockFile(shard_dirs[shard] + "/" + MANIFEST_LOCK, true);
+        publishSegment(shard_dirs[shard], shard_dirs[shard] + "/seg_0.tmp", segment, {});
+        close(lock_fd);
+        std::cout << "Wrote shard " << shard << " with " << segment.doc_count << " docs" << std::endl;
+    }
+    std::filesystem::remove_all(full_dir);
+}
+
+// Index a batch of new documents as an immutable segment of index_dir
+void appendSegment(const std::string &index_dir, const std::vector<std::string> &inputs)
+{
+    std::filesystem::create_directories(index_dir);
+    int next_doc_id = 0;
+    for (const auto &segment : readManifest(index_dir))
+    {
+        next_doc_id = std::max(next_doc_id, segmentDocEnd(index_dir, segment));
+    }
+
+    SegmentInfo info{newSegmentName(index_dir), -1, 0};
+    std::string tmp_dir = index_dir + "/" + info.name + ".tmp";
+    info.doc_count = processInputs(inputs, CHUNK_SIZE, tmp_dir, info.doc_base);
+    if (info.doc_count == 0 || info.doc_base < next_doc_id)
+    {
+        std::cerr << "Segment must contain new doc_ids starting at " << next_doc_id
+                  << ", got " << info.doc_base << std::endl;
+        std::filesystem::remove_all(tmp_dir);
+        exit(1);
+    }
+    writeBuildReport(tmp_dir + "/" + BUILD_REPORT_FILE);
+    int lock_fd = lockFile(index_dir + "/" + MANIFEST_LOCK, true);
+    publishSegment(index_dir, tmp_dir, info, {});
+    close(lock_fd);
+    std::cout << "Added segment " << info.name << " with " << info.doc_count
+              << " docs starting at doc_id " << info.doc_base << std::endl;
+
+    // merge small segments in the background so query fan-out stays bounded
+    if (fork() == 0)
+    {
+        setsid();
+        runMergePolicy(index_dir);
+        _exit(0);
+    }
+}
+
 int main(int argc, char *argv[])
 {
-    if (argc != 2)
+    std::string mode = argc > 1 ? argv[1] : "";
+    if (mode == "--segment" && argc >= 4)
     {
-        std::cerr << "Usage: " << argv[0] << " <gz file path>" << std::endl;
+        appendSegment(argv[2], std::vector<std::string>(argv + 3, argv + argc));
+    }
+    else if (mode == "--merge" && argc == 3)
+    {
+        runMergePolicy(argv[2]);
+    }
+    else if (mode == "--delete" && argc >= 4)
+    {
+        std::vector<int> doc_ids;
+        for (int i = 3; i < argc; ++i)
+        {
+            doc_ids.push_back(std::atoi(argv[i]));
+        }
+        deleteDocuments(argv[2], doc_ids);
+    }
+    else if (mode == "--compact" && (argc == 3 || argc == 4))
+    {
+        compactSegments(argv[2], argc == 4 ? std::atof(argv[3]) : COMPACT_THRESHOLD);
+    }
+    else if (mode == "--shards" && argc >= 5 && std::atoi(argv[2]) > 0)
+    {
+        buildShards(argv[3], std::vector<std::string>(argv + 4, argv + argc), std::atoi(argv[2]));
+        writeBuildReport(std::string(argv[3]) + "/" + BUILD_REPORT_FILE);
+    }
+    else if (argc >= 2 && (argv[argc - 1][0] != '-' || std::string(argv[argc - 1]) == "-"))
+    {
+        // build options of a single index in the working directory, followed by the inputs
+        bool reorder = false;
+        bool impacts = false;
+        int tier_postings = 0;
+        int inflate_threads = 0;
+        std::string pairs_file;
+        int64_t pair_budget = PAIR_BUDGET;
+        int i = 1;
+        for (; i < argc - 1 && std::string(argv[i]).starts_with("--"); ++i)
+        {
+            std::string option = argv[i];
+            if (option == "--reorder")
+            {
+                reorder = true;
+            }
+            else if (option == "--impacts")
+            {
+                impacts = true;
+            }
+            else if (option == "--tier" && i + 2 < argc && std::atoi(argv[i + 1]) > 0)
+            {
+                tier_postings = std::atoi(argv[++i]);
+            }
+            else if (option == "--parallel-inflate" && i + 2 < argc && std::atoi(argv[i + 1]) > 0)
+            {
+                inflate_threads = std::atoi(argv[++i]);
+            }
+            else if (option == "--pairs" && i + 2 < argc)
+            {
+                pairs_file = argv[++i];
+            }
+            else if (option == "--pair-budget" && i + 2 < argc && std::atoi(argv[i + 1]) > 0)
+            {
+                pair_budget = std::atoll(argv[++i]) * 1024 * 1024;
+            }
+            else if (option == "--debug-dumps")
+            {
+                debug_dumps = true;
+            }
+            else if (option == "--block-size" && i + 2 < argc)
+            {
+                build_format.block_size = std::atoi(argv[++i]);
+                if (!supportedFormat(build_format))
+                {
+                    std::cerr << "--block-size must be 64, 128 or 256" << std::endl;
+                    return 1;
+                }
+            }
+            else
+            {
+                std::cerr << "Unknown option: " << option << std::endl;
+                return 1;
+            }
+        }
+        if (impacts && tier_postings > 0)
+        {
+            std::cerr << "--tier bounds are BM25 based and cannot be combined with --impacts" << std::endl;
+            return 1;
+        }
+        if (impacts && !pairs_file.empty())
+        {
+            std::cerr << "--pairs lists hold term counts and cannot be combined with --impacts" << std::endl;
+            return 1;
+        }
+        std::vector<std::string> inputs(argv + i, argv + argc);
+        int doc_base = 0;
+        processInputs(inputs, CHUNK_SIZE, ".", doc_base, inflate_threads);
+        if (reorder)
+        {
+            reorderDocs(".");
+        }
+        if (impacts)
+        {
+            quantizeImpacts(".");
+        }
+        if (tier_postings > 0)
+        {
+            buildFirstTier(".", tier_postings);
+        }
+        if (!pairs_file.empty())
+        {
+            buildPairIndex(".", pairs_file, pair_budget);
+        }
+        writeBuildReport(BUILD_REPORT_FILE);
+    }
+    else
+    {
+        std::cerr << "Usage: " << argv[0] << " [--reorder] [--impacts | --tier <postings per term>] [--parallel-inflate <threads>]\n"
+                  << "       " << std::string(std::strlen(argv[0]), ' ') << " [--pairs <query log> [--pair-budget <MB>]] [--block-size <postings>]\n"
+                  << "       " << std::string(std::strlen(argv[0]), ' ') << " [--debug-dumps] <input>...\n"
+                  << "       " << argv[0] << " --segment <index dir> <input>...\n"
+                  << "       " << argv[0] << " --merge <index dir>\n"
+                  << "       " << argv[0] << " --delete <index dir> <doc_id>...\n"
+                  << "       " << argv[0] << " --compact <index dir> [deleted ratio]\n"
+                  << "       " << argv[0] << " --shards <count> <index dir> <input>...\n"
+                  << "inputs are .tar.gz, .gz or plain text files with one \"doc_id<TAB>text\" line per doc, - reads stdin" << std::endl;
         return 1;
     }
-
-    std::string filename = argv[1];
-    processTarGz(filename, CHUNK_SIZE);
     std::cout << "done" << std::endl;
     return 0;
 }
@@ -0,0 +1,238 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+// Format of an index directory, shared by build_index, search and index_inspect. A list is a run of
+// blocks of block size postings: all doc_id gaps, then all counts, then the second term's counts of
+// a pair list, encoded by the codec of the format header. Gaps restart from the last doc_id of the
+// previous block. A bitmap list is one block: varbyte first word and word count, the 64 bit words,
+// then the counts
+const int POSTING_PER_BLOCK = 128; // block size of indexes written without --block-size
+const int LIST_BLOCKS = 0; // list types, last column of the lexicon
+const int LIST_BITMAP = 1; // dense list, one bit per doc_id of its range followed by the counts
+const int LIST_PAIR = 2;   // pair index list, blocks hold the counts of the second term after those of the first
+const int VARBYTE_MAX_BYTES = 5; // bytes of the longest 32 bit varbyte value
+
+// index files, relative to the index or segment directory
+const std::string LEXICON_FILE = "final_sorted_lexicon.txt";
+const std::string INDEX_FILE = "final_sorted_index.bin";
+const std::string BLOCK_INFO_FILE = "final_sorted_block_info.bin"; // (last doc_id, block size) pairs
+const std::string DOC_INFO_FILE = "document_info.txt";
+const std::string LIVE_DOCS_FILE = "live_docs.bin"; // one bit per doc, 1 = live, missing file = all live
+const std::string DOC_MAP_FILE = "doc_map.bin";     // global doc_id of every local doc_id, written once docs were dropped
+const std::string SEGMENT_MANIFEST = "segments.txt";      // live segments of an index directory
+const std::string SEGMENT_INFO_FILE = "segment_info.txt"; // doc_base and doc_count of one segment
+const std::string IMPACT_INFO_FILE = "impact_info.txt";   // score of one impact unit, present if counts are impacts
+const std::string TIER_DIR = "tier1";                     // first tier of statically pruned lists
+const std::string TIER_BOUNDS_FILE = "tier_bounds.txt";   // avg doc length, then "term max_part pruned_part" lines
+const std::string GLOBAL_STATS_FILE = "global_stats.txt"; // collection stats written next to the segments of a shard
+const std::string PAIR_DIR = "pairs";                     // term-pair index
+const char PAIR_SEPARATOR = '+';                          // pair lexicon terms are "first+second" with first < second
+const std::string FORMAT_FILE = "index_format.txt";       // format header, "codec block_size scoring"
+
+// format header values, a directory without FORMAT_FILE holds varbyte lists of POSTING_PER_BLOCK
+const int CODEC_VARBYTE = 0;
+const int SCORING_BM25 = 0;   // lists hold term counts
+const int SCORING_IMPACT = 1; // lists hold quantized BM25 impacts, scaled by IMPACT_INFO_FILE
+const char *const CODEC_NAMES[] = {"varbyte"};
+const char *const SCORING_NAMES[] = {"bm25", "impact"};
+
+// BM25 parameters, impacts quantized by build_index must score like search
+const double BM25_K1 = 1.2;
+const double BM25_B = 0.75;
+
+inline void appendVarbyte(std::vector<uint8_t> &bytes, uint32_t number)
+{
+    while (number >= 128)
+    {
+        bytes.push_back((number & 127) | 128);
+        number >>= 7;
+    }
+    bytes.push_back(number);
+}
+
+inline size_t varbyteEncodedSize(uint32_t number)
+{
+    size_t size = 1;
+    for (; number >= 128; number >>= 7)
+        size++;
+    return size;
+}
+
+// value of the little endian varbyte bytes of one number
+inline uint32_t varbyteDecode(const std::vector<uint8_t> &bytes)
+{
+    uint32_t number = 0;
+    for (int i = bytes.size() - 1; i >= 0; --i)
+    {
+        number = (number << 7) | (bytes[i] & 127);
+    }
+    return number;
+}
+
+// varbyte value at data, bytes_read is set to its length. Stops after max_size bytes
+inline int varbyteDecode(const uint8_t *data, size_t max_size, size_t &bytes_read)
+{
+    int value = 0;
+    int shift = 0;
+    bytes_read = 0;
+
+    for (size_t i = 0; i < max_size; ++i)
+    {
+        uint8_t byte = data[i];
+        value |= (byte & 0x7F) << shift; // Use lower 7 bits
+        shift += 7;
+        bytes_read++;
+
+        if (!(byte & 0x80)) // high bit is set on every byte except the last one
+        {
+            break;
+        }
+    }
+
+    return value;
+}
+
+// Decode count varbyte values of a block section into out. With Delta the values are gaps added up
+// from base, as the doc_ids of a block. A Count above 0 fixes the count at compile time, so the
+// loop of a full block has a constant trip count. Values with VARBYTE_MAX_BYTES left in the section
+// are decoded without a bounds check per byte. Returns the bytes read
+template <int Count, bool Delta>
+inline size_t decodeVarbytes(const uint8_t *data, size_t size, int count, int base, int *out)
+{
+    if constexpr (Count > 0)
+        count = Count;
+    size_t pos = 0;
+    int value = base;
+    for (int i = 0; i < count; ++i)
+    {
+        uint32_t decoded = 0;
+        if (pos + VARBYTE_MAX_BYTES <= size)
+        {
+            uint8_t byte;
+            int shift = 0;
+            do
+            {
+                byte = data[pos++];
+                decoded |= uint32_t(byte & 127) << shift;
+                shift += 7;
+            } while ((byte & 128) && shift < 7 * VARBYTE_MAX_BYTES);
+        }
+        else
+        {
+            size_t bytes_read;
+            decoded = varbyteDecode(data + pos, size - pos, bytes_read);
+            pos += bytes_read;
+        }
+        if constexpr (Delta)
+            value += decoded;
+        else
+            value = decoded;
+        out[i] = value;
+    }
+    return pos;
+}
+
+// VarbyteCodec struct, block values as little endian varbytes. A codec is a policy type with the
+// id of its format header value and the decoder of the values of a block
+struct VarbyteCodec
+{
+    static const int ID = CODEC_VARBYTE;
+
+    // decodeVarbytes for count values of a block, full blocks take the BlockSize instantiation
+    template <int BlockSize, bool Delta>
+    static size_t decodeBlock(const uint8_t *data, size_t size, int count, int base, int *out)
+    {
+        if (count == BlockSize)
+            return decodeVarbytes<BlockSize, Delta>(data, size, count, base, out);
+        return decodeVarbytes<0, Delta>(data, size, count, base, out);
+    }
+};
+
+// IndexFormat struct, the format header of an index, segment, tier or pair directory
+struct IndexFormat
+{
+    int codec = CODEC_VARBYTE;
+    int block_size = POSTING_PER_BLOCK;
+    int scoring = SCORING_BM25;
+
+    bool operator==(const IndexFormat &other) const = default;
+
+    std::string name() const
+    {
+        return std::string(CODEC_NAMES[codec]) + " " + std::to_string(block_size) + " " + SCORING_NAMES[scoring];
+    }
+};
+
+// Call visit(block size, codec) with the block size as a std::integral_constant and a codec object,
+// the one place naming the block sizes and codecs lists are compiled for. Returns false for a
+// format without an instantiation
+template <class Visit>
+inline bool visitFormat(const IndexFormat &format, Visit &&visit)
+{
+    if (format.codec != CODEC_VARBYTE)
+        return false;
+    switch (format.block_size)
+    {
+    case 64:
+        visit(std::integral_constant<int, 64>(), VarbyteCodec());
+        return true;
+    case 128:
+        visit(std::integral_constant<int, 128>(), VarbyteCodec());
+        return true;
+    case 256:
+        visit(std::integral_constant<int, 256>(), VarbyteCodec());
+        return true;
+    }
+    return false;
+}
+
+inline bool supportedFormat(const IndexFormat &format)
+{
+    return visitFormat(format, [](auto, auto) {});
+}
+
+// index of name in names, -1 if it is none of them
+template <size_t N>
+inline int formatValue(const char *const (&names)[N], const std::string &name)
+{
+    for (size_t i = 0; i < N; ++i)
+    {
+        if (name == names[i])
+            return i;
+    }
+    return -1;
+}
+
+// Read the format header of dir. Directories written before the header hold varbyte lists of
+// POSTING_PER_BLOCK, impacts if they have an IMPACT_INFO_FILE. False for a header naming a codec,
+// block size or scoring model this build has no instantiation for
+inline bool readIndexFormat(const std::string &dir, IndexFormat &format)
+{
+    format = IndexFormat();
+    std::ifstream file(dir + "/" + FORMAT_FILE);
+    if (!file)
+    {
+        if (std::filesystem::exists(dir + "/" + IMPACT_INFO_FILE))
+            format.scoring = SCORING_IMPACT;
+        return true;
+    }
+    std::string codec, scoring;
+    if (!(file >> codec >> format.block_size >> scoring))
+        return false;
+    format.codec = formatValue(CODEC_NAMES, codec);
+    format.scoring = formatValue(SCORING_NAMES, scoring);
+    return format.scoring >= 0 && supportedFormat(format);
+}
+
+inline void writeIndexFormat(const std::string &dir, const IndexFormat &format)
+{
+    std::ofstream file(dir + "/" + FORMAT_FILE);
+    file << format.name() << "\n";
+}
@@ -0,0 +1,369 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <array>
+#include <algorithm>
+#include <unordered_map>
+#include <cstdint>
+#include <cstring>
+#include <iomanip>
+#include "index_format.h"
+
+// index_inspect reads the binary index of a directory written by build_index and reports where
+// its bytes go, --verify decodes every list and checks it against the lexicon and block info
+const int HEAVIEST_TERMS = 20;
+const int HIST_BUCKETS = 40; // log2 buckets
+
+struct Term
+{
+    std::string word;
+    int64_t postings;
+    int64_t start;
+    int64_t bytes;
+    int list_type;
+};
+
+// Decoded list with the bytes spent on each part
+struct DecodedList
+{
+    std::vector<int> doc_ids;
+    int64_t gap_bytes = 0;
+    int64_t count_bytes = 0; // counts of both terms for a pair list
+    std::vector<std::pair<int, int64_t>> blocks; // last doc_id and bytes of every block
+    std::string error;
+};
+
+struct BucketStats
+{
+    int64_t lists = 0;
+    int64_t postings = 0;
+    int64_t bytes = 0;
+};
+
+int log2Bucket(int64_t value)
+{
+    int bucket = 0;
+    while (value > 1 && bucket < HIST_BUCKETS - 1)
+    {
+        value >>= 1;
+        bucket++;
+    }
+    return bucket;
+}
+
+// varbyte value at pos, high bit set on every byte but the last. Returns false past the end, unlike
+// the decoders of index_format.h, so --verify reports truncated lists
+bool varbyteDecode(const uint8_t *data, size_t size, size_t &pos, int &value)
+{
+    value = 0;
+    for (int shift = 0; pos < size && shift < 35; shift += 7)
+    {
+        uint8_t byte = data[pos++];
+        value |= (byte & 0x7F) << shift;
+        if (!(byte & 0x80))
+            return true;
+    }
+    return false;
+}
+
+DecodedList decodeList(const Term &term, const uint8_t *data, int block_size)
+{
+    DecodedList list;
+    size_t size = term.bytes;
+    size_t pos = 0;
+    int value;
+    if (term.list_type == LIST_BITMAP)
+    {
+        int first_word, num_words;
+        if (!varbyteDecode(data, size, pos, first_word) || !varbyteDecode(data, size, pos, num_words) ||
+            pos + int64_t(num_words) * sizeof(uint64_t) > size)
+        {
+            list.error = "bitmap header past the end of the list";
+            return list;
+        }
+        for (int i = 0; i < num_words; ++i)
+        {
+            uint64_t bits;
+            std::memcpy(&bits, data + pos + i * sizeof(uint64_t), sizeof(bits));
+            for (; bits != 0; bits &= bits - 1)
+                list.doc_ids.push_back((first_word + i) * 64 + __builtin_ctzll(bits));
+        }
+        pos += num_words * sizeof(uint64_t);
+        list.gap_bytes = pos;
+        for (size_t i = 0; i < list.doc_ids.size(); ++i)
+        {
+            if (!varbyteDecode(data, size, pos, value))
+            {
+                list.error = "bitmap counts past the end of the list";
+                return list;
+            }
+        }
+        list.count_bytes = pos - list.gap_bytes;
+        list.blocks.emplace_back(list.doc_ids.empty() ? 0 : list.doc_ids.back(), pos);
+    }
+    else
+    {
+        int counts_per_posting = term.list_type == LIST_PAIR ? 2 : 1;
+        int doc_id = 0;
+        int64_t left = term.postings;
+        while (left > 0 && pos < size)
+        {
+            size_t block_start = pos;
+            int count = std::min<int64_t>(left, block_size);
+            for (int i = 0; i < count; ++i)
+            {
+                if (!varbyteDecode(data, size, pos, value))
+                {
+                    list.error = "doc_id gaps past the end of the list";
+                    return list;
+                }
+                if (value <= 0 && !list.doc_ids.empty())
+                {
+                    list.error = "doc_ids not increasing";
+                    return list;
+                }
+                doc_id += value;
+                list.doc_ids.push_back(doc_id);
+            }
+            size_t counts_start = pos;
+            for (int i = 0; i < count * counts_per_posting; ++i)
+            {
+                if (!varbyteDecode(data, size, pos, value))
+                {
+                    list.error = "counts past the end of the list";
+                    return list;
+                }
+            }
+            list.gap_bytes += counts_start - block_start;
+            list.count_bytes += pos - counts_start;
+            list.blocks.emplace_back(doc_id, pos - block_start);
+            left -= count;
+        }
+    }
+    if (pos != size)
+        list.error = "list decodes to " + std::to_string(pos) + " of " + std::to_string(size) + " bytes";
+    return list;
+}
+
+void printHistogram(const std::string &title, const std::array<int64_t, HIST_BUCKETS> &hist, const std::string &unit)
+{
+    std::cout << title << std::endl;
+    int64_t total = 0;
+    for (int64_t n : hist)
+        total += n;
+    for (int bucket = 0; bucket < HIST_BUCKETS; ++bucket)
+    {
+        if (hist[bucket] == 0)
+            continue;
+        std::cout << "  >= " << std::setw(10) << (int64_t(1) << bucket) << " " << unit << ": " << std::setw(12) << hist[bucket]
+                  << " (" << std::fixed << std::setprecision(1) << 100.0 * hist[bucket] / total << "%)" << std::endl;
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    // index_inspect [--verify] [--queries <file>] <index dir>
+    bool verify = false;
+    std::string queries_file;
+    std::string dir;
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+        if (arg == "--verify")
+            verify = true;
+        else if (arg == "--queries" && i + 1 < argc)
+            queries_file = argv[++i];
+        else
+            dir = arg;
+    }
+    if (dir.empty())
+    {
+        std::cerr << "Usage: " << argv[0] << " [--verify] [--queries <file>] <index dir>" << std::endl;
+        return 1;
+    }
+
+    IndexFormat format;
+    if (!readIndexFormat(dir, format))
+    {
+        std::cerr << "Unsupported index format in " << dir << std::endl;
+        return 1;
+    }
+    std::vector<Term> terms;
+    std::ifstream lexicon_file(dir + "/" + LEXICON_FILE);
+    std::string line;
+    while (std::getline(lexicon_file, line))
+    {
+        std::istringstream fields(line);
+        Term term{};
+        int64_t term_id;
+        if (!(fields >> term.word >> term_id >> term.postings >> term.start >> term.bytes))
+            continue;
+        if (!(fields >> term.list_type))
+            term.list_type = 0; // indexes written before bitmap lists
+        terms.push_back(term);
+    }
+    std::ifstream index_file(dir + "/" + INDEX_FILE, std::ios::binary);
+    std::vector<uint8_t> index((std::istreambuf_iterator<char>(index_file)), std::istreambuf_iterator<char>());
+    std::ifstream block_info_file(dir + "/" + BLOCK_INFO_FILE, std::ios::binary);
+    std::vector<std::pair<int, int64_t>> block_info; // last doc_id and bytes of every block
+    std::pair<int, int64_t> block;
+    while (block_info_file.read(reinterpret_cast<char *>(&block), sizeof(block)))
+        block_info.push_back(block);
+    int64_t doc_count = 0;
+    std::ifstream doc_info(dir + "/" + DOC_INFO_FILE);
+    while (std::getline(doc_info, line))
+        doc_count++;
+    if (terms.empty() || index.empty())
+    {
+        std::cerr << "No index found in " << dir << std::endl;
+        return 1;
+    }
+
+    // block info is in index order, map the start of every block to its entry
+    std::unordered_map<int64_t, size_t> block_at;
+    int64_t block_start = 0;
+    for (size_t i = 0; i < block_info.size(); ++i)
+    {
+        block_at[block_start] = i;
+        block_start += block_info[i].second;
+    }
+
+    std::array<BucketStats, HIST_BUCKETS> by_length{};
+    std::array<int64_t, HIST_BUCKETS> block_fill{};
+    std::array<int64_t, HIST_BUCKETS> block_bytes{};
+    std::array<int64_t, HIST_BUCKETS> gaps{};
+    int64_t total_postings = 0, gap_bytes = 0, count_bytes = 0, bitmap_lists = 0, pair_lists = 0, errors = 0;
+    for (const Term &term : terms)
+    {
+        BucketStats &bucket = by_length[log2Bucket(term.postings)];
+        bucket.lists++;
+        bucket.postings += term.postings;
+        bucket.bytes += term.bytes;
+        total_postings += term.postings;
+        bitmap_lists += term.list_type == LIST_BITMAP;
+        pair_lists += term.list_type == LIST_PAIR;
+        if (term.start < 0 || term.start + term.bytes > int64_t(index.size()))
+        {
+            std::cerr << "ERROR " << term.word << ": list past the end of the index" << std::endl;
+            errors++;
+            continue;
+        }
+
+        DecodedList list = decodeList(term, index.data() + term.start, format.block_size);
+        gap_bytes += list.gap_bytes;
+        count_bytes += list.count_bytes;
+        for (size_t i = 0; i < list.doc_ids.size(); ++i)
+            gaps[log2Bucket(i == 0 ? list.doc_ids[i] + 1 : list.doc_ids[i] - list.doc_ids[i - 1])]++;
+        for (size_t i = 0; i < list.blocks.size(); ++i)
+        {
+            int postings = term.list_type == LIST_BITMAP ? term.postings : std::min<int64_t>(term.postings - i * format.block_size, format.block_size);
+            block_fill[log2Bucket(postings)]++;
+            block_bytes[log2Bucket(list.blocks[i].second)]++;
+        }
+        if (!verify)
+            continue;
+
+        std::string error = list.error;
+        if (error.empty() && int64_t(list.doc_ids.size()) != term.postings)
+            error = "decoded " + std::to_string(list.doc_ids.size()) + " postings, lexicon says " + std::to_string(term.postings);
+        if (error.empty() && doc_count > 0 && !list.doc_ids.empty() && list.doc_ids.back() >= doc_count)
+            error = "doc_id " + std::to_string(list.doc_ids.back()) + " past the " + std::to_string(doc_count) + " docs";
+        auto first_block = block_at.find(term.start);
+        if (error.empty() && first_block == block_at.end())
+            error = "no block info entry at the start of the list";
+        for (size_t i = 0; error.empty() && i < list.blocks.size(); ++i)
+        {
+            size_t entry = first_block->second + i;
+            if (entry >= block_info.size() || block_info[entry] != list.blocks[i])
+                error = "block " + std::to_string(i) + " does not match the block info";
+        }
+        if (!error.empty())
+        {
+            std::cerr << "ERROR " << term.word << ": " << error << std::endl;
+            errors++;
+        }
+    }
+
+    std::cout << std::fixed << std::setprecision(2);
+    std::cout << "Index " << dir << ": " << terms.size() << " terms (" << bitmap_lists << " bitmap, " << pair_lists
+              << " pair lists), " << total_postings << " postings, " << doc_count << " docs, " << index.size()
+              << " bytes, " << block_info.size() << " blocks, format " << format.name() << std::endl;
+    std::cout << "Bits per posting: " << 8.0 * index.size() / total_postings << " (doc_ids "
+              << 8.0 * gap_bytes / total_postings << ", counts " << 8.0 * count_bytes / total_postings << ")" << std::endl;
+
+    std::cout << "Bits per posting by list length" << std::endl;
+    for (int bucket = 0; bucket < HIST_BUCKETS; ++bucket)
+    {
+        const BucketStats &stats = by_length[bucket];
+        if (stats.lists == 0)
+            continue;
+        std::cout << "  >= " << std::setw(10) << (int64_t(1) << bucket) << " postings: " << std::setw(10) << stats.lists
+                  << " lists, " << std::setw(12) << stats.postings << " postings, " << std::setw(8)
+                  << 8.0 * stats.bytes / stats.postings << " bits per posting" << std::endl;
+    }
+    printHistogram("Block fill, a bitmap list is one block", block_fill, "postings");
+    printHistogram("Block size", block_bytes, "bytes");
+    printHistogram("Doc_id gaps", gaps, "docs");
+
+    std::vector<const Term *> heaviest;
+    for (const Term &term : terms)
+        heaviest.push_back(&term);
+    size_t top = std::min<size_t>(HEAVIEST_TERMS, heaviest.size());
+    std::partial_sort(heaviest.begin(), heaviest.begin() + top, heaviest.end(), [](const Term *a, const Term *b)
+                      { return a->bytes > b->bytes; });
+    std::cout << "Heaviest terms" << std::endl;
+    for (size_t i = 0; i < top; ++i)
+    {
+        std::cout << "  " << std::setw(20) << heaviest[i]->word << ": " << std::setw(12) << heaviest[i]->bytes << " bytes, "
+                  << std::setw(10) << heaviest[i]->postings << " postings, " << std::setw(5)
+                  << 100.0 * heaviest[i]->bytes / index.size() << "% of the index" << std::endl;
+    }
+
+    // query cost is the postings and bytes of the lists a query has to read
+    if (!queries_file.empty())
+    {
+        std::unordered_map<std::string, const Term *> lexicon;
+        for (const Term &term : terms)
+            lexicon[term.word] = &term;
+        std::ifstream queries(queries_file);
+        int64_t query_count = 0, query_postings = 0, query_bytes = 0, max_bytes = 0;
+        std::string max_query;
+        while (std::getline(queries, line))
+        {
+            std::istringstream words(line);
+            std::string word;
+            int64_t bytes = 0;
+            while (words >> word)
+            {
+                std::transform(word.begin(), word.end(), word.begin(), ::tolower);
+                auto it = lexicon.find(word);
+                if (it == lexicon.end())
+                    continue;
+                query_postings += it->second->postings;
+                bytes += it->second->bytes;
+            }
+            query_count++;
+            query_bytes += bytes;
+            if (bytes > max_bytes)
+            {
+                max_bytes = bytes;
+                max_query = line;
+            }
+        }
+        std::cout << "Queries " << queries_file << ": " << query_count << " queries, " << query_postings << " postings, "
+                  << query_bytes << " bytes";
+        if (query_count > 0)
+            std::cout << ", " << query_bytes / query_count << " bytes per query, most expensive \"" << max_query
+                      << "\" with " << max_bytes << " bytes";
+        std::cout << std::endl;
+    }
+
+    if (verify)
+    {
+        std::cout << (errors == 0 ? "Index verified" : "Index verification failed: " + std::to_string(errors) + " bad lists")
+                  << std::endl;
+    }
+    return errors == 0 ? 0 : 1;
+}
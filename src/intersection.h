@@ -0,0 +1,119 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <numeric>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+// probed lists this many times longer than the rarest list are searched with SIMD
+const int SIMD_SEARCH_SKEW = 16;
+
+// Galloping search: index of the first doc_id >= target in ids[pos, size), size if there is none
+inline int findGEQ(const int *ids, int pos, int size, int target)
+{
+    int low = pos;
+    int high = pos;
+    int step = 1;
+    while (high < size && ids[high] < target)
+    {
+        low = high + 1;
+        high += step;
+        step *= 2;
+    }
+    return std::lower_bound(ids + low, ids + std::min(high, size), target) - ids;
+}
+
+#if defined(__x86_64__)
+// findGEQ that gallops over 8 doc_id chunks and compares a whole chunk at once, long jumps of
+// skewed lists land in the right chunk after a few probes
+__attribute__((target("avx2"))) inline int findGEQAvx2(const int *ids, int pos, int size, int target)
+{
+    int low = pos;
+    int step = 8;
+    while (low + step < size && ids[low + step - 1] < target)
+    {
+        low += step;
+        step *= 2;
+    }
+    int end = std::min(low + step, size);
+    const __m256i below = _mm256_set1_epi32(target - 1); // doc_ids are never negative
+    for (; low + 8 <= end; low += 8)
+    {
+        __m256i chunk = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(ids + low));
+        int mask = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(chunk, below)));
+        if (mask)
+            return low + __builtin_ctz(mask);
+    }
+    while (low < end && ids[low] < target)
+        low++;
+    return low;
+}
+#endif
+
+inline int findGEQSimd(const int *ids, int pos, int size, int target)
+{
+#if defined(__x86_64__)
+    static const bool has_avx2 = __builtin_cpu_supports("avx2");
+    if (has_avx2)
+        return findGEQAvx2(ids, pos, size, target);
+#endif
+    return findGEQ(ids, pos, size, target);
+}
+
+// Conjunctive intersection. The rarest list proposes candidates, the others are probed in order of
+// length with nextGEQ, and a probe that jumps past the candidate makes the rarest list catch up.
+// Cursor needs next(doc_id), nextGEQ(target, doc_id), freq() of the posting returned last,
+// getPostingsNum() and setSimdSearch(bool). Freqs are only asked for on a match, so cursors can
+// leave them undecoded for the postings passed over. on_match(doc_id, freqs) gets the freqs in the
+// order of lists
+template <typename Cursor, typename OnMatch>
+void intersectLists(std::vector<Cursor> &lists, OnMatch on_match)
+{
+    size_t n = lists.size();
+    if (n == 0)
+        return;
+    std::vector<size_t> order(n);
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(),
+                     [&lists](size_t a, size_t b)
+                     { return lists[a].getPostingsNum() < lists[b].getPostingsNum(); });
+    for (size_t i = 1; i < n; ++i)
+    {
+        Cursor &list = lists[order[i]];
+        list.setSimdSearch(list.getPostingsNum() >= int64_t(SIMD_SEARCH_SKEW) * lists[order[0]].getPostingsNum());
+    }
+
+    std::vector<int> doc_ids(n, -1); // current doc_id of every list, -1 before the first one
+    std::vector<int> freqs(n, 0);
+    size_t rarest = order[0];
+    if (!lists[rarest].next(doc_ids[rarest]))
+        return;
+    size_t i = 1;
+    while (true)
+    {
+        int candidate = doc_ids[rarest];
+        if (i == n)
+        {
+            for (size_t j = 0; j < n; ++j)
+                freqs[j] = lists[j].freq();
+            on_match(candidate, freqs);
+            if (!lists[rarest].next(doc_ids[rarest]))
+                return;
+            i = 1;
+            continue;
+        }
+        size_t list = order[i];
+        if (doc_ids[list] < candidate && !lists[list].nextGEQ(candidate, doc_ids[list]))
+            return;
+        if (doc_ids[list] == candidate)
+        {
+            i++;
+            continue;
+        }
+        if (!lists[rarest].nextGEQ(doc_ids[list], doc_ids[rarest]))
+            return;
+        i = 1;
+    }
+}
@@ -0,0 +1,163 @@
+#undef NDEBUG // checks stay on in release builds
+#include <iostream>
+#include <vector>
+#include <random>
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <cassert>
+#include "intersection.h"
+
+// VectorCursor struct, in-memory list with the cursor interface of InvertedList
+struct VectorCursor
+{
+    std::vector<int> doc_ids;
+    int salt; // freqs are derived from the doc_id and the list, so matches can be checked
+    size_t pos = 0;
+    bool simd_search = false;
+    int freqs_read = 0;
+
+    static int freqOf(int doc_id, int salt) { return (doc_id * (salt + 3)) % 11 + 1; }
+
+    bool next(int &doc_id)
+    {
+        if (pos >= doc_ids.size())
+            return false;
+        doc_id = doc_ids[pos++];
+        return true;
+    }
+
+    bool nextGEQ(int target, int &doc_id)
+    {
+        const int *ids = doc_ids.data();
+        int size = doc_ids.size();
+        pos = simd_search ? findGEQSimd(ids, pos, size, target) : findGEQ(ids, pos, size, target);
+        return next(doc_id);
+    }
+
+    int freq()
+    {
+        freqs_read++;
+        return freqOf(doc_ids[pos - 1], salt);
+    }
+
+    int getPostingsNum() const { return doc_ids.size(); }
+    void setSimdSearch(bool simd) { simd_search = simd; }
+};
+
+// sorted random doc_ids in [0, universe)
+std::vector<int> randomList(std::mt19937 &rng, int size, int universe)
+{
+    std::vector<int> doc_ids(size);
+    std::uniform_int_distribution<int> dist(0, universe - 1);
+    for (int &doc_id : doc_ids)
+        doc_id = dist(rng);
+    std::sort(doc_ids.begin(), doc_ids.end());
+    doc_ids.erase(std::unique(doc_ids.begin(), doc_ids.end()), doc_ids.end());
+    return doc_ids;
+}
+
+// both block searches against std::lower_bound
+void testFindGEQ()
+{
+    std::mt19937 rng(42);
+    for (int round = 0; round < 2000; ++round)
+    {
+        std::vector<int> ids = randomList(rng, rng() % 300, 1000);
+        int size = ids.size();
+        int pos = size > 0 ? rng() % (size + 1) : 0;
+        int target = rng() % 1100;
+        int expected = std::max<int>(pos, std::lower_bound(ids.begin() + pos, ids.end(), target) - ids.begin());
+        assert(findGEQ(ids.data(), pos, size, target) == expected && "findGEQ mismatch");
+        assert(findGEQSimd(ids.data(), pos, size, target) == expected && "findGEQSimd mismatch");
+    }
+    std::cout << "findGEQ tests passed" << std::endl;
+}
+
+// intersectLists against a brute force intersection, for even and very skewed list lengths
+void testIntersection()
+{
+    std::mt19937 rng(7);
+    for (int round = 0; round < 300; ++round)
+    {
+        int num_lists = 1 + rng() % 4;
+        int universe = 1000 + rng() % 20000;
+        std::vector<VectorCursor> lists;
+        for (int i = 0; i < num_lists; ++i)
+        {
+            int size = round % 2 ? rng() % universe : rng() % 50; // skewed: some lists nearly dense, some tiny
+            lists.push_back({randomList(rng, size, universe), i});
+        }
+
+        std::vector<int> expected = lists[0].doc_ids;
+        for (int i = 1; i < num_lists; ++i)
+        {
+            std::vector<int> both;
+            std::set_intersection(expected.begin(), expected.end(), lists[i].doc_ids.begin(), lists[i].doc_ids.end(),
+                                  std::back_inserter(both));
+            expected = both;
+        }
+
+        std::vector<int> matched;
+        intersectLists(lists, [&](int doc_id, const std::vector<int> &freqs)
+                       {
+                           for (int i = 0; i < num_lists; ++i)
+                               assert(freqs[i] == VectorCursor::freqOf(doc_id, i) && "freq of the wrong list");
+                           matched.push_back(doc_id); });
+        assert(matched == expected && "intersection mismatch");
+        for (const VectorCursor &list : lists)
+            assert(list.freqs_read == int(matched.size()) && "freq read for a doc that did not match");
+    }
+    std::cout << "intersection tests passed" << std::endl;
+}
+
+// rare + common pairs: linear merge against intersectLists with the skewed list searched by SIMD
+void benchmarkIntersection()
+{
+    std::mt19937 rng(1);
+    const int universe = 10000000;
+    std::vector<int> common = randomList(rng, 2000000, universe);
+    for (int rare_size : {100, 1000, 10000, 100000, 1000000})
+    {
+        std::vector<int> rare = randomList(rng, rare_size, universe);
+        int rounds = 20;
+
+        auto start = std::chrono::steady_clock::now();
+        size_t merged = 0;
+        for (int round = 0; round < rounds; ++round)
+        {
+            std::vector<int> both;
+            std::set_intersection(rare.begin(), rare.end(), common.begin(), common.end(), std::back_inserter(both));
+            merged += both.size();
+        }
+        double merge_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count() / rounds;
+
+        std::vector<VectorCursor> lists{{rare, 0}, {common, 1}};
+        start = std::chrono::steady_clock::now();
+        size_t intersected = 0;
+        for (int round = 0; round < rounds; ++round)
+        {
+            lists[0].pos = 0;
+            lists[1].pos = 0;
+            intersectLists(lists, [&](int, const std::vector<int> &)
+                           { intersected++; });
+        }
+        double adaptive_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count() / rounds;
+        assert(merged == intersected);
+
+        std::cout << "rare " << rare_size << " x common " << common.size()
+                  << ": merge " << merge_ms << "ms, adaptive " << adaptive_ms << "ms" << std::endl;
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    testFindGEQ();
+    testIntersection();
+    if (argc > 1 && std::string(argv[1]) == "--bench")
+    {
+        benchmarkIntersection();
+    }
+    std::cout << "all tests passed!" << std::endl;
+    return 0;
+}
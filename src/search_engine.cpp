@@ -4,27 +4,58 @@
 #include <string>
 #include <unordered_map>
 #include <algorithm>
+#include <numeric>
 #include <queue>
 #include <cmath>
 #include <sstream>
 #include <cstdint>
+#include <cstring>
+#include <chrono>
+#include <limits>
+#include <memory>
+#include <filesystem>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
 #include <zlib.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <csignal>
+#include <fnmatch.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+#include "index_format.h"
+#include "intersection.h"
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define HAVE_IO_URING
+#endif
 
-const int POSTING_PER_BLOCK = 128;
-const std::string LEXICON_FILE = "final_sorted_lexicon.txt";
-const std::string INDEX_FILE = "final_sorted_index.bin";
-const std::string DOC_INFO_FILE = "document_info.txt";
-const std::string BLOCK_INFO_FILE = "final_sorted_block_info2.txt";
 const std::string ORIGINAL_TAR_GZ = "../src/collection.tar.gz";
 
 // parameters
-const double k1 = 1.2;
-const double b = 0.75;
+const size_t BLOCK_SCORING_MAX_TERMS = 3; // disjunctive queries up to this length are scored block at a time
+const int ACCUMULATOR_PARTITION = 64;     // docs per accumulator partition, untouched partitions are skipped
+const int64_t PREFETCH_LIST_BYTES = 1 << 20; // bytes of every query list read ahead in one batch
+const int64_t PREFETCH_CHUNK = 128 << 10;    // prefetch read size, traversal starts once the first chunk arrived
+const unsigned IO_RING_ENTRIES = 64;
+const size_t DICTIONARY_BUCKET = 16;        // terms per front coded bucket of the term dictionary
+const size_t PREFIX_EXPANSION_LIMIT = 64;   // a prefix query term stands for at most this many terms, highest df first
+const int RANGES_PER_THREAD = 4;            // doc_id ranges of a split query per query thread, idle threads take over the rest
+const int PARALLEL_MIN_BLOCKS = 64;         // a query is split if its longest list has this many blocks per range
+const int BITMAP_BUDGET_WORDS = 32;         // bitmap words combined between two query budget checks
+const int64_t WARM_BYTES = 256LL << 20;     // bytes of the longest lists read ahead before a reloaded index goes live
+const std::string RELOAD_COMMAND = ":reload"; // ":reload [dir]" loads the one in dir, or a segmented index again, in the background
 
-// decode function
-uint32_t varbyteDecode(const std::vector<uint8_t> &bytes);
-int varbyteDecode(const uint8_t *data, size_t max_size, size_t &bytes_read);
-size_t varbyteEncodedSize(int value);
+void scoreBlock(const int *doc_ids, const int *freqs, int count, double idf, const double *norms, double *scores);
 
 struct LexiconEntry
 {
@@ -32,241 +63,2179 @@ struct LexiconEntry
     int postings_num;
     int64_t start_position;
     int64_t bytes_size;
+    int list_type = 0;
+    double max_part = 0;    // first tier only, best BM25 frequency part of the full list
+    double pruned_part = 0; // first tier only, best frequency part of the postings left out
 };
 
 struct SearchResult
 {
     int doc_id;
     double score;
+    double bound = 0; // score a first tier result may still gain from pruned postings
 };
 
+// QueryStats struct, per-query execution counters, empty unless built with QUERY_STATS
+struct QueryStats
+{
+#ifdef QUERY_STATS
+    int64_t lists_opened = 0;
+    int64_t blocks_loaded = 0;
+    int64_t blocks_skipped = 0; // passed by nextGEQ without decoding
+    int64_t bytes_read = 0;
+    int64_t postings_decoded = 0;
+    int64_t freqs_decoded = 0; // freqs of block lists are decoded only for blocks a doc was scored in
+    int64_t docs_scored = 0;
+    int64_t heap_insertions = 0;
+    int64_t tier_answers = 0;   // segments answered from the first tier
+    int64_t tier_fallbacks = 0; // segments that needed the full index after the first tier
+    int64_t pair_lists = 0; // pairs of query terms answered from the pair index
+    int64_t prefetched_bytes = 0;
+    int64_t io_waits = 0; // blocks whose prefetch had not arrived when traversal reached them
+    double lookup_ms = 0;
+    double traversal_ms = 0;
+    double ranking_ms = 0;
+#endif
+
+    // add the counters of a range traversed by another thread, its time is part of traversal_ms
+    void add(const QueryStats &other)
+    {
+#ifdef QUERY_STATS
+        lists_opened += other.lists_opened;
+        blocks_loaded += other.blocks_loaded;
+        blocks_skipped += other.blocks_skipped;
+        bytes_read += other.bytes_read;
+        postings_decoded += other.postings_decoded;
+        freqs_decoded += other.freqs_decoded;
+        docs_scored += other.docs_scored;
+        heap_insertions += other.heap_insertions;
+        io_waits += other.io_waits;
+#else
+        (void)other;
+#endif
+    }
+};
+
+// QUERY_STAT(stats, field += n) updates a counter, compiles to nothing but a use of stats in release builds
+#ifdef QUERY_STATS
+#define QUERY_STAT(stats, expr) ((stats).expr)
+#else
+#define QUERY_STAT(stats, expr) ((void)(stats))
+#endif
+
+// QueryTimer struct, adds its lifetime to one of the QueryStats timers
+struct QueryTimer
+{
+#ifdef QUERY_STATS
+    double &target_;
+    std::chrono::steady_clock::time_point start_;
+
+    QueryTimer(double &target) : target_(target), start_(std::chrono::steady_clock::now()) {}
+    ~QueryTimer()
+    {
+        target_ += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start_).count();
+    }
+#endif
+};
+
+#ifdef QUERY_STATS
+#define QUERY_TIMER(stats, field) QueryTimer query_timer_##field((stats).field)
+#else
+#define QUERY_TIMER(stats, field) ((void)(stats))
+#endif
+
+// QueryBudget struct, time and postings a query may spend, 0 for no limit. Lists check it when
+// they move to another block and end early once it is spent, the traversal then returns the best
+// results found so far
+struct QueryBudget
+{
+    std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max();
+    int64_t max_postings = 0;
+    std::atomic<int64_t> postings_total = 0; // postings of the lists opened
+    std::atomic<int64_t> postings_done = 0;  // postings of the blocks decoded or skipped, by all query threads
+    std::atomic<bool> spent = false;
+
+    QueryBudget(double max_ms, int64_t max_postings) : max_postings(max_postings)
+    {
+        if (max_ms > 0)
+            deadline = std::chrono::steady_clock::now() + std::chrono::microseconds(static_cast<int64_t>(max_ms * 1000));
+    }
+
+    bool limited() const { return max_postings > 0 || deadline != std::chrono::steady_clock::time_point::max(); }
+
+    // called at block boundaries, true once the budget ran out
+    bool exceeded()
+    {
+        if (!spent && limited())
+            spent = (max_postings > 0 && postings_done >= max_postings) || std::chrono::steady_clock::now() >= deadline;
+        return spent;
+    }
+
+    // a budget spent before any list was opened processed nothing
+    double processed() const
+    {
+        if (postings_total == 0)
+            return spent ? 0 : 1;
+        return std::min(1.0, double(postings_done) / postings_total);
+    }
+};
+
+// SearchResponse struct, top results together with the stats of the query
+struct SearchResponse
+{
+    std::vector<SearchResult> results;
+    QueryStats stats;
+    bool truncated = false; // the query budget ran out, results are the best found until then
+    double processed = 1;   // fraction of the query's postings processed
+};
+
+// LiveDocs struct, deleted docs of a segment with a deleted count per 64 docs
+struct LiveDocs
+{
+    std::vector<uint64_t> bits;      // 1 = live, empty if no doc is deleted
+    std::vector<int> deleted_before; // deleted docs before each word of bits
+    std::filesystem::file_time_type file_time;
+
+    void load(const std::string &live_docs_file, int doc_count)
+    {
+        bits.clear();
+        deleted_before.clear();
+        std::error_code ec;
+        file_time = std::filesystem::last_write_time(live_docs_file, ec);
+        std::ifstream file(live_docs_file, std::ios::binary);
+        if (!file.is_open())
+            return;
+        bits.assign((doc_count + 63) / 64, ~uint64_t(0));
+        file.read(reinterpret_cast<char *>(bits.data()), bits.size() * sizeof(uint64_t));
+        deleted_before.resize(bits.size() + 1, 0);
+        for (size_t i = 0; i < bits.size(); ++i)
+        {
+            deleted_before[i + 1] = deleted_before[i] + __builtin_popcountll(~bits[i]);
+        }
+    }
+
+    bool isLive(int doc_id) const
+    {
+        return bits.empty() || ((bits[doc_id >> 6] >> (doc_id & 63)) & 1);
+    }
+
+    // number of deleted docs in [0, doc_id)
+    int rank(int doc_id) const
+    {
+        int word = doc_id >> 6;
+        uint64_t below = (uint64_t(1) << (doc_id & 63)) - 1;
+        int in_word = size_t(word) < bits.size() ? __builtin_popcountll(~bits[word] & below) : 0;
+        return deleted_before[word] + in_word;
+    }
+
+    // true if no doc in [first, last] is deleted, whole blocks then skip the per-doc test
+    bool allLive(int first, int last) const
+    {
+        return bits.empty() || rank(last + 1) == rank(first);
+    }
+};
+
+// IndexFile struct, read-only descriptor of an index file, blocks are read with pread or io_uring
+struct IndexFile
+{
+    int fd = -1;
+
+    IndexFile() = default;
+    IndexFile(const IndexFile &) = delete;
+    IndexFile &operator=(const IndexFile &) = delete;
+    ~IndexFile()
+    {
+        if (fd >= 0)
+            ::close(fd);
+    }
+
+    void open(const std::string &path) { fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC); }
+    bool is_open() const { return fd >= 0; }
+};
+
+// read size bytes at offset, short only at the end of the file
+size_t preadFully(int fd, uint8_t *buffer, size_t size, int64_t offset)
+{
+    size_t done = 0;
+    while (done < size)
+    {
+        ssize_t n = pread(fd, buffer + done, size - done, offset + done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        done += n;
+    }
+    return done;
+}
+
+// IndexTier struct, statically pruned copy of a segment's lists, small enough to stay in memory
+struct IndexTier
+{
+    std::unordered_map<std::string, LexiconEntry> lexicon;
+    std::vector<std::pair<int, int64_t>> block;
+    IndexFile index_file;
+    double avg_doc_length = 0; // bounds are only valid with the stats the tier was built with
+};
+
+// TermDictionary struct, the terms of a lexicon sorted and front coded in buckets of
+// DICTIONARY_BUCKET terms. The first term of a bucket is stored whole, the others as the length of
+// the prefix shared with the previous term and the rest. A prefix lookup binary searches the bucket
+// heads and decodes forward from there
+struct TermDictionary
+{
+    std::vector<uint8_t> data;
+    std::vector<uint32_t> buckets; // offset in data of every bucket
+    std::vector<int> dfs;          // postings of every term in sorted order
+
+    void build(const std::unordered_map<std::string, LexiconEntry> &lexicon)
+    {
+        std::vector<std::string> terms;
+        terms.reserve(lexicon.size());
+        for (const auto &[term, entry] : lexicon)
+            terms.push_back(term);
+        std::sort(terms.begin(), terms.end());
+        data.clear();
+        buckets.clear();
+        dfs.clear();
+        for (size_t i = 0; i < terms.size(); ++i)
+        {
+            dfs.push_back(lexicon.at(terms[i]).postings_num);
+            size_t shared = 0;
+            if (i % DICTIONARY_BUCKET == 0)
+            {
+                buckets.push_back(data.size());
+            }
+            else
+            {
+                const std::string &previous = terms[i - 1];
+                while (shared < previous.size() && shared < terms[i].size() && previous[shared] == terms[i][shared])
+                    shared++;
+                appendVarbyte(data, shared);
+            }
+            appendVarbyte(data, terms[i].size() - shared);
+            data.insert(data.end(), terms[i].begin() + shared, terms[i].end());
+        }
+    }
+
+    // terms starting with prefix in order, with their df
+    std::vector<std::pair<std::string, int64_t>> prefixRange(const std::string &prefix) const
+    {
+        std::vector<std::pair<std::string, int64_t>> terms;
+        if (buckets.empty())
+            return terms;
+        // the last bucket whose head sorts before prefix holds the first match
+        auto it = std::lower_bound(buckets.begin(), buckets.end(), prefix,
+                                   [this](uint32_t offset, const std::string &key)
+                                   { return decodeHead(offset) < key; });
+        size_t bucket = it == buckets.begin() ? 0 : it - buckets.begin() - 1;
+        size_t pos = buckets[bucket];
+        std::string term;
+        for (size_t i = bucket * DICTIONARY_BUCKET; pos < data.size(); ++i)
+        {
+            size_t bytes_read = 0;
+            size_t shared = 0;
+            if (i % DICTIONARY_BUCKET != 0)
+            {
+                shared = varbyteDecode(data.data() + pos, data.size() - pos, bytes_read);
+                pos += bytes_read;
+            }
+            size_t suffix = varbyteDecode(data.data() + pos, data.size() - pos, bytes_read);
+            pos += bytes_read;
+            term.resize(shared);
+            term.append(reinterpret_cast<const char *>(data.data() + pos), suffix);
+            pos += suffix;
+            if (term.starts_with(prefix))
+                terms.emplace_back(term, dfs[i]);
+            else if (term > prefix)
+                break;
+        }
+        return terms;
+    }
+
+private:
+    std::string decodeHead(uint32_t offset) const
+    {
+        size_t bytes_read = 0;
+        size_t size = varbyteDecode(data.data() + offset, data.size() - offset, bytes_read);
+        return std::string(reinterpret_cast<const char *>(data.data() + offset + bytes_read), size);
+    }
+};
+
+// PairIndex struct, intersected lists of frequent term pairs with the freqs of both terms
+struct PairIndex
+{
+    std::unordered_map<std::string, LexiconEntry> lexicon;
+    std::vector<std::pair<int, int64_t>> block;
+    IndexFile index_file;
+};
+
+// Segment struct, one immutable part of the index with its own lexicon, blocks and doc table
+struct Segment
+{
+    std::string name;
+    int doc_base = 0; // global doc_id of the segment's local doc_id 0
+    std::unordered_map<std::string, LexiconEntry> lexicon;
+    TermDictionary dictionary; // sorted terms of lexicon for prefix queries
+    std::vector<std::pair<int, int64_t>> block; // last doc_id and start position of each block
+    IndexFile index_file;
+    std::vector<int64_t> lines_pos;
+    std::vector<int> doc_lengths;
+    std::vector<int> doc_map; // global doc_id of every local doc_id once compaction renumbered docs
+    LiveDocs live_docs;
+    double impact_scale = 0; // score of one impact unit of a segment scored by impacts
+    IndexFormat format; // codec, block size and scoring model of the lists, those of the tier and pairs too
+    std::vector<uint32_t> accumulators; // impact sum per doc, reset after every query
+    std::unique_ptr<IndexTier> first_tier;
+    std::unique_ptr<PairIndex> pair_index;
+    std::vector<double> length_norms;         // k1 * (1 - b + b * length / avg length) of every doc
+    double length_norms_avg = 0;              // average doc length the norms were computed with
+    std::vector<double> scores;               // block scoring accumulators, zero between queries
+    std::vector<uint8_t> touched_partitions;  // partitions of scores holding a nonzero value
+    std::vector<int> union_freqs;             // prefix union accumulators, zero between queries
+    std::vector<uint64_t> union_docs;         // docs with a nonzero union_freqs entry
+    int num_docs = 0;
+    int64_t total_length = 0;
+
+    int globalDocId(int doc_id) const
+    {
+        return doc_map.empty() ? doc_base + doc_id : doc_map[doc_id];
+    }
+
+    int localDocId(int doc_id) const
+    {
+        if (doc_map.empty())
+            return doc_id - doc_base;
+        // reordered segments have an unsorted map, only used for the few results shown
+        return std::find(doc_map.begin(), doc_map.end(), doc_id) - doc_map.begin();
+    }
+};
+
+// IndexSnapshot struct, one version of the index with its collection stats. Queries run on the
+// snapshot current when they start, a reload builds the next one beside it. Segments still listed
+// in a new manifest are shared with the previous snapshot, the others close with the last snapshot
+// holding them
+struct IndexSnapshot
+{
+    std::string dir;
+    bool segmented = false; // dir has a segment manifest, otherwise it holds a single index
+    std::vector<std::shared_ptr<Segment>> segments; // ordered by doc_base
+    std::filesystem::file_time_type manifest_time;
+    int total_docs = 0;
+    double avg_doc_length = 0;
+    int64_t global_docs = 0; // collection wide stats of a shard, 0 if the index is the whole collection
+    int64_t global_length = 0;
+    std::unordered_map<std::string, int64_t> global_df;
+};
+
+// IoRing class, io_uring set up with raw syscalls that only submits reads. Not available where
+// the kernel headers, the kernel or a seccomp filter do not allow io_uring
+class IoRing
+{
+private:
+    int fd_ = -1;
+    unsigned entries_ = 0;
+    unsigned queued_ = 0;  // reads in the submission queue not yet passed to the kernel
+    unsigned pending_ = 0; // reads queued or in flight whose completion was not reaped yet
+#ifdef HAVE_IO_URING
+    void *sq_ring_ = MAP_FAILED;
+    void *cq_ring_ = MAP_FAILED;
+    io_uring_sqe *sqes_ = static_cast<io_uring_sqe *>(MAP_FAILED);
+    size_t sq_ring_size_ = 0;
+    size_t cq_ring_size_ = 0;
+    unsigned *sq_tail_ = nullptr;
+    unsigned *sq_mask_ = nullptr;
+    unsigned *sq_array_ = nullptr;
+    unsigned *cq_head_ = nullptr;
+    unsigned *cq_tail_ = nullptr;
+    unsigned *cq_mask_ = nullptr;
+    io_uring_cqe *cqes_ = nullptr;
+#endif
+
+public:
+    IoRing(unsigned entries)
+    {
+#ifdef HAVE_IO_URING
+        io_uring_params params{};
+        fd_ = syscall(__NR_io_uring_setup, entries, &params);
+        if (fd_ < 0)
+            return;
+        sq_ring_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cq_ring_size_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+        if (single_mmap)
+            sq_ring_size_ = cq_ring_size_ = std::max(sq_ring_size_, cq_ring_size_);
+        sq_ring_ = mmap(nullptr, sq_ring_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQ_RING);
+        cq_ring_ = single_mmap ? sq_ring_
+                               : mmap(nullptr, cq_ring_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_CQ_RING);
+        sqes_ = static_cast<io_uring_sqe *>(mmap(nullptr, params.sq_entries * sizeof(io_uring_sqe), PROT_READ | PROT_WRITE,
+                                                 MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQES));
+        entries_ = params.sq_entries;
+        if (sq_ring_ == MAP_FAILED || cq_ring_ == MAP_FAILED || sqes_ == MAP_FAILED)
+        {
+            release();
+            return;
+        }
+        char *sq = static_cast<char *>(sq_ring_);
+        char *cq = static_cast<char *>(cq_ring_);
+        sq_tail_ = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+        sq_mask_ = reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+        sq_array_ = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+        cq_head_ = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+        cq_tail_ = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+        cq_mask_ = reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+        cqes_ = reinterpret_cast<io_uring_cqe *>(cq + params.cq_off.cqes);
+#endif
+    }
+
+    IoRing(const IoRing &) = delete;
+    IoRing &operator=(const IoRing &) = delete;
+    ~IoRing() { release(); }
+
+    bool available() const { return fd_ >= 0; }
+    unsigned capacity() const { return entries_ - pending_; } // the completion queue never overflows
+    unsigned pending() const { return pending_; }
+
+    // queue a read of size bytes at offset into buffer, tag comes back with its completion
+    void queueRead(int fd, void *buffer, unsigned size, int64_t offset, uint64_t tag)
+    {
+#ifdef HAVE_IO_URING
+        unsigned tail = *sq_tail_;
+        unsigned index = tail & *sq_mask_;
+        io_uring_sqe &sqe = sqes_[index];
+        std::memset(&sqe, 0, sizeof(sqe));
+        sqe.opcode = IORING_OP_READ;
+        sqe.fd = fd;
+        sqe.addr = reinterpret_cast<uint64_t>(buffer);
+        sqe.len = size;
+        sqe.off = offset;
+        sqe.user_data = tag;
+        sq_array_[index] = index;
+        __atomic_store_n(sq_tail_, tail + 1, __ATOMIC_RELEASE);
+        queued_++;
+        pending_++;
+#endif
+    }
+
+    // pass the queued reads to the kernel and wait until at least wait_for completions arrived
+    bool submit(unsigned wait_for)
+    {
+#ifdef HAVE_IO_URING
+        while (true)
+        {
+            long submitted = syscall(__NR_io_uring_enter, fd_, queued_, wait_for, wait_for > 0 ? IORING_ENTER_GETEVENTS : 0,
+                                     nullptr, 0);
+            if (submitted >= 0)
+            {
+                queued_ -= submitted;
+                return true;
+            }
+            if (errno != EINTR)
+                return false;
+        }
+#else
+        return false;
+#endif
+    }
+
+    // next completion, false if none arrived yet
+    bool reap(uint64_t &tag, int &result)
+    {
+#ifdef HAVE_IO_URING
+        unsigned head = *cq_head_;
+        if (head == __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE))
+            return false;
+        const io_uring_cqe &cqe = cqes_[head & *cq_mask_];
+        tag = cqe.user_data;
+        result = cqe.res;
+        __atomic_store_n(cq_head_, head + 1, __ATOMIC_RELEASE);
+        pending_--;
+        return true;
+#else
+        return false;
+#endif
+    }
+
+private:
+    void release()
+    {
+#ifdef HAVE_IO_URING
+        if (sqes_ != MAP_FAILED)
+            munmap(sqes_, entries_ * sizeof(io_uring_sqe));
+        if (cq_ring_ != MAP_FAILED && cq_ring_ != sq_ring_)
+            munmap(cq_ring_, cq_ring_size_);
+        if (sq_ring_ != MAP_FAILED)
+            munmap(sq_ring_, sq_ring_size_);
+        sqes_ = static_cast<io_uring_sqe *>(MAP_FAILED);
+        cq_ring_ = sq_ring_ = MAP_FAILED;
+#endif
+        if (fd_ >= 0)
+            ::close(fd_);
+        fd_ = -1;
+    }
+};
+
+// ListPrefetcher class, reads the lists of a query in one batch before traversal starts. The first
+// PREFETCH_LIST_BYTES of every list are split into chunks that are all submitted through io_uring
+// at once, first chunks of every list first, so a cold query waits about one device round trip.
+// Blocks are handed out as soon as the chunks covering them arrived, blocks past the prefetched
+// bytes are read on demand. Without io_uring the lists are announced with posix_fadvise and
+// blocks are read with pread
+class ListPrefetcher
+{
+private:
+    struct Chunk
+    {
+        int list;
+        int64_t offset; // in the index file
+        unsigned size;
+        bool queued = false;
+        bool done = false;
+    };
+
+    struct List
+    {
+        int fd;
+        int64_t start;
+        int64_t prefetched; // bytes from start read ahead
+        std::unique_ptr<uint8_t[]> data;
+        size_t first_chunk;
+    };
+
+    IoRing *ring_; // null without io_uring
+    std::vector<List> lists_;
+    std::vector<Chunk> chunks_;
+    std::vector<size_t> order_; // chunks in submission order
+    size_t next_ = 0;           // next chunk of order_ to queue
+
+    // queue chunks in submission order while the ring has room
+    void pump()
+    {
+        while (next_ < order_.size() && ring_->capacity() > 0)
+        {
+            Chunk &chunk = chunks_[order_[next_++]];
+            if (chunk.done)
+                continue;
+            List &list = lists_[chunk.list];
+            ring_->queueRead(list.fd, list.data.get() + (chunk.offset - list.start), chunk.size, chunk.offset, &chunk - chunks_.data());
+            chunk.queued = true;
+        }
+    }
+
+    void readChunk(Chunk &chunk)
+    {
+        List &list = lists_[chunk.list];
+        preadFully(list.fd, list.data.get() + (chunk.offset - list.start), chunk.size, chunk.offset);
+        chunk.done = true;
+    }
+
+    void reapCompletions()
+    {
+        uint64_t tag;
+        int result;
+        while (ring_->reap(tag, result))
+        {
+            Chunk &chunk = chunks_[tag];
+            chunk.queued = false;
+            if (result == int(chunk.size))
+                chunk.done = true;
+            else
+                readChunk(chunk); // failed or short read
+        }
+    }
+
+    void waitChunk(Chunk &chunk, QueryStats &stats)
+    {
+        if (!chunk.done)
+            QUERY_STAT(stats, io_waits++);
+        while (!chunk.done)
+        {
+            pump();
+            if (!chunk.queued || !ring_->submit(1))
+            {
+                readChunk(chunk); // not reached by the batch yet, or the ring failed
+                break;
+            }
+            reapCompletions();
+        }
+    }
+
+public:
+    ListPrefetcher(IoRing *ring) : ring_(ring && ring->available() ? ring : nullptr) {}
+    ListPrefetcher(const ListPrefetcher &) = delete;
+    ListPrefetcher &operator=(const ListPrefetcher &) = delete;
+
+    // reads still in flight write into the buffers, wait for them
+    ~ListPrefetcher()
+    {
+        while (ring_ && ring_->pending() > 0 && ring_->submit(1))
+            reapCompletions();
+    }
+
+    // register the byte range of a list, returns its id for read
+    int add(const IndexFile &file, int64_t start, int64_t bytes)
+    {
+        List list{file.fd, start, ring_ ? std::min(bytes, PREFETCH_LIST_BYTES) : 0, nullptr, chunks_.size()};
+        if (!ring_)
+        {
+            posix_fadvise(file.fd, start, std::min(bytes, PREFETCH_LIST_BYTES), POSIX_FADV_WILLNEED);
+        }
+        else
+        {
+            list.data.reset(new uint8_t[list.prefetched]);
+            for (int64_t offset = 0; offset < list.prefetched; offset += PREFETCH_CHUNK)
+            {
+                chunks_.push_back({int(lists_.size()), start + offset, unsigned(std::min(PREFETCH_CHUNK, list.prefetched - offset))});
+            }
+        }
+        lists_.push_back(std::move(list));
+        return lists_.size() - 1;
+    }
+
+    // submit the chunks of all lists, the first chunk of every list goes first
+    void submit(QueryStats &stats)
+    {
+        if (!ring_)
+            return;
+        order_.resize(chunks_.size());
+        std::iota(order_.begin(), order_.end(), 0);
+        std::stable_sort(order_.begin(), order_.end(), [this](size_t a, size_t b)
+                         { return a - lists_[chunks_[a].list].first_chunk < b - lists_[chunks_[b].list].first_chunk; });
+        pump();
+        ring_->submit(0);
+#ifdef QUERY_STATS
+        for (const auto &list : lists_)
+            QUERY_STAT(stats, prefetched_bytes += list.prefetched);
+#else
+        (void)stats;
+#endif
+    }
+
+    // wait for the reads of all lists, read is then safe to call from several threads
+    void waitAll(QueryStats &stats)
+    {
+        if (!ring_)
+            return;
+        for (auto &chunk : chunks_)
+            waitChunk(chunk, stats);
+    }
+
+    // size bytes of the index file at offset, which lie in list. Points into the prefetched bytes,
+    // or into scratch if they were not prefetched
+    const uint8_t *read(int list_id, int64_t offset, size_t size, std::vector<uint8_t> &scratch, QueryStats &stats)
+    {
+        const List &list = lists_[list_id];
+        if (offset + int64_t(size) > list.start + list.prefetched)
+        {
+            scratch.resize(size);
+            preadFully(list.fd, scratch.data(), size, offset);
+            return scratch.data();
+        }
+        if (size > 0)
+        {
+            size_t first = list.first_chunk + (offset - list.start) / PREFETCH_CHUNK;
+            size_t last = list.first_chunk + (offset + size - 1 - list.start) / PREFETCH_CHUNK;
+            for (size_t i = first; i <= last; ++i)
+                waitChunk(chunks_[i], stats);
+        }
+        return list.data.get() + (offset - list.start);
+    }
+};
+
+// InvertedList class, cursor over one list in the block size and codec of its segment's format
+// header, searchSegment picks the instantiation once per segment
+template <int BlockSize, class Codec>
 class InvertedList
 {
 private:
-    std::ifstream &index_file_;
+    ListPrefetcher &prefetcher_;
+    int list_id_; // of the list in prefetcher_
     int64_t start_pos_;
     int64_t bytes_size_;
-    size_t current_pos_;
-    std::vector<std::pair<int, int>> &block_info_;
-    std::vector<uint8_t> current_block_;
+    int postings_num_;
+    int postings_left_;                              // postings of this list in blocks not yet opened
+    size_t current_pos_;                             // next posting inside the current block
+    std::vector<std::pair<int, int64_t>> &block_info_; // last doc_id and start position of each block
+    std::vector<uint8_t> current_block_; // blocks that were not prefetched are read into it
+    std::vector<int> block_doc_ids_; // decoded doc_ids of the current block
+    std::vector<int> block_freqs_;   // decoded frequencies of the current block
+    std::vector<int> block_pair_freqs_; // second term's frequencies of a pair list block
+    const uint8_t *block_ = nullptr;   // bytes of the current block, its freqs are decoded on first use
+    size_t block_bytes_ = 0;
+    size_t block_freqs_pos_ = 0; // offset of the first freq in block_
+    int block_count_ = 0;        // postings of the current block before clipping
+    bool freqs_decoded_ = true;  // block_freqs_ holds the freqs of the current block
     int current_block_index_;
+    bool block_all_live_; // no doc of the current block is deleted
+    bool simd_search_ = false; // nextGEQ searches blocks with findGEQSimd
+    bool bitmap_;                // dense list, the whole list is one block decoded on first use
+    bool pair_ = false;          // pair index list
+    int bitmap_first_word_ = 0;
+    std::vector<uint64_t> bitmap_words_; // bit i of word w is doc_id (bitmap_first_word_ + w) * 64 + i
+    std::vector<int> bitmap_rank_;       // postings before each word, index of its first count
+    std::vector<int> bitmap_freqs_;      // counts of all postings of a bitmap list
+    int bitmap_next_word_ = 0;           // first word decodeBitmap has not expanded yet
+    const LiveDocs &live_docs_;
+    QueryBudget &budget_;
+    QueryStats *stats_; // a range cursor counts into the stats of its thread
+    int end_doc_ = std::numeric_limits<int>::max(); // postings from this doc_id on are dropped
 
+    // find the first block of the list, lists always start on a block boundary
     void loadBlockIndex()
     {
-        std::cout << "Loading block index." << std::endl;
-        for (int i = 0; i < block_info_.size(); ++i)
+        auto it = std::lower_bound(block_info_.begin(), block_info_.end(), start_pos_,
+                                   [](const std::pair<int, int64_t> &block, int64_t pos)
+                                   { return block.second < pos; });
+        current_block_index_ = it - block_info_.begin();
+    }
+
+    void openBlock()
+    {
+        int64_t block_start = block_info_[current_block_index_].second;
+        int64_t block_end = start_pos_ + bytes_size_;
+        if (size_t(current_block_index_ + 1) < block_info_.size() && block_info_[current_block_index_ + 1].second < block_end)
+        {
+            block_end = block_info_[current_block_index_ + 1].second;
+        }
+        int64_t block_bytes = block_end - block_start;
+        const uint8_t *block = prefetcher_.read(list_id_, block_start, block_bytes, current_block_, *stats_);
+        QUERY_STAT(*stats_, blocks_loaded++);
+        QUERY_STAT(*stats_, bytes_read += block_bytes);
+
+        // a block holds all doc_id gaps first, followed by all frequencies. Only the gaps are
+        // decoded here, the freqs wait until a posting of the block is scored
+        int count = std::min(postings_left_, BlockSize);
+        postings_left_ -= count;
+        block_doc_ids_.resize(count);
+        size_t pos = Codec::template decodeBlock<BlockSize, true>(block, block_bytes, count, blockBaseDocId(), block_doc_ids_.data());
+        block_ = block;
+        block_bytes_ = block_bytes;
+        block_freqs_pos_ = pos;
+        block_count_ = count;
+        freqs_decoded_ = false;
+        QUERY_STAT(*stats_, postings_decoded += count);
+        budget_.postings_done += count;
+        clipBlock();
+        block_all_live_ = block_doc_ids_.empty() || live_docs_.allLive(block_doc_ids_.front(), block_doc_ids_.back());
+        current_pos_ = 0; // reset the current position
+    }
+
+    // decode the freqs of the current block, and the second term's freqs of a pair list
+    void decodeFreqs()
+    {
+        block_freqs_.resize(block_count_);
+        size_t pos = block_freqs_pos_;
+        pos += Codec::template decodeBlock<BlockSize, false>(block_ + pos, block_bytes_ - pos, block_count_, 0, block_freqs_.data());
+        if (pair_)
+        {
+            block_pair_freqs_.resize(block_count_);
+            Codec::template decodeBlock<BlockSize, false>(block_ + pos, block_bytes_ - pos, block_count_, 0, block_pair_freqs_.data());
+        }
+        freqs_decoded_ = true;
+        QUERY_STAT(*stats_, freqs_decoded += block_count_);
+    }
+
+    // drop the postings from end_doc_ on, the block is then the last one of a range cursor
+    void clipBlock()
+    {
+        if (block_doc_ids_.empty() || block_doc_ids_.back() < end_doc_)
+            return;
+        size_t size = std::lower_bound(block_doc_ids_.begin(), block_doc_ids_.end(), end_doc_) - block_doc_ids_.begin();
+        block_doc_ids_.resize(size);
+        if (freqs_decoded_)
+            block_freqs_.resize(size);
+        postings_left_ = 0;
+    }
+
+    // gaps restart from the last doc_id of the previous block of the same list
+    int blockBaseDocId() const
+    {
+        if (block_info_[current_block_index_].second == start_pos_)
+            return 0;
+        return block_info_[current_block_index_ - 1].first;
+    }
+
+    // read the words and counts of a bitmap list, doc_ids are only expanded by decodeBitmap
+    void openBitmap()
+    {
+        const uint8_t *block = prefetcher_.read(list_id_, start_pos_, bytes_size_, current_block_, *stats_);
+        QUERY_STAT(*stats_, blocks_loaded++);
+        QUERY_STAT(*stats_, bytes_read += bytes_size_);
+
+        size_t pos = 0;
+        size_t bytes_read = 0;
+        bitmap_first_word_ = varbyteDecode(block, bytes_size_, bytes_read);
+        pos += bytes_read;
+        int num_words = varbyteDecode(block + pos, bytes_size_ - pos, bytes_read);
+        pos += bytes_read;
+        bitmap_words_.resize(num_words);
+        std::memcpy(bitmap_words_.data(), block + pos, num_words * sizeof(uint64_t));
+        pos += num_words * sizeof(uint64_t);
+        bitmap_rank_.resize(num_words);
+        int rank = 0;
+        for (int i = 0; i < num_words; ++i)
+        {
+            bitmap_rank_[i] = rank;
+            rank += __builtin_popcountll(bitmap_words_[i]);
+        }
+        bitmap_freqs_.resize(postings_num_);
+        decodeVarbytes<0, false>(block + pos, bytes_size_ - pos, postings_num_, 0, bitmap_freqs_.data());
+        QUERY_STAT(*stats_, postings_decoded += postings_num_);
+        current_pos_ = 0;
+    }
+
+    // expand the next words of the bitmap, about a block of postings, into block_doc_ids_ and
+    // block_freqs_ for the cursor methods
+    void decodeBitmap()
+    {
+        block_doc_ids_.clear();
+        int num_words = bitmap_words_.size();
+        int word = bitmap_next_word_;
+        for (; word < num_words && block_doc_ids_.size() < BlockSize; ++word)
+        {
+            for (uint64_t bits = bitmap_words_[word]; bits != 0; bits &= bits - 1)
+                block_doc_ids_.push_back((bitmap_first_word_ + word) * 64 + __builtin_ctzll(bits));
+        }
+        auto first_freq = bitmap_freqs_.begin() + bitmap_rank_[bitmap_next_word_];
+        block_freqs_.assign(first_freq, first_freq + block_doc_ids_.size());
+        bitmap_next_word_ = word;
+        postings_left_ -= block_doc_ids_.size();
+        budget_.postings_done += block_doc_ids_.size();
+        clipBlock();
+        block_all_live_ = block_doc_ids_.empty() || live_docs_.allLive(block_doc_ids_.front(), block_doc_ids_.back());
+        current_pos_ = 0;
+    }
+
+    // Move a cursor that was not advanced yet to its first posting >= first_doc. The passed blocks
+    // belong to the ranges of other threads, so unlike nextGEQ they are neither charged to the
+    // budget nor counted as skipped
+    void seekRangeStart(int first_doc)
+    {
+        if (bitmap_)
+        {
+            int word = std::max(first_doc / 64 - bitmap_first_word_, 0);
+            if (word >= int(bitmap_words_.size()))
+            {
+                postings_left_ = 0;
+                return;
+            }
+            bitmap_next_word_ = word;
+            postings_left_ = postings_num_ - bitmap_rank_[word];
+            decodeBitmap();
+        }
+        else if (postings_left_ > 0 && (block_doc_ids_.empty() || block_doc_ids_.back() < first_doc))
+        {
+            // first block of the rest of the list whose last doc_id reaches first_doc
+            auto first = block_info_.begin() + current_block_index_ + 1;
+            auto last = first + (postings_left_ + BlockSize - 1) / BlockSize;
+            auto block = std::lower_bound(first, last, first_doc, [](const std::pair<int, int64_t> &info, int doc_id)
+                                          { return info.first < doc_id; });
+            if (block == last)
+            {
+                postings_left_ = 0;
+                current_pos_ = block_doc_ids_.size();
+                return;
+            }
+            postings_left_ -= (block - first) * BlockSize; // every block before the last one is full
+            current_block_index_ = block - block_info_.begin();
+            openBlock();
+        }
+        current_pos_ = findGEQ(block_doc_ids_.data(), current_pos_, block_doc_ids_.size(), first_doc);
+    }
+
+    bool loadNextBlock()
+    {
+        if (postings_left_ == 0) // no more blocks
+        {
+            return false;
+        }
+        if (budget_.exceeded())
+            return false;
+        if (bitmap_)
         {
-            if (start_pos_ < block_info_[i].second)
+            decodeBitmap();
+            return true;
+        }
+        current_block_index_++;
+        openBlock();
+        return true;
+    }
+
+public:
+    static const int BLOCK_POSTINGS = BlockSize;
+
+    // the list's bytes must have been added to prefetcher as list_id
+    InvertedList(ListPrefetcher &prefetcher, int list_id, std::vector<std::pair<int, int64_t>> &block_info,
+                 const LiveDocs &live_docs, const LexiconEntry &entry, QueryBudget &budget, QueryStats &stats)
+        : prefetcher_(prefetcher), list_id_(list_id), start_pos_(entry.start_position), bytes_size_(entry.bytes_size),
+          postings_num_(entry.postings_num), postings_left_(entry.postings_num), current_pos_(0), block_info_(block_info),
+          bitmap_(entry.list_type == LIST_BITMAP), pair_(entry.list_type == LIST_PAIR), live_docs_(live_docs), budget_(budget),
+          stats_(&stats)
+    {
+        QUERY_STAT(*stats_, lists_opened++);
+        budget_.postings_total += postings_num_;
+        if (bitmap_)
+        {
+            openBitmap();
+            return;
+        }
+        loadBlockIndex();
+        openBlock();
+    }
+
+    InvertedList(Segment &segment, const LexiconEntry &entry, ListPrefetcher &prefetcher, int list_id, QueryBudget &budget,
+                 QueryStats &stats)
+        : InvertedList(prefetcher, list_id, segment.block, segment.live_docs, entry, budget, stats)
+    {
+    }
+
+    // list of the segment's pair index
+    InvertedList(Segment &segment, PairIndex &pairs, const LexiconEntry &entry, ListPrefetcher &prefetcher, int list_id,
+                 QueryBudget &budget, QueryStats &stats)
+        : InvertedList(prefetcher, list_id, pairs.block, segment.live_docs, entry, budget, stats)
+    {
+    }
+
+    // union of lists as one decoded block with the freqs of a doc summed, stands in for the terms
+    // a prefix expanded to. Freqs are added up in the segment's union scratch, deleted docs are
+    // dropped when the marked docs are collected in order
+    InvertedList(std::vector<InvertedList> &parts, Segment &segment)
+        : prefetcher_(parts[0].prefetcher_), list_id_(-1), start_pos_(0), bytes_size_(0), postings_num_(0), postings_left_(0),
+          current_pos_(0), block_info_(parts[0].block_info_), current_block_index_(0), block_all_live_(true), bitmap_(false),
+          live_docs_(segment.live_docs), budget_(parts[0].budget_), stats_(parts[0].stats_)
+    {
+        size_t doc_count = segment.doc_lengths.size();
+        if (segment.union_freqs.size() != doc_count)
+        {
+            segment.union_freqs.assign(doc_count, 0);
+            segment.union_docs.assign(doc_count / 64 + 1, 0);
+        }
+        int *freqs = segment.union_freqs.data();
+        uint64_t *docs = segment.union_docs.data();
+        size_t first_word = segment.union_docs.size();
+        size_t end_word = 0;
+        const int *doc_ids;
+        const int *part_freqs;
+        int count;
+        for (auto &part : parts)
+        {
+            bytes_size_ += part.bytes_size_;
+            while (part.nextBlock(doc_ids, part_freqs, count))
+            {
+                for (int i = 0; i < count; ++i)
+                {
+                    freqs[doc_ids[i]] += part_freqs[i];
+                    docs[doc_ids[i] / 64] |= uint64_t(1) << (doc_ids[i] % 64);
+                }
+                if (count > 0)
+                {
+                    first_word = std::min<size_t>(first_word, doc_ids[0] / 64);
+                    end_word = std::max<size_t>(end_word, doc_ids[count - 1] / 64 + 1);
+                }
+            }
+        }
+        for (size_t word = first_word; word < end_word; ++word)
+        {
+            for (uint64_t bits = docs[word]; bits != 0; bits &= bits - 1)
+            {
+                int doc_id = word * 64 + __builtin_ctzll(bits);
+                if (live_docs_.isLive(doc_id))
+                {
+                    block_doc_ids_.push_back(doc_id);
+                    block_freqs_.push_back(freqs[doc_id]);
+                }
+                freqs[doc_id] = 0;
+            }
+            docs[word] = 0;
+        }
+        postings_num_ = block_doc_ids_.size();
+    }
+
+    // cursor over the doc_ids [first_doc, end_doc) of a list that was not advanced yet, one range of
+    // a query split across threads
+    InvertedList(const InvertedList &list, int first_doc, int end_doc, QueryStats &stats) : InvertedList(list)
+    {
+        stats_ = &stats;
+        end_doc_ = end_doc;
+        if (!freqs_decoded_)
+            decodeFreqs(); // block_ may be the read buffer of list
+        clipBlock();
+        if (first_doc > 0)
+            seekRangeStart(first_doc);
+    }
+
+    // list of the segment's first tier, deletions still come from the segment
+    InvertedList(Segment &segment, IndexTier &tier, const LexiconEntry &entry, ListPrefetcher &prefetcher, int list_id,
+                 QueryBudget &budget, QueryStats &stats)
+        : InvertedList(prefetcher, list_id, tier.block, segment.live_docs, entry, budget, stats)
+    {
+    }
+
+    bool next(int &doc_id)
+    {
+        while (true)
+        {
+            if (current_pos_ >= block_doc_ids_.size()) // Check if we have processed all postings in the current block
+            {
+                if (!loadNextBlock())
+                {
+                    return false;
+                }
+            }
+            if (block_all_live_ || live_docs_.isLive(block_doc_ids_[current_pos_]))
+                break;
+            current_pos_++; // deleted doc
+        }
+
+        doc_id = block_doc_ids_[current_pos_];
+        current_pos_++;
+        return true;
+    }
+
+    bool next(int &doc_id, int &freq)
+    {
+        if (!next(doc_id))
+            return false;
+        freq = this->freq();
+        return true;
+    }
+
+    // first live posting with doc_id >= target. Blocks ending below target are passed using the
+    // block info alone, the block holding target is searched by galloping
+    bool nextGEQ(int target, int &doc_id)
+    {
+        if (current_pos_ >= block_doc_ids_.size() || block_doc_ids_.back() < target)
+        {
+            if (postings_left_ == 0)
+            {
+                current_pos_ = block_doc_ids_.size();
+                return false;
+            }
+            if (bitmap_)
+            {
+                // words before the one of target are passed using their ranks
+                int word = std::min<int>(target / 64 - bitmap_first_word_, bitmap_words_.size() - 1);
+                if (word > bitmap_next_word_)
+                {
+                    int passed = bitmap_rank_[word] - bitmap_rank_[bitmap_next_word_];
+                    postings_left_ -= passed;
+                    budget_.postings_done += passed;
+                    bitmap_next_word_ = word;
+                }
+                return loadNextBlock() && nextGEQ(target, doc_id);
+            }
+            if (budget_.exceeded())
+            {
+                current_pos_ = block_doc_ids_.size();
+                return false;
+            }
+            current_block_index_++;
+            // every block before the last one holds BlockSize postings
+            while (postings_left_ > BlockSize && block_info_[current_block_index_].first < target)
+            {
+                postings_left_ -= BlockSize;
+                budget_.postings_done += BlockSize;
+                current_block_index_++;
+                QUERY_STAT(*stats_, blocks_skipped++);
+            }
+            openBlock();
+        }
+        const int *ids = block_doc_ids_.data();
+        int size = block_doc_ids_.size();
+        current_pos_ = simd_search_ ? findGEQSimd(ids, current_pos_, size, target) : findGEQ(ids, current_pos_, size, target);
+        return next(doc_id);
+    }
+
+    bool nextGEQ(int target, int &doc_id, int &freq)
+    {
+        if (!nextGEQ(target, doc_id))
+            return false;
+        freq = this->freq();
+        return true;
+    }
+
+    // freq of the posting next or nextGEQ returned last
+    int freq()
+    {
+        if (!freqs_decoded_)
+            decodeFreqs();
+        return block_freqs_[current_pos_ - 1];
+    }
+
+    void setSimdSearch(bool simd_search) { simd_search_ = simd_search; }
+
+    // hand out the rest of the current block and move on, deleted docs are not filtered
+    bool nextBlock(const int *&doc_ids, const int *&freqs, int &count)
+    {
+        if (current_pos_ >= block_doc_ids_.size() && !loadNextBlock())
+            return false;
+        if (!freqs_decoded_)
+            decodeFreqs();
+        doc_ids = block_doc_ids_.data() + current_pos_;
+        freqs = block_freqs_.data() + current_pos_;
+        count = block_doc_ids_.size() - current_pos_;
+        current_pos_ = block_doc_ids_.size();
+        return true;
+    }
+
+    bool isBitmap() const { return bitmap_; }
+    bool hasBlocks() const { return !bitmap_ && list_id_ >= 0; } // not a bitmap or a union
+
+    // first doc_ids of parts of about equal block counts of a list that was not advanced yet, every
+    // part starts on a block boundary
+    std::vector<int> rangeStarts(int parts) const
+    {
+        int blocks = (postings_num_ + BlockSize - 1) / BlockSize;
+        std::vector<int> starts{0};
+        for (int i = 1; i < parts; ++i)
+        {
+            int block = current_block_index_ + int64_t(blocks) * i / parts;
+            if (block > current_block_index_ && block_info_[block - 1].first + 1 > starts.back())
+                starts.push_back(block_info_[block - 1].first + 1);
+        }
+        return starts;
+    }
+
+    // second term's freq of the posting next or nextGEQ returned last, pair lists only
+    int pairFreq()
+    {
+        if (!freqs_decoded_)
+            decodeFreqs();
+        return block_pair_freqs_[current_pos_ - 1];
+    }
+    int bitmapFirstWord() const { return bitmap_first_word_; }
+    int bitmapEndWord() const { return bitmap_first_word_ + bitmap_words_.size(); }
+
+    // postings of a bitmap list before word
+    int bitmapRank(int word) const
+    {
+        word -= bitmap_first_word_;
+        if (word <= 0)
+            return 0;
+        return word < int(bitmap_words_.size()) ? bitmap_rank_[word] : postings_num_;
+    }
+
+    // word of a bitmap list covering doc_ids [word * 64, word * 64 + 64), 0 outside the list
+    uint64_t bitmapWord(int word) const
+    {
+        if (word < bitmap_first_word_ || word >= bitmapEndWord())
+            return 0;
+        return bitmap_words_[word - bitmap_first_word_];
+    }
+
+    // freq of a doc set in the bitmap, its rank in the list indexes the counts
+    int bitmapFreq(int doc_id) const
+    {
+        int word = doc_id / 64 - bitmap_first_word_;
+        uint64_t below = bitmap_words_[word] & ((uint64_t(1) << (doc_id % 64)) - 1);
+        return bitmap_freqs_[bitmap_rank_[word] + __builtin_popcountll(below)];
+    }
+
+    int64_t getSize() const { return bytes_size_; }
+    int getPostingsNum() const { return postings_num_; }
+};
+
+// Scorer policies of searchSegmentAs, the scoring model of a segment's format header. Bm25Scorer
+// scores the term counts of the lists
+struct Bm25Scorer
+{
+    double avg_doc_length; // of the whole collection, so segment scores are comparable
+
+    // idf times the BM25 frequency part of freq occurrences in a doc of doc_length
+    double score(double idf, int freq, int doc_length) const
+    {
+        return idf * ((freq * (BM25_K1 + 1)) / (freq + BM25_K1 * (1 - BM25_B + BM25_B * (doc_length / avg_doc_length))));
+    }
+};
+
+// ImpactScorer scores the sum of the quantized impacts build_index --impacts stored in place of the counts
+struct ImpactScorer
+{
+    double impact_scale; // score of one impact unit
+
+    double score(uint32_t impacts) const { return impacts * impact_scale; }
+};
+
+// QueryPool class, threads traversing the doc_id ranges of a split query together with the caller.
+// Ranges are claimed from a shared counter, so a thread done early takes over ranges of the others
+class QueryPool
+{
+private:
+    std::vector<std::thread> threads_;
+    std::mutex mutex_;
+    std::condition_variable wake_;
+    std::condition_variable done_;
+    std::function<void(size_t)> task_;
+    size_t tasks_ = 0;
+    std::atomic<size_t> next_task_ = 0;
+    size_t finished_ = 0; // tasks of the current run completed
+    int active_ = 0;      // pool threads inside work, run waits for them before returning
+    uint64_t run_ = 0;    // count of runs, wakes the pool threads
+    bool stop_ = false;
+
+    size_t work()
+    {
+        size_t done = 0;
+        for (size_t task; (task = next_task_++) < tasks_; ++done)
+            task_(task);
+        return done;
+    }
+
+    void loop()
+    {
+        uint64_t seen = 0;
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (true)
+        {
+            wake_.wait(lock, [&]
+                       { return stop_ || run_ != seen; });
+            if (stop_)
+                return;
+            seen = run_;
+            active_++;
+            lock.unlock();
+            size_t done = work();
+            lock.lock();
+            finished_ += done;
+            active_--;
+            done_.notify_one();
+        }
+    }
+
+public:
+    QueryPool(int threads)
+    {
+        for (int i = 1; i < threads; ++i)
+            threads_.emplace_back([this]
+                                  { loop(); });
+    }
+
+    ~QueryPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+        }
+        wake_.notify_all();
+        for (auto &thread : threads_)
+            thread.join();
+    }
+
+    int size() const { return threads_.size() + 1; }
+
+    // run task(i) for every i < tasks, returns once all of them finished
+    void run(size_t tasks, std::function<void(size_t)> task)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            task_ = std::move(task);
+            tasks_ = tasks;
+            next_task_ = 0;
+            finished_ = 0;
+            run_++;
+        }
+        wake_.notify_all();
+        size_t done = work();
+        std::unique_lock<std::mutex> lock(mutex_);
+        finished_ += done;
+        done_.wait(lock, [&]
+                   { return finished_ == tasks_ && active_ == 0; });
+    }
+};
+
+class SearchEngine
+{
+private: // private members
+    std::shared_ptr<IndexSnapshot> index; // replaced between queries only, a query holds it throughout
+    std::shared_ptr<IndexSnapshot> loaded; // snapshot the loader finished, installed by the next query
+    std::mutex loaded_mutex;
+    std::thread loader;
+    std::atomic<bool> loading = false;
+    std::ifstream original_file;
+    std::unique_ptr<IoRing> io_ring; // query lists are prefetched through it, null without io_uring
+    double budget_ms = 0; // query budget set by setQueryBudget
+    int64_t budget_postings = 0;
+    std::unique_ptr<QueryPool> query_pool; // splits long queries across threads, null for one thread
+
+public: // public members
+    // index in index_dir, a single index or a directory written by build_index --segment whose new
+    // segments are picked up between queries
+    SearchEngine(const std::string &index_dir, const std::string &original_tar_gz)
+        : original_file(original_tar_gz, std::ios::binary)
+    {
+        openIoRing();
+        index = loadSnapshot(index_dir, nullptr);
+        if (!index)
+        {
+            index = std::make_shared<IndexSnapshot>();
+            index->dir = index_dir; // reloaded once an index was built there
+        }
+    }
+
+    ~SearchEngine()
+    {
+        if (loader.joinable())
+            loader.join();
+    }
+
+    void openIoRing()
+    {
+        io_ring = std::make_unique<IoRing>(IO_RING_ENTRIES);
+        if (!io_ring->available())
+        {
+            io_ring.reset();
+            std::cout << "io_uring not available, prefetching lists with posix_fadvise." << std::endl;
+        }
+    }
+
+    void loadLexicon(std::unordered_map<std::string, LexiconEntry> &lexicon, const std::string &lexicon_file)
+    {
+        std::ifstream lex_file(lexicon_file);
+        std::string term;
+        LexiconEntry entry;
+        std::cout << "Loading lexicon..." << std::endl;
+        std::string line;
+        while (std::getline(lex_file, line))
+        {
+            std::istringstream fields(line);
+            if (!(fields >> term >> entry.term_id >> entry.postings_num >> entry.start_position >> entry.bytes_size))
+                continue;
+            if (!(fields >> entry.list_type)) // lexicons written before bitmap lists
+                entry.list_type = 0;
+            lexicon[term] = entry;
+        }
+        std::cout << "Lexicon loaded." << std::endl;
+    }
+
+    void loadBlockInfo(std::vector<std::pair<int, int64_t>> &block, const std::string &block_info_file)
+    {
+        std::cout << "Loading block info..." << std::endl;
+        // binary (last doc_id, block size) pairs, sizes are turned into start positions in place
+        std::ifstream block_info(block_info_file, std::ios::binary | std::ios::ate);
+        if (!block_info)
+        {
+            std::cerr << "Cannot open block info: " << block_info_file << std::endl;
+            return;
+        }
+        block.resize(block_info.tellg() / sizeof(std::pair<int, int64_t>));
+        block_info.seekg(0);
+        block_info.read(reinterpret_cast<char *>(block.data()), block.size() * sizeof(std::pair<int, int64_t>));
+        int64_t block_start_pos = 0;
+        for (auto &[last_doc_id, position] : block)
+        {
+            int64_t block_size = position;
+            position = block_start_pos;
+            block_start_pos += block_size;
+        }
+        std::cout << "Block info loaded." << std::endl;
+    }
+
+    void loadDocInfo(Segment &segment, const std::string &doc_info_file)
+    {
+        std::cout << "Loading doc info..." << std::endl;
+        std::ifstream doc_info(doc_info_file);
+        int doc_length;
+        int64_t line_pos;
+        while (doc_info >> doc_length >> line_pos) // tested
+        {
+            segment.doc_lengths.push_back(doc_length);
+            segment.lines_pos.push_back(line_pos);
+            if (line_pos >= 0) // unused doc_ids between merged segments have no line
+            {
+                segment.total_length += doc_length;
+                segment.num_docs++;
+            }
+        }
+        std::cout << "Doc info loaded." << std::endl;
+    }
+
+    // live docs bitmap and doc map written by build_index --delete and --compact
+    void loadDeletions(Segment &segment, const std::string &segment_dir)
+    {
+        segment.live_docs.load(segment_dir + "/" + LIVE_DOCS_FILE, segment.doc_lengths.size());
+        std::ifstream doc_map_file(segment_dir + "/" + DOC_MAP_FILE, std::ios::binary);
+        if (doc_map_file.is_open())
+        {
+            segment.doc_map.resize(segment.doc_lengths.size());
+            doc_map_file.read(reinterpret_cast<char *>(segment.doc_map.data()), segment.doc_map.size() * sizeof(int));
+        }
+    }
+
+    // scale of the impacts of a segment whose format header says it is scored by impacts
+    bool loadImpactInfo(Segment &segment, const std::string &segment_dir)
+    {
+        std::ifstream impact_info(segment_dir + "/" + IMPACT_INFO_FILE);
+        if (!(impact_info >> segment.impact_scale))
+        {
+            std::cerr << "Cannot read impact info: " << segment_dir << std::endl;
+            return false;
+        }
+        segment.accumulators.assign(segment.doc_lengths.size(), 0);
+        std::cout << "Impact scores loaded." << std::endl;
+        return true;
+    }
+
+    // format header of a tier or pair directory, their lists are searched by the cursor of the segment
+    bool sameFormat(const Segment &segment, const std::string &dir)
+    {
+        IndexFormat format;
+        if (readIndexFormat(dir, format) && format == segment.format)
+            return true;
+        std::cerr << "Format of " << dir << " differs from its segment, not loaded." << std::endl;
+        return false;
+    }
+
+    // first tier written by build_index --tier, with the bounds of the postings it left out
+    void loadFirstTier(Segment &segment, const std::string &segment_dir)
+    {
+        std::string tier_dir = segment_dir + "/" + TIER_DIR;
+        std::ifstream bounds(tier_dir + "/" + TIER_BOUNDS_FILE);
+        auto tier = std::make_unique<IndexTier>();
+        if (!(bounds >> tier->avg_doc_length) || !sameFormat(segment, tier_dir))
+            return;
+        std::cout << "Loading first tier..." << std::endl;
+        tier->index_file.open(tier_dir + "/" + INDEX_FILE);
+        loadLexicon(tier->lexicon, tier_dir + "/" + LEXICON_FILE);
+        loadBlockInfo(tier->block, tier_dir + "/" + BLOCK_INFO_FILE);
+        std::string term;
+        double max_part, pruned_part;
+        while (bounds >> term >> max_part >> pruned_part)
+        {
+            auto it = tier->lexicon.find(term);
+            if (it != tier->lexicon.end())
+            {
+                it->second.max_part = max_part;
+                it->second.pruned_part = pruned_part;
+            }
+        }
+        segment.first_tier = std::move(tier);
+        std::cout << "First tier loaded." << std::endl;
+    }
+
+    // pair index written by build_index --pairs
+    void loadPairIndex(Segment &segment, const std::string &segment_dir)
+    {
+        std::string pair_dir = segment_dir + "/" + PAIR_DIR;
+        if (!std::filesystem::exists(pair_dir + "/" + LEXICON_FILE) || !sameFormat(segment, pair_dir))
+            return;
+        std::cout << "Loading pair index..." << std::endl;
+        auto pairs = std::make_unique<PairIndex>();
+        pairs->index_file.open(pair_dir + "/" + INDEX_FILE);
+        loadLexicon(pairs->lexicon, pair_dir + "/" + LEXICON_FILE);
+        loadBlockInfo(pairs->block, pair_dir + "/" + BLOCK_INFO_FILE);
+        segment.pair_index = std::move(pairs);
+        std::cout << "Pair index loaded." << std::endl;
+    }
+
+    // stats of the whole collection for a shard written by build_index --shards, so IDF and
+    // average doc length match across shards
+    void loadGlobalStats(IndexSnapshot &snapshot, const std::string &global_stats_file)
+    {
+        std::ifstream global_stats(global_stats_file);
+        if (!(global_stats >> snapshot.global_docs >> snapshot.global_length))
+            return;
+        std::cout << "Loading global stats..." << std::endl;
+        std::string term;
+        int64_t df;
+        while (global_stats >> term >> df)
+        {
+            snapshot.global_df[term] = df;
+        }
+        std::cout << "Global stats loaded." << std::endl;
+    }
+
+    // load the segment in segment_dir, false if its index file is gone or its format header names
+    // a codec, block size or scoring model without a search instantiation
+    bool loadSegment(Segment &segment, const std::string &segment_dir)
+    {
+        segment.index_file.open(segment_dir + "/" + INDEX_FILE);
+        if (!segment.index_file.is_open())
+            return false;
+        if (!readIndexFormat(segment_dir, segment.format))
+        {
+            std::cerr << "Unsupported index format: " << segment_dir << std::endl;
+            return false;
+        }
+        std::cout << "Index format: " << segment.format.name() << std::endl;
+        loadLexicon(segment.lexicon, segment_dir + "/" + LEXICON_FILE);
+        segment.dictionary.build(segment.lexicon);
+        loadBlockInfo(segment.block, segment_dir + "/" + BLOCK_INFO_FILE);
+        loadDocInfo(segment, segment_dir + "/" + DOC_INFO_FILE);
+        loadDeletions(segment, segment_dir);
+        if (segment.format.scoring == SCORING_IMPACT && !loadImpactInfo(segment, segment_dir))
+            return false;
+        loadFirstTier(segment, segment_dir);
+        loadPairIndex(segment, segment_dir);
+        return true;
+    }
+
+    // Load the index in dir. Segments of base still listed in the manifest are shared unless their
+    // deletions changed, segments are immutable otherwise. Null if dir holds no index
+    std::shared_ptr<IndexSnapshot> loadSnapshot(const std::string &dir, const std::shared_ptr<IndexSnapshot> &base)
+    {
+        auto snapshot = std::make_shared<IndexSnapshot>();
+        snapshot->dir = dir;
+        std::error_code ec;
+        snapshot->manifest_time = std::filesystem::last_write_time(dir + "/" + SEGMENT_MANIFEST, ec);
+        if (ec)
+        {
+            auto segment = std::make_shared<Segment>();
+            if (!loadSegment(*segment, dir))
+            {
+                std::cerr << "Cannot open index: " << dir << std::endl;
+                return nullptr;
+            }
+            snapshot->segments.push_back(std::move(segment));
+            updateCollectionStats(*snapshot);
+            return snapshot;
+        }
+
+        snapshot->segmented = true;
+        loadGlobalStats(*snapshot, dir + "/" + GLOBAL_STATS_FILE);
+        std::ifstream manifest(dir + "/" + SEGMENT_MANIFEST);
+        std::string name;
+        int doc_base, doc_count;
+        while (manifest >> name >> doc_base >> doc_count)
+        {
+            std::string segment_dir = dir + "/" + name;
+            if (base && base->dir == dir)
+            {
+                auto it = std::find_if(base->segments.begin(), base->segments.end(),
+                                       [&name](const std::shared_ptr<Segment> &segment)
+                                       { return segment->name == name; });
+                std::error_code live_docs_ec;
+                if (it != base->segments.end() &&
+                    std::filesystem::last_write_time(segment_dir + "/" + LIVE_DOCS_FILE, live_docs_ec) == (*it)->live_docs.file_time)
+                {
+                    snapshot->segments.push_back(*it);
+                    continue;
+                }
+            }
+
+            auto segment = std::make_shared<Segment>();
+            segment->name = name;
+            segment->doc_base = doc_base;
+            if (!loadSegment(*segment, segment_dir)) // merged away after the manifest was read
+            {
+                snapshot->manifest_time = {};
+                continue;
+            }
+            snapshot->segments.push_back(std::move(segment));
+        }
+        std::sort(snapshot->segments.begin(), snapshot->segments.end(),
+                  [](const std::shared_ptr<Segment> &a, const std::shared_ptr<Segment> &b)
+                  { return a->doc_base < b->doc_base; });
+        updateCollectionStats(*snapshot);
+        std::cout << "Loaded " << snapshot->segments.size() << " segments." << std::endl;
+        return snapshot;
+    }
+
+    // read ahead the longest lists of a snapshot, WARM_BYTES in all, so its first queries do not
+    // wait for the disk
+    void warmSnapshot(const IndexSnapshot &snapshot)
+    {
+        std::vector<std::pair<const LexiconEntry *, int>> lists; // entry and index file
+        for (const auto &segment : snapshot.segments)
+        {
+            for (const auto &[term, entry] : segment->lexicon)
+                lists.emplace_back(&entry, segment->index_file.fd);
+        }
+        std::sort(lists.begin(), lists.end(), [](const auto &a, const auto &b)
+                  { return a.first->bytes_size > b.first->bytes_size; });
+        int64_t warmed = 0;
+        for (const auto &[entry, fd] : lists)
+        {
+            if (warmed + entry->bytes_size > WARM_BYTES)
+                break;
+            posix_fadvise(fd, entry->start_position, entry->bytes_size, POSIX_FADV_WILLNEED);
+            warmed += entry->bytes_size;
+        }
+    }
+
+    // A single index is rewritten in place by build_index while queries still pread its files, so
+    // only a segmented index, whose segments are replaced by renames, is loaded again from its own
+    // directory. A rebuilt single index is loaded from the new directory it was written to
+    bool reloadable(const std::string &dir) const
+    {
+        std::error_code ec;
+        if (index->segmented || index->segments.empty())
+            return true;
+        return !dir.empty() && !std::filesystem::equivalent(dir, index->dir, ec);
+    }
+
+    // Load the index again, or the one in dir, in the background. Queries go on with the current
+    // snapshot until the next one is loaded and warmed. False while a reload is still running, the
+    // caller checks reloadable first
+    bool reload(const std::string &dir)
+    {
+        if (loading.exchange(true))
+            return false;
+        if (loader.joinable())
+            loader.join();
+        std::shared_ptr<IndexSnapshot> base = index;
+        loader = std::thread([this, dir, base]()
+                             {
+                                 auto snapshot = loadSnapshot(dir.empty() ? base->dir : dir, base);
+                                 if (snapshot)
+                                     warmSnapshot(*snapshot);
+                                 std::lock_guard<std::mutex> lock(loaded_mutex);
+                                 loaded = std::move(snapshot);
+                                 loading = false; });
+        return true;
+    }
+
+    // Install a snapshot the loader finished and start a reload if the manifest changed. Runs
+    // before every query, the replaced snapshot is released here
+    void refreshSnapshot()
+    {
+        {
+            std::lock_guard<std::mutex> lock(loaded_mutex);
+            if (loaded)
+            {
+                index = std::move(loaded);
+                std::cout << "Switched to the index in " << index->dir << "." << std::endl;
+            }
+        }
+        if (!index->segmented || loading)
+            return;
+        std::error_code ec;
+        auto mtime = std::filesystem::last_write_time(index->dir + "/" + SEGMENT_MANIFEST, ec);
+        if (!ec && mtime != index->manifest_time)
+            reload(index->dir);
+    }
+
+    std::string getOriginalFileContent(int doc_id)
+    {
+        return "document content";
+        // Seek to the position in the compressed file
+        const Segment &segment = findSegment(doc_id);
+        original_file.seekg(segment.lines_pos[segment.localDocId(doc_id)]);
+
+        // Read the compressed data
+        std::string line;
+        std::getline(original_file, line);
+
+        return line;
+    }
+
+    SearchResponse search(const std::string &query, bool conjunctive)
+    {
+        refreshSnapshot();
+
+        SearchResponse response;
+        QueryStats &stats = response.stats;
+        QueryBudget budget(budget_ms, budget_postings); // counts from the start of the query
+        std::vector<std::vector<std::string>> terms; // words of every query term, several for a prefix
+        std::vector<double> idfs;
+        {
+            QUERY_TIMER(stats, lookup_ms);
+            // process the query, terms missing from every segment are dropped
+            for (const auto &term : processQuery(query))
+            {
+                std::vector<std::string> words;
+                int64_t term_freq = 0;
+                if (term.find('*') != std::string::npos)
+                {
+                    // a wildcard term is the disjunction of its expansion, its df the sum of theirs
+                    words = expandWildcard(term);
+                    for (const auto &word : words)
+                        term_freq += documentFrequency(word);
+                    term_freq = std::min<int64_t>(term_freq, index->total_docs);
+                }
+                else
+                {
+                    words.push_back(term);
+                    term_freq = documentFrequency(term);
+                }
+                if (term_freq > 0)
+                {
+                    terms.push_back(words);
+                    idfs.push_back(computeIDF(term_freq)); // collection wide, so segment scores are comparable
+                }
+            }
+        }
+
+        // if no lists are found, return empty response
+        if (terms.empty())
+            return response;
+
+        std::vector<SearchResult> &results = response.results;
+        for (const auto &segment : index->segments)
+        {
+            if (budget.exceeded())
+                break; // later segments are not searched at all
+            std::vector<SearchResult> segment_results = searchSegment(terms, idfs, *segment, conjunctive, budget, stats);
+
+            // keep the segment's top 10 in global doc_ids
+            QUERY_TIMER(stats, ranking_ms);
+            sortResults(segment_results);
+            for (auto &result : segment_results)
+            {
+                result.doc_id = segment->globalDocId(result.doc_id);
+                results.push_back(result);
+            }
+        }
+
+        QUERY_TIMER(stats, ranking_ms);
+        sortResults(results);
+        if (budget.spent)
+        {
+            response.truncated = true;
+            response.processed = budget.processed();
+        }
+        return response;
+    }
+
+    // threads of every following query, long lists are then traversed in doc_id ranges
+    void setQueryThreads(int threads)
+    {
+        query_pool.reset();
+        if (threads > 1)
+            query_pool = std::make_unique<QueryPool>(threads);
+    }
+
+    // budget of every following query, 0 for no limit
+    void setQueryBudget(double max_ms, int64_t max_postings)
+    {
+        budget_ms = max_ms;
+        budget_postings = max_postings;
+    }
+
+private: // private methods
+    // Evaluate the query on one segment with the cursor and scorer of its format header, the
+    // format is dispatched on once here and the whole search runs in that instantiation
+    std::vector<SearchResult> searchSegment(const std::vector<std::vector<std::string>> &terms, const std::vector<double> &idfs,
+                                            Segment &segment, bool conjunctive, QueryBudget &budget, QueryStats &stats)
+    {
+        std::vector<SearchResult> results;
+        visitFormat(segment.format, [&](auto block_size, auto codec)
+                    {
+                        using List = InvertedList<decltype(block_size)::value, decltype(codec)>;
+                        if (segment.format.scoring == SCORING_IMPACT)
+                            results = searchSegmentAs<List>(terms, idfs, segment, conjunctive, ImpactScorer{segment.impact_scale}, budget, stats);
+                        else
+                            results = searchSegmentAs<List>(terms, idfs, segment, conjunctive, Bm25Scorer{index->avg_doc_length}, budget, stats); });
+        return results;
+    }
+
+    // Evaluate the query on one segment: BM25 segments try the first tier and the pair index
+    // before the full lists
+    template <class List, class Scorer>
+    std::vector<SearchResult> searchSegmentAs(const std::vector<std::vector<std::string>> &terms, const std::vector<double> &idfs,
+                                              Segment &segment, bool conjunctive, const Scorer &scorer, QueryBudget &budget,
+                                              QueryStats &stats)
+    {
+        if constexpr (std::is_same_v<Scorer, Bm25Scorer>)
+        {
+            std::vector<SearchResult> results;
+            if (segment.first_tier && searchFirstTier<List>(terms, idfs, segment, conjunctive, scorer, budget, stats, results))
+                return results;
+            if (conjunctive && searchPairs<List>(terms, idfs, segment, scorer, budget, stats, results))
+                return results;
+        }
+
+        ListPrefetcher prefetcher(io_ring.get()); // outlives the lists reading from it
+        std::vector<List> lists;
+        std::vector<double> list_idfs;
+        {
+            QUERY_TIMER(stats, lookup_ms);
+            // find the inverted lists for the terms, all of them are read in one batch
+            std::vector<std::vector<const LexiconEntry *>> entries; // lists of every query term found
+            for (size_t i = 0; i < terms.size(); ++i)
+            {
+                std::vector<const LexiconEntry *> term_entries;
+                for (const auto &word : terms[i])
+                {
+                    auto it = segment.lexicon.find(word);
+                    if (it != segment.lexicon.end())
+                        term_entries.push_back(&it->second);
+                }
+                if (!term_entries.empty())
+                {
+                    entries.push_back(term_entries);
+                    list_idfs.push_back(idfs[i]);
+                }
+            }
+            if (entries.empty() || (conjunctive && entries.size() < terms.size()))
+                return {};
+            for (const auto &term_entries : entries)
             {
-                current_block_index_ = i - 1;
-                break;
+                for (const LexiconEntry *entry : term_entries)
+                    prefetcher.add(segment.index_file, entry->start_position, entry->bytes_size);
+            }
+            prefetcher.submit(stats);
+            int list_id = 0;
+            for (const auto &term_entries : entries)
+            {
+                if (term_entries.size() == 1)
+                {
+                    lists.emplace_back(segment, *term_entries[0], prefetcher, list_id++, budget, stats);
+                    continue;
+                }
+                std::vector<List> parts;
+                for (const LexiconEntry *entry : term_entries)
+                    parts.emplace_back(segment, *entry, prefetcher, list_id++, budget, stats);
+                lists.emplace_back(parts, segment);
             }
         }
-        std::cout << "Block index loaded. Current block index: " << current_block_index_ << std::endl;
-    }
 
-    void openBlock()
-    {
-        std::cout << "Opening block." << std::endl;
-        index_file_.seekg(block_info_[current_block_index_].second);
-        if (current_block_index_ == block_info_.size() - 1) // last block
+        QUERY_TIMER(stats, traversal_ms);
+        if constexpr (std::is_same_v<Scorer, ImpactScorer>)
         {
-            bytes_size_ = bytes_size_ - block_info_[current_block_index_].second;
+            return impactSearch(lists, segment, conjunctive, scorer, budget, stats);
         }
-        else // not the last block
+        else
         {
-            bytes_size_ = block_info_[current_block_index_ + 1].second - block_info_[current_block_index_].second;
+            if (std::all_of(lists.begin(), lists.end(), [](const List &list)
+                            { return list.isBitmap(); }))
+            {
+                return bitmapSearch(lists, list_idfs, segment, conjunctive, scorer, budget, stats);
+            }
+            std::vector<SearchResult> results;
+            if (query_pool && (conjunctive || lists.size() > BLOCK_SCORING_MAX_TERMS) &&
+                parallelSearch(lists, list_idfs, segment, conjunctive, scorer, prefetcher, stats, results))
+            {
+                return results;
+            }
+            if (conjunctive)
+            {
+                return conjunctiveSearch(lists, list_idfs, segment, scorer, stats);
+            }
+            if (lists.size() <= BLOCK_SCORING_MAX_TERMS)
+            {
+                return blockSearch(lists, list_idfs, segment, scorer, budget, stats);
+            }
+            return disjunctiveSearch(lists, list_idfs, segment, scorer, stats, {});
         }
-        current_block_.resize(bytes_size_);
-        index_file_.read(reinterpret_cast<char *>(current_block_.data()), bytes_size_); // read the block into memory
-        current_pos_ = 0;                                                               // reset the current position
     }
 
-    bool loadNextBlock()
+    // Split the doc_ids at block boundaries of the longest list into ranges traversed by the query
+    // pool, every range keeps its top 10 and they are merged. Returns false if the lists are too
+    // short to be worth it
+    template <class List>
+    bool parallelSearch(std::vector<List> &lists, const std::vector<double> &idfs, const Segment &segment, bool conjunctive,
+                        const Bm25Scorer &scorer, ListPrefetcher &prefetcher, QueryStats &stats, std::vector<SearchResult> &results)
     {
-        std::cout << "Loading next block." << std::endl;
-        current_block_index_++;
-        if (current_block_index_ == block_info_.size()) // no more blocks
+        int longest = -1;
+        for (size_t i = 0; i < lists.size(); ++i)
         {
+            if (lists[i].hasBlocks() && (longest < 0 || lists[i].getPostingsNum() > lists[longest].getPostingsNum()))
+                longest = i;
+        }
+        if (longest < 0)
             return false;
+        int blocks = (lists[longest].getPostingsNum() + List::BLOCK_POSTINGS - 1) / List::BLOCK_POSTINGS;
+        int ranges = std::min(query_pool->size() * RANGES_PER_THREAD, blocks / PARALLEL_MIN_BLOCKS);
+        if (ranges < 2)
+            return false;
+
+        prefetcher.waitAll(stats);
+        std::vector<int> starts = lists[longest].rangeStarts(ranges);
+        std::vector<std::vector<SearchResult>> range_results(starts.size());
+        std::vector<QueryStats> range_stats(starts.size());
+        query_pool->run(starts.size(), [&](size_t range)
+                        {
+                            int end = range + 1 < starts.size() ? starts[range + 1] : std::numeric_limits<int>::max();
+                            std::vector<List> range_lists;
+                            range_lists.reserve(lists.size());
+                            for (const auto &list : lists)
+                                range_lists.emplace_back(list, starts[range], end, range_stats[range]);
+                            if (conjunctive)
+                                range_results[range] = conjunctiveSearch(range_lists, idfs, segment, scorer, range_stats[range]);
+                            else
+                                range_results[range] = disjunctiveSearch(range_lists, idfs, segment, scorer, range_stats[range], {});
+                            sortResults(range_results[range]); });
+
+        results.clear();
+        for (size_t range = 0; range < starts.size(); ++range)
+        {
+            stats.add(range_stats[range]);
+            results.insert(results.end(), range_results[range].begin(), range_results[range].end());
         }
-        openBlock();
         return true;
     }
 
-public:
-    InvertedList(std::ifstream &index_file, int64_t start_pos, int64_t bytes_size, std::vector<std::pair<int, int>> &block_info)
-        : index_file_(index_file), start_pos_(start_pos), bytes_size_(bytes_size), block_info_(block_info)
-    {
-        std::cout << "Inverted list initialized. Start pos: " << start_pos_ << ", Size: " << bytes_size_ << " bytes." << std::endl;
-        loadBlockIndex();
-        openBlock();
-    }
-
-    bool next(int &doc_id, int &freq)
+    // Evaluate a conjunctive query with the pair index: indexed pairs of its terms are taken
+    // shortest list first, each pair list replaces the lists of both its terms. Returns false if
+    // the pair index holds no pair of the query
+    template <class List>
+    bool searchPairs(const std::vector<std::vector<std::string>> &terms, const std::vector<double> &idfs, Segment &segment,
+                     const Bm25Scorer &scorer, QueryBudget &budget, QueryStats &stats, std::vector<SearchResult> &results)
     {
-        if (current_pos_ >= POSTING_PER_BLOCK) // Check if we have processed all postings in the current block
+        if (!segment.pair_index || terms.size() < 2)
+            return false;
+        PairIndex &pairs = *segment.pair_index;
+        std::vector<std::tuple<int, size_t, size_t, const LexiconEntry *>> found; // postings, first and second term
         {
-            if (!loadNextBlock())
+            QUERY_TIMER(stats, lookup_ms);
+            for (size_t i = 0; i < terms.size(); ++i)
             {
-                return false;
+                for (size_t j = 0; j < terms.size(); ++j)
+                {
+                    if (terms[i].size() != 1 || terms[j].size() != 1 || terms[i][0] >= terms[j][0])
+                        continue;
+                    auto it = pairs.lexicon.find(terms[i][0] + PAIR_SEPARATOR + terms[j][0]);
+                    if (it != pairs.lexicon.end())
+                        found.emplace_back(it->second.postings_num, i, j, &it->second);
+                }
             }
-            current_pos_ = 0; // Reset position after loading a new block
         }
+        if (found.empty())
+            return false;
+        std::sort(found.begin(), found.end());
 
-        size_t bytes_read = 0;
-
-        // Decode the next doc_id diff
-        int doc_id_diff = varbyteDecode(current_block_.data() + current_pos_, current_block_.size() - current_pos_, bytes_read);
-        current_pos_ += bytes_read; // Move position by the size of the encoded doc_id
-
-        // Decode the corresponding frequency
-        int freq_pos = POSTING_PER_BLOCK + current_pos_; // Calculate position for frequency
-        freq = varbyteDecode(current_block_.data() + freq_pos, current_block_.size() - freq_pos, bytes_read);
-
-        // Update the doc_id with the decoded difference
-        doc_id += doc_id_diff;
+        ListPrefetcher prefetcher(io_ring.get());
+        std::vector<List> lists;
+        std::vector<std::pair<int, int>> list_terms;
+        {
+            QUERY_TIMER(stats, lookup_ms);
+            std::vector<const LexiconEntry *> pair_entries;
+            std::vector<bool> covered(terms.size(), false);
+            for (const auto &[postings_num, first, second, entry] : found)
+            {
+                if (covered[first] || covered[second])
+                    continue;
+                covered[first] = covered[second] = true;
+                pair_entries.push_back(entry);
+                list_terms.emplace_back(first, second);
+            }
+            std::vector<const LexiconEntry *> entries;
+            for (size_t i = 0; i < terms.size(); ++i)
+            {
+                if (covered[i])
+                    continue;
+                if (terms[i].size() != 1)
+                    return false; // prefix terms are merged by searchSegment
+                auto it = segment.lexicon.find(terms[i][0]);
+                if (it == segment.lexicon.end())
+                {
+                    results.clear();
+                    return true;
+                }
+                entries.push_back(&it->second);
+                list_terms.emplace_back(i, -1);
+            }
+            for (const LexiconEntry *entry : pair_entries)
+                prefetcher.add(pairs.index_file, entry->start_position, entry->bytes_size);
+            for (const LexiconEntry *entry : entries)
+                prefetcher.add(segment.index_file, entry->start_position, entry->bytes_size);
+            prefetcher.submit(stats);
+            int list_id = 0;
+            for (const LexiconEntry *entry : pair_entries)
+                lists.emplace_back(segment, pairs, *entry, prefetcher, list_id++, budget, stats);
+            for (const LexiconEntry *entry : entries)
+                lists.emplace_back(segment, *entry, prefetcher, list_id++, budget, stats);
+            QUERY_STAT(stats, pair_lists += pair_entries.size());
+        }
 
+        QUERY_TIMER(stats, traversal_ms);
+        results = pairSearch(lists, list_terms, idfs, segment, scorer, stats);
         return true;
     }
 
-    int64_t getSize() const { return bytes_size_; }
-};
+    // Evaluate the query on the first tier of a segment. Returns false if the pruned postings
+    // could still change the top 10, the caller then falls back to the full lists
+    template <class List>
+    bool searchFirstTier(const std::vector<std::vector<std::string>> &terms, const std::vector<double> &idfs,
+                         Segment &segment, bool conjunctive, const Bm25Scorer &scorer, QueryBudget &budget, QueryStats &stats,
+                         std::vector<SearchResult> &results)
+    {
+        IndexTier &tier = *segment.first_tier;
+        if (tier.avg_doc_length != scorer.avg_doc_length)
+            return false; // bounds were computed with other collection stats
+        if (std::any_of(terms.begin(), terms.end(), [](const std::vector<std::string> &words)
+                        { return words.size() > 1; }))
+            return false; // bounds hold for single lists, not for the union of a prefix
 
-class SearchEngine
-{
-private: // private members
-    std::unordered_map<std::string, LexiconEntry> lexicon;
-    std::vector<std::pair<int, int>> block;
-    std::unordered_map<int, std::string> term_id_to_word;
-    std::ifstream index_file;
-    std::ifstream doc_info_file;
-    std::ifstream original_file;
-    std::vector<int64_t> lines_pos;
-    std::vector<int> doc_lengths;
-    int total_docs;
-    double avg_doc_length;
+        ListPrefetcher prefetcher(io_ring.get());
+        std::vector<List> lists;
+        std::vector<double> list_idfs;
+        std::vector<double> pruned_bounds; // best score the pruned postings of each list can add
+        std::vector<double> max_scores;
+        {
+            QUERY_TIMER(stats, lookup_ms);
+            std::vector<const LexiconEntry *> entries;
+            for (size_t i = 0; i < terms.size(); ++i)
+            {
+                auto it = tier.lexicon.find(terms[i][0]);
+                if (it != tier.lexicon.end())
+                {
+                    entries.push_back(&it->second);
+                    list_idfs.push_back(idfs[i]);
+                    pruned_bounds.push_back(idfs[i] * it->second.pruned_part);
+                    max_scores.push_back(idfs[i] * it->second.max_part);
+                }
+            }
+            if (entries.empty() || (conjunctive && entries.size() < terms.size()))
+            {
+                results.clear();
+                return true; // the tier holds every term of the segment
+            }
+            for (const LexiconEntry *entry : entries)
+                prefetcher.add(tier.index_file, entry->start_position, entry->bytes_size);
+            prefetcher.submit(stats);
+            for (size_t i = 0; i < entries.size(); ++i)
+                lists.emplace_back(segment, tier, *entries[i], prefetcher, i, budget, stats);
+        }
 
-public: // public members
-    SearchEngine(const std::string &lexicon_file, const std::string &index_file,
-                 const std::string &doc_info_file, const std::string &block_info_file, const std::string &original_tar_gz)
-        : index_file(index_file, std::ios::binary), original_file(original_tar_gz, std::ios::binary)
-    {
-        loadLexicon(lexicon_file);
-        loadBlockInfo(block_info_file);
-        loadDocInfo(doc_info_file);
-    }
+        {
+            QUERY_TIMER(stats, traversal_ms);
+            if (conjunctive)
+            {
+                results = conjunctiveSearch(lists, list_idfs, segment, scorer, stats);
+            }
+            else
+            {
+                results = disjunctiveSearch(lists, list_idfs, segment, scorer, stats, pruned_bounds);
+            }
+        }
 
-    void loadLexicon(const std::string &lexicon_file)
-    {
-        std::ifstream lex_file(lexicon_file);
-        std::unordered_map<int, std::string> term_id_to_word;
-        std::string term;
-        LexiconEntry entry;
-        std::cout << "Loading lexicon..." << std::endl;
-        while (lex_file >> term >> entry.term_id >> entry.postings_num >> entry.start_position >> entry.bytes_size) // tested
+        if (budget.spent)
+            return true; // no time left to fall back to the full lists
+
+        // best score of a doc the tier did not fully score
+        double unseen_bound = 0;
+        if (conjunctive)
         {
-            lexicon[term] = entry;
-            term_id_to_word[entry.term_id] = term;
+            // such a doc has a pruned posting in at least one list, and at most the best posting in the others
+            double max_sum = 0;
+            for (double max_score : max_scores)
+                max_sum += max_score;
+            for (size_t i = 0; i < lists.size(); ++i)
+            {
+                if (pruned_bounds[i] > 0)
+                    unseen_bound = std::max(unseen_bound, max_sum - max_scores[i] + pruned_bounds[i]);
+            }
+        }
+        else
+        {
+            for (double pruned_bound : pruned_bounds)
+                unseen_bound += pruned_bound;
         }
-        std::cout << "Lexicon loaded." << std::endl;
-    }
 
-    void loadBlockInfo(const std::string &block_info_file)
-    {
-        std::cout << "Loading block info..." << std::endl;
-        std::ifstream block_info(block_info_file);
-        int last_doc_id = 0;
-        int block_start_pos = 0;
-        int block_size = 0;
-        while (block_info >> last_doc_id >> block_size) // tested
+        // the top 10 is final if its scores are exact and no other doc can reach the 10th score
+        QUERY_TIMER(stats, ranking_ms);
+        std::sort(results.begin(), results.end(),
+                  [](const SearchResult &a, const SearchResult &b)
+                  { return a.score > b.score; });
+        size_t top = std::min<size_t>(results.size(), 10);
+        double threshold = top == 10 ? results[9].score : 0;
+        bool complete = unseen_bound == 0 || (top == 10 && unseen_bound <= threshold);
+        for (size_t i = 0; i < results.size() && complete; ++i)
         {
-            block.push_back({last_doc_id, block_start_pos});
-            block_start_pos += block_size;
+            complete = i < top ? results[i].bound == 0 : results[i].score + results[i].bound <= threshold;
         }
-        std::cout << "Block info loaded." << std::endl;
+        if (complete)
+        {
+            QUERY_STAT(stats, tier_answers++);
+            return true;
+        }
+        QUERY_STAT(stats, tier_fallbacks++);
+        return false;
     }
 
-    void loadDocInfo(const std::string &doc_info_file)
+    // collection statistics over all segments, used by BM25
+    void updateCollectionStats(IndexSnapshot &snapshot)
     {
-        std::cout << "Loading doc info..." << std::endl;
-        std::ifstream doc_info(doc_info_file);
-        int total_length = 0;
-        int total_docs = 0;
-        int doc_length;
-        int64_t line_pos;
-        while (doc_info >> doc_length >> line_pos) // tested
+        if (snapshot.global_docs > 0)
         {
-            doc_lengths.push_back(doc_length);
-            total_length += doc_length;
-            ++total_docs;
-            lines_pos.push_back(line_pos);
+            snapshot.total_docs = snapshot.global_docs;
+            snapshot.avg_doc_length = static_cast<double>(snapshot.global_length) / snapshot.global_docs;
+            return;
         }
-        avg_doc_length = static_cast<double>(total_length) / total_docs;
-        std::cout << "Doc info loaded." << std::endl;
+        int64_t total_length = 0;
+        snapshot.total_docs = 0;
+        for (const auto &segment : snapshot.segments)
+        {
+            total_length += segment->total_length;
+            snapshot.total_docs += segment->num_docs;
+        }
+        snapshot.avg_doc_length = snapshot.total_docs > 0 ? static_cast<double>(total_length) / snapshot.total_docs : 0;
     }
 
-    std::string getOriginalFileContent(int doc_id)
+    // number of docs containing term in the whole collection
+    int64_t documentFrequency(const std::string &term) const
     {
-        return "document content";
-        // Seek to the position in the compressed file
-        original_file.seekg(lines_pos[doc_id]);
-
-        // Read the compressed data
-        std::string line;
-        std::getline(original_file, line);
-
-        return line;
+        if (index->global_docs > 0)
+        {
+            auto it = index->global_df.find(term);
+            return it == index->global_df.end() ? 0 : it->second;
+        }
+        int64_t term_freq = 0;
+        for (const auto &segment : index->segments)
+        {
+            auto it = segment->lexicon.find(term);
+            if (it != segment->lexicon.end())
+                term_freq += it->second.postings_num;
+        }
+        return term_freq;
     }
 
-    std::vector<SearchResult> search(const std::string &query, bool conjunctive)
+    // Terms matching a query term with '*' wildcards, the PREFIX_EXPANSION_LIMIT with the highest df.
+    // The part before the first '*' is looked up as a range of the term dictionaries, the rest of
+    // the pattern filters that range. A pattern starting with '*' matches nothing
+    std::vector<std::string> expandWildcard(const std::string &pattern) const
     {
-        // process the query
-        std::cout << "Processing query..." << std::endl;
-        std::vector<std::string> terms = processQuery(query);
-        std::cout << "Query processed." << std::endl;
-        std::vector<InvertedList> lists;
-        // find the inverted lists for the terms
-        for (const auto &term : terms)
+        std::string prefix = pattern.substr(0, pattern.find('*'));
+        if (prefix.empty())
+            return {};
+        bool prefix_only = prefix.size() + 1 == pattern.size();
+        std::vector<std::pair<std::string, int64_t>> matches; // term and its df in the segment it came from
+        for (const auto &segment : index->segments)
         {
-            std::cout << "Searching for term: " << term << std::endl;
-            if (lexicon.find(term) != lexicon.end())
-            {
-                std::cout << "Found term: " << term << std::endl;
-                const auto &entry = lexicon[term];
-                lists.emplace_back(index_file, entry.start_position, entry.bytes_size, block);
-                std::cout << "Inverted list found for term: " << term << std::endl;
-                std::cout << "The term starts at: " << entry.start_position << " with size: " << entry.bytes_size << std::endl;
-            }
-            else
+            for (auto &match : segment->dictionary.prefixRange(prefix))
             {
-                std::cout << "Term not found: " << term << std::endl;
+                if (prefix_only || fnmatch(pattern.c_str(), match.first.c_str(), 0) == 0)
+                    matches.push_back(std::move(match));
             }
         }
-
-        // if no lists are found, return empty vector
-        if (lists.empty())
-            return {};
-
-        std::vector<SearchResult> results;
-        if (conjunctive)
+        if (index->segments.size() > 1)
         {
-            results = conjunctiveSearch(lists);
+            // sum the dfs of a term over the segments
+            std::sort(matches.begin(), matches.end());
+            size_t unique = 0;
+            for (size_t i = 0; i < matches.size(); ++i)
+            {
+                if (unique > 0 && matches[unique - 1].first == matches[i].first)
+                    matches[unique - 1].second += matches[i].second;
+                else if (unique++ != i)
+                    matches[unique - 1] = std::move(matches[i]);
+            }
+            matches.resize(unique);
         }
-        else
+        if (index->global_docs > 0)
         {
-            results = disjunctiveSearch(lists);
+            for (auto &[word, df] : matches)
+                df = documentFrequency(word);
         }
+        size_t limit = std::min(matches.size(), PREFIX_EXPANSION_LIMIT);
+        std::partial_sort(matches.begin(), matches.begin() + limit, matches.end(),
+                          [](const std::pair<std::string, int64_t> &a, const std::pair<std::string, int64_t> &b)
+                          { return a.second > b.second || (a.second == b.second && a.first < b.first); });
+        std::vector<std::string> words;
+        for (size_t i = 0; i < limit; ++i)
+            words.push_back(std::move(matches[i].first));
+        return words;
+    }
+
+    const Segment &findSegment(int doc_id) const
+    {
+        auto it = std::upper_bound(index->segments.begin(), index->segments.end(), doc_id,
+                                   [](int id, const std::shared_ptr<Segment> &segment)
+                                   { return id < segment->doc_base; });
+        return **(it - 1);
+    }
 
+    // sort by score and keep the top 10
+    void sortResults(std::vector<SearchResult> &results)
+    {
         std::sort(results.begin(), results.end(),
                   [](const SearchResult &a, const SearchResult &b)
                   { return a.score > b.score; });
         if (results.size() > 10)
             results.resize(10);
-        return results;
     }
 
-private: // private methods
     std::vector<std::string> processQuery(const std::string &query)
     {
         std::vector<std::string> terms;
@@ -277,111 +2246,255 @@ private: // private methods
             std::transform(term.begin(), term.end(), term.begin(), ::tolower);
             terms.push_back(term);
         }
-        std::cout << "Query terms: ";
-        for (const auto &term : terms)
-        {
-            std::cout << term << " ";
-        }
-        std::cout << std::endl;
         return terms;
     }
 
     double computeIDF(int64_t term_freq)
     {
-        return std::log((total_docs - term_freq + 0.5) / (term_freq + 0.5) + 1.0);
+        return std::log((index->total_docs - term_freq + 0.5) / (term_freq + 0.5) + 1.0);
     }
 
-    double computeTF(int freq, int doc_length)
+    template <class List>
+    std::vector<SearchResult> conjunctiveSearch(std::vector<List> &lists, const std::vector<double> &idfs,
+                                                const Segment &segment, const Bm25Scorer &scorer, QueryStats &stats)
     {
-        return (freq * (k1 + 1)) / (freq + k1 * (1 - b + b * (doc_length / avg_doc_length)));
+        const std::vector<int> &doc_lengths = segment.doc_lengths;
+        std::vector<SearchResult> results;
+        intersectLists(lists, [&](int doc_id, const std::vector<int> &freqs)
+                       {
+                           double score = 0;
+                           int doc_length = doc_lengths[doc_id];
+                           for (size_t i = 0; i < lists.size(); ++i)
+                               score += scorer.score(idfs[i], freqs[i], doc_length);
+                           results.push_back({doc_id, score});
+                           QUERY_STAT(stats, docs_scored++); });
+        return results;
     }
 
-    std::vector<SearchResult> conjunctiveSearch(std::vector<InvertedList> &lists)
+    // conjunctiveSearch over pair lists and single term lists. list_terms holds the query terms of
+    // every list, the second one -1 for single terms. Term scores are summed in query order so
+    // scores come out the same as without the pair index
+    template <class List>
+    std::vector<SearchResult> pairSearch(std::vector<List> &lists, const std::vector<std::pair<int, int>> &list_terms,
+                                         const std::vector<double> &idfs, const Segment &segment, const Bm25Scorer &scorer,
+                                         QueryStats &stats)
     {
-        std::cout << "Conjunctive search..." << std::endl;
+        const std::vector<int> &doc_lengths = segment.doc_lengths;
         std::vector<SearchResult> results;
-        int current_doc = 0;
-        std::vector<int> doc_ids(lists.size(), 0);
-        std::vector<int> freqs(lists.size(), 0);
-        std::cout << "Conjunctive search initialized." << std::endl;
+        std::vector<double> term_scores(idfs.size());
+        intersectLists(lists, [&](int doc_id, const std::vector<int> &freqs)
+                       {
+                           int doc_length = doc_lengths[doc_id];
+                           for (size_t i = 0; i < lists.size(); ++i)
+                           {
+                               auto [first, second] = list_terms[i];
+                               term_scores[first] = scorer.score(idfs[first], freqs[i], doc_length);
+                               if (second >= 0)
+                                   term_scores[second] = scorer.score(idfs[second], lists[i].pairFreq(), doc_length);
+                           }
+                           double score = 0;
+                           for (double term_score : term_scores)
+                               score += term_score;
+                           results.push_back({doc_id, score});
+                           QUERY_STAT(stats, docs_scored++); });
+        return results;
+    }
 
-        while (true)
+    // Search over bitmap lists only: the words of the lists are ANDed or ORed together with the
+    // live docs, so only docs in the result are visited, their freqs are found by popcount rank.
+    // Every BITMAP_BUDGET_WORDS words the budget is checked and charged with the postings of the
+    // lists in the next words, postings before the first word of an AND are charged as skipped
+    template <class List>
+    std::vector<SearchResult> bitmapSearch(std::vector<List> &lists, const std::vector<double> &idfs, const Segment &segment,
+                                           bool conjunctive, const Bm25Scorer &scorer, QueryBudget &budget, QueryStats &stats)
+    {
+        int first_word = lists[0].bitmapFirstWord();
+        int end_word = lists[0].bitmapEndWord();
+        for (const auto &list : lists)
         {
-            bool all_equal = true;
-            int max_doc = -1;             // Start with an invalid doc_id value
-            bool any_list_active = false; // To track if any list is still active
+            first_word = conjunctive ? std::max(first_word, list.bitmapFirstWord()) : std::min(first_word, list.bitmapFirstWord());
+            end_word = conjunctive ? std::min(end_word, list.bitmapEndWord()) : std::max(end_word, list.bitmapEndWord());
+        }
 
-            // Process each inverted list
-            for (size_t i = 0; i < lists.size(); ++i)
+        const std::vector<uint64_t> &live_bits = segment.live_docs.bits;
+        const std::vector<int> &doc_lengths = segment.doc_lengths;
+        std::priority_queue<std::pair<double, int>, std::vector<std::pair<double, int>>, std::greater<>> top;
+        int charged_word = 0; // postings of the words before it were charged to the budget
+        for (int word = first_word; word < end_word; ++word)
+        {
+            if ((word - first_word) % BITMAP_BUDGET_WORDS == 0)
+            {
+                if (word > first_word && budget.exceeded())
+                    break; // like the first block of a list, the first words are always combined
+                int stride_end = std::min(word + BITMAP_BUDGET_WORDS, end_word);
+                for (const auto &list : lists)
+                    budget.postings_done += list.bitmapRank(stride_end) - list.bitmapRank(charged_word);
+                charged_word = stride_end;
+            }
+            uint64_t bits = conjunctive ? ~uint64_t(0) : 0;
+            for (const auto &list : lists)
+                bits = conjunctive ? bits & list.bitmapWord(word) : bits | list.bitmapWord(word);
+            if (!live_bits.empty())
+                bits &= live_bits[word];
+            for (; bits != 0; bits &= bits - 1)
             {
-                // Advance the list until we find a doc_id >= current_doc
-                while (doc_ids[i] < current_doc && lists[i].next(doc_ids[i], freqs[i]))
+                int doc_id = word * 64 + __builtin_ctzll(bits);
+                double score = 0;
+                for (size_t i = 0; i < lists.size(); ++i)
                 {
+                    if (lists[i].bitmapWord(word) >> (doc_id % 64) & 1)
+                        score += scorer.score(idfs[i], lists[i].bitmapFreq(doc_id), doc_lengths[doc_id]);
                 }
-                std::cout << "Doc ID: " << doc_ids[i] << ", Freq: " << freqs[i] << std::endl;
-
-                if (doc_ids[i] != current_doc)
-                    all_equal = false;
-
-                // Only consider active lists (i.e., where next() was successful)
-                if (lists[i].next(doc_ids[i], freqs[i]))
+                QUERY_STAT(stats, docs_scored++);
+                if (top.size() < 10 || score > top.top().first)
                 {
-                    any_list_active = true;
-
-                    // Find the maximum doc_id across all lists
-                    if (doc_ids[i] > max_doc)
-                        max_doc = doc_ids[i];
+                    top.push({score, doc_id});
+                    QUERY_STAT(stats, heap_insertions++);
+                    if (top.size() > 10)
+                        top.pop();
                 }
             }
+        }
 
-            // If no list is active anymore, stop the search
-            if (!any_list_active)
-                break;
+        std::vector<SearchResult> results;
+        for (; !top.empty(); top.pop())
+            results.push_back({top.top().second, top.top().first});
+        return results;
+    }
+
+    // list order of term-at-a-time traversal. With a budget the rarest lists, whose postings score
+    // highest, come first so a truncated query has scored what matters most
+    template <class List>
+    std::vector<size_t> traversalOrder(const std::vector<List> &lists, const QueryBudget &budget)
+    {
+        std::vector<size_t> order(lists.size());
+        std::iota(order.begin(), order.end(), 0);
+        if (budget.limited())
+        {
+            std::stable_sort(order.begin(), order.end(), [&lists](size_t a, size_t b)
+                             { return lists[a].getPostingsNum() < lists[b].getPostingsNum(); });
+        }
+        return order;
+    }
 
-            // If all lists have the same doc_id, calculate the score and move to the next document
-            if (all_equal)
+    // Term-at-a-time integer accumulation over an impact index, scores are sums of precomputed
+    // quantized BM25 impacts so no floating point work happens per posting
+    template <class List>
+    std::vector<SearchResult> impactSearch(std::vector<List> &lists, Segment &segment, bool conjunctive,
+                                           const ImpactScorer &scorer, QueryBudget &budget, QueryStats &stats)
+    {
+        std::vector<uint32_t> &accumulators = segment.accumulators;
+        std::vector<int> touched; // docs with a nonzero accumulator
+        int doc_id, impact;
+        for (size_t i : traversalOrder(lists, budget))
+        {
+            while (lists[i].next(doc_id, impact))
             {
-                if (current_doc < doc_lengths.size()) // Ensure doc_lengths[current_doc] is valid
-                {
-                    double score = 0;
-                    int doc_length = doc_lengths[current_doc];
-                    for (size_t i = 0; i < lists.size(); ++i)
-                    {
-                        double idf = computeIDF(lists[i].getSize());
-                        double tf = computeTF(freqs[i], doc_length);
-                        score += idf * tf;
-                    }
-                    results.push_back({current_doc, score});
-                }
-                ++current_doc; // Increment to the next doc
+                if (accumulators[doc_id] == 0)
+                    touched.push_back(doc_id);
+                // the top 8 bits count the lists matching the doc, for conjunctive queries of up to 255 terms
+                accumulators[doc_id] += impact + (1u << 24);
             }
-            else
+        }
+
+        std::vector<SearchResult> results;
+        uint32_t required = conjunctive ? lists.size() : 1;
+        for (int touched_doc : touched)
+        {
+            uint32_t accumulator = accumulators[touched_doc];
+            accumulators[touched_doc] = 0;
+            if ((accumulator >> 24) < required)
+                continue;
+            results.push_back({touched_doc, scorer.score(accumulator & 0xFFFFFF)});
+            QUERY_STAT(stats, docs_scored++);
+        }
+        return results;
+    }
+
+    // Term-at-a-time disjunctive search for short queries: whole decoded blocks are scored with
+    // scoreBlock into per-doc accumulators, a top 10 pass over the touched partitions finishes
+    template <class List>
+    std::vector<SearchResult> blockSearch(std::vector<List> &lists, const std::vector<double> &idfs, Segment &segment,
+                                          const Bm25Scorer &scorer, QueryBudget &budget, QueryStats &stats)
+    {
+        size_t doc_count = segment.doc_lengths.size();
+        double avg_doc_length = scorer.avg_doc_length;
+        if (segment.length_norms_avg != avg_doc_length || segment.length_norms.size() != doc_count)
+        {
+            // same arithmetic as Bm25Scorer so both paths give the same scores
+            segment.length_norms.resize(doc_count);
+            for (size_t doc_id = 0; doc_id < doc_count; ++doc_id)
+                segment.length_norms[doc_id] = BM25_K1 * (1 - BM25_B + BM25_B * (segment.doc_lengths[doc_id] / avg_doc_length));
+            segment.length_norms_avg = avg_doc_length;
+            segment.scores.assign(doc_count, 0);
+            segment.touched_partitions.assign(doc_count / ACCUMULATOR_PARTITION + 1, 0);
+        }
+
+        std::vector<double> &scores = segment.scores;
+        const int *doc_ids;
+        const int *freqs;
+        int count;
+        for (size_t i : traversalOrder(lists, budget))
+        {
+            while (lists[i].nextBlock(doc_ids, freqs, count))
             {
-                // Move to the largest doc_id found across the lists to continue
-                current_doc = max_doc;
+                scoreBlock(doc_ids, freqs, count, idfs[i], segment.length_norms.data(), scores.data());
+                for (int j = 0; j < count; ++j)
+                    segment.touched_partitions[doc_ids[j] / ACCUMULATOR_PARTITION] = 1;
             }
+        }
 
-            // Exit condition: stop when the current doc_id exceeds total_docs
-            if (current_doc >= total_docs || max_doc == -1)
-                break;
+        // top 10 of the touched partitions, accumulators are cleared on the way
+        std::priority_queue<std::pair<double, int>, std::vector<std::pair<double, int>>, std::greater<>> top;
+        for (size_t partition = 0; partition < segment.touched_partitions.size(); ++partition)
+        {
+            if (!segment.touched_partitions[partition])
+                continue;
+            segment.touched_partitions[partition] = 0;
+            size_t end = std::min(doc_count, (partition + 1) * ACCUMULATOR_PARTITION);
+            for (size_t doc_id = partition * ACCUMULATOR_PARTITION; doc_id < end; ++doc_id)
+            {
+                double score = scores[doc_id];
+                if (score == 0)
+                    continue;
+                scores[doc_id] = 0;
+                QUERY_STAT(stats, docs_scored++);
+                if (!segment.live_docs.isLive(doc_id))
+                    continue;
+                if (top.size() < 10 || score > top.top().first)
+                {
+                    top.push({score, static_cast<int>(doc_id)});
+                    QUERY_STAT(stats, heap_insertions++);
+                    if (top.size() > 10)
+                        top.pop();
+                }
+            }
         }
 
+        std::vector<SearchResult> results;
+        for (; !top.empty(); top.pop())
+            results.push_back({top.top().second, top.top().first});
         return results;
     }
 
-    std::vector<SearchResult> disjunctiveSearch(std::vector<InvertedList> &lists)
+    // pruned_bounds is empty unless lists come from a first tier, results then carry the score
+    // their doc may still gain from pruned postings of the lists it did not match
+    template <class List>
+    std::vector<SearchResult> disjunctiveSearch(std::vector<List> &lists, const std::vector<double> &idfs,
+                                                const Segment &segment, const Bm25Scorer &scorer, QueryStats &stats,
+                                                const std::vector<double> &pruned_bounds)
     {
-        std::cout << "Disjunctive search..." << std::endl;
+        const std::vector<int> &doc_lengths = segment.doc_lengths;
         std::vector<SearchResult> results;
         std::vector<int> doc_ids(lists.size(), 0);
         std::vector<int> freqs(lists.size(), 0);
         std::priority_queue<std::pair<int, int>> pq;
-        std::cout << "Disjunctive search initialized." << std::endl;
         for (size_t i = 0; i < lists.size(); ++i)
         {
             if (lists[i].next(doc_ids[i], freqs[i]))
             {
                 pq.push({-doc_ids[i], i});
+                QUERY_STAT(stats, heap_insertions++);
             }
         }
 
@@ -391,90 +2504,270 @@ private: // private methods
             int list_index = pq.top().second;
             pq.pop();
 
+            // the doc was already scored when another list popped it
+            if (doc_ids[list_index] != doc_id)
+                continue;
+
             double score = 0;
 
             // Check if doc_id is within the range of doc_lengths
-            if (doc_id < 0 || doc_id >= doc_lengths.size())
+            if (doc_id < 0 || size_t(doc_id) >= doc_lengths.size())
             {
                 std::cerr << "Invalid doc_id: " << doc_id << std::endl;
                 continue;
             }
 
             int doc_length = doc_lengths[doc_id];
+            double bound = 0;
 
             for (size_t i = 0; i < lists.size(); ++i)
             {
-                if (doc_ids[i] == doc_id)
+                if (doc_ids[i] != doc_id)
                 {
-                    double idf = computeIDF(lists[i].getSize());
-                    double tf = computeTF(freqs[i], doc_length);
-                    score += idf * tf;
+                    if (!pruned_bounds.empty())
+                        bound += pruned_bounds[i];
+                }
+                else
+                {
+                    score += scorer.score(idfs[i], freqs[i], doc_length);
 
                     if (lists[i].next(doc_ids[i], freqs[i]))
                     {
                         pq.push({-doc_ids[i], i});
+                        QUERY_STAT(stats, heap_insertions++);
+                    }
+                    else
+                    {
+                        doc_ids[i] = -1; // list exhausted
                     }
                 }
             }
 
-            results.push_back({doc_id, score});
+            results.push_back({doc_id, score, bound});
+            QUERY_STAT(stats, docs_scored++);
         }
 
         return results;
     }
 };
 
-// Varbyte decode function
-uint32_t varbyteDecode(const std::vector<uint8_t> &bytes)
+// Add idf * BM25 frequency part of a decoded block into the accumulators, norms holds the length
+// part of the denominator per doc
+void scoreBlockScalar(const int *doc_ids, const int *freqs, int count, double idf, const double *norms, double *scores)
 {
-    uint32_t number = 0;
-    for (int i = bytes.size() - 1; i >= 0; --i)
+    for (int i = 0; i < count; ++i)
     {
-        number = (number << 7) | (bytes[i] & 127);
+        double tf = (freqs[i] * (BM25_K1 + 1)) / (freqs[i] + norms[doc_ids[i]]);
+        scores[doc_ids[i]] += idf * tf;
     }
-    return number;
 }
 
-size_t varbyteEncodedSize(int value)
+#if defined(__x86_64__)
+// scoreBlockScalar four postings at a time, the norms are gathered and the scores scattered back
+__attribute__((target("avx2"))) void scoreBlockAvx2(const int *doc_ids, const int *freqs, int count, double idf,
+                                                    const double *norms, double *scores)
 {
-    size_t size = 0;
-    do
+    const __m256d k1_plus_one = _mm256_set1_pd(BM25_K1 + 1);
+    const __m256d idf_vector = _mm256_set1_pd(idf);
+    alignas(32) double block_scores[4];
+    int i = 0;
+    for (; i + 4 <= count; i += 4)
     {
-        value >>= 7;
-        size++;
-    } while (value > 0);
-    return size;
+        __m128i docs = _mm_loadu_si128(reinterpret_cast<const __m128i *>(doc_ids + i));
+        __m256d freq = _mm256_cvtepi32_pd(_mm_loadu_si128(reinterpret_cast<const __m128i *>(freqs + i)));
+        __m256d norm = _mm256_mask_i32gather_pd(_mm256_setzero_pd(), norms, docs, _mm256_castsi256_pd(_mm256_set1_epi64x(-1)), 8);
+        __m256d tf = _mm256_div_pd(_mm256_mul_pd(freq, k1_plus_one), _mm256_add_pd(freq, norm));
+        _mm256_store_pd(block_scores, _mm256_mul_pd(idf_vector, tf));
+        scores[doc_ids[i]] += block_scores[0];
+        scores[doc_ids[i + 1]] += block_scores[1];
+        scores[doc_ids[i + 2]] += block_scores[2];
+        scores[doc_ids[i + 3]] += block_scores[3];
+    }
+    scoreBlockScalar(doc_ids + i, freqs + i, count - i, idf, norms, scores);
+}
+#endif
+
+void scoreBlock(const int *doc_ids, const int *freqs, int count, double idf, const double *norms, double *scores)
+{
+#if defined(__x86_64__)
+    static const bool has_avx2 = __builtin_cpu_supports("avx2");
+    if (has_avx2)
+    {
+        scoreBlockAvx2(doc_ids, freqs, count, idf, norms, scores);
+        return;
+    }
+#endif
+    scoreBlockScalar(doc_ids, freqs, count, idf, norms, scores);
 }
 
-int varbyteDecode(const uint8_t *data, size_t max_size, size_t &bytes_read)
+// Print query stats, nothing in release builds
+void printQueryStats(const QueryStats &stats)
 {
-    int value = 0;
-    int shift = 0;
-    bytes_read = 0;
+#ifdef QUERY_STATS
+    std::cout << "[stats] lists: " << stats.lists_opened
+              << ", blocks: " << stats.blocks_loaded
+              << ", skipped: " << stats.blocks_skipped
+              << ", bytes: " << stats.bytes_read
+              << ", postings: " << stats.postings_decoded
+              << ", freqs: " << stats.freqs_decoded
+              << ", scored: " << stats.docs_scored
+              << ", heap: " << stats.heap_insertions
+              << ", tier answers: " << stats.tier_answers
+              << ", tier fallbacks: " << stats.tier_fallbacks
+              << ", pair lists: " << stats.pair_lists
+              << ", prefetched: " << stats.prefetched_bytes
+              << ", io waits: " << stats.io_waits
+              << ", lookup: " << stats.lookup_ms << "ms"
+              << ", traversal: " << stats.traversal_ms << "ms"
+              << ", ranking: " << stats.ranking_ms << "ms" << std::endl;
+#else
+    (void)stats;
+#endif
+}
 
-    for (size_t i = 0; i < max_size; ++i)
+// Serve one shard over a unix socket for the aggregator.
+// A request is one line "<0 disjunctive|1 conjunctive> <query>", the reply is one "doc_id score"
+// line per result in global doc_ids, a "truncated <fraction processed>" line if the query budget
+// ran out, and an empty line. A "r [dir]" request reloads the shard, or loads the one in dir, in the
+// background and is answered by "reloading", "busy" or "rejected" if the shard is a single index
+// and dir is not another directory. Connections stay open across queries and are
+// served one request at a time, the engine is not thread safe
+int serveShard(SearchEngine &engine, const std::string &socket_path)
+{
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    if (listen_fd < 0 || socket_path.size() >= sizeof(addr.sun_path))
     {
-        uint8_t byte = data[i];
-        value |= (byte & 0x7F) << shift; // Use lower 7 bits
-        shift += 7;
-        bytes_read++;
+        std::cerr << "Cannot create socket: " << socket_path << std::endl;
+        return 1;
+    }
+    std::copy(socket_path.begin(), socket_path.end(), addr.sun_path);
+    unlink(socket_path.c_str()); // left behind by a previous server
+    if (bind(listen_fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0 || listen(listen_fd, 16) != 0)
+    {
+        std::cerr << "Cannot listen on socket: " << socket_path << std::endl;
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN); // a timed out aggregator may close before the reply is written
+    std::cout << "Serving on " << socket_path << std::endl;
 
-        if (byte & 0x80) // Check if this is the last byte
+    std::vector<pollfd> fds{{listen_fd, POLLIN, 0}};
+    std::vector<std::string> buffers{""}; // unparsed input of every connection
+    while (poll(fds.data(), fds.size(), -1) >= 0)
+    {
+        if (fds[0].revents & POLLIN)
         {
-            break;
+            int client_fd = accept(listen_fd, nullptr, nullptr);
+            if (client_fd >= 0)
+            {
+                fds.push_back({client_fd, POLLIN, 0});
+                buffers.emplace_back();
+            }
         }
-    }
+        for (size_t i = 1; i < fds.size(); ++i)
+        {
+            if (!(fds[i].revents & (POLLIN | POLLHUP | POLLERR)))
+                continue;
+            char data[4096];
+            ssize_t n = read(fds[i].fd, data, sizeof(data));
+            if (n <= 0) // aggregator went away
+            {
+                close(fds[i].fd);
+                fds[i].fd = -1;
+                continue;
+            }
+            buffers[i].append(data, n);
 
-    return value;
+            size_t line_end;
+            while ((line_end = buffers[i].find('\n')) != std::string::npos)
+            {
+                std::string request = buffers[i].substr(0, line_end);
+                buffers[i].erase(0, line_end + 1);
+                std::ostringstream reply;
+                reply.precision(17); // scores are compared across shards
+                if (!request.empty() && request[0] == 'r')
+                {
+                    std::string dir = request.size() > 2 ? request.substr(2) : "";
+                    if (!engine.reloadable(dir))
+                        reply << "rejected\n";
+                    else
+                        reply << (engine.reload(dir) ? "reloading" : "busy") << "\n";
+                }
+                else
+                {
+                    bool conjunctive = !request.empty() && request[0] == '1';
+                    std::string query = request.size() > 2 ? request.substr(2) : "";
+                    SearchResponse response = engine.search(query, conjunctive);
+                    for (const auto &result : response.results)
+                    {
+                        reply << result.doc_id << " " << result.score << "\n";
+                    }
+                    if (response.truncated)
+                        reply << "truncated " << response.processed << "\n";
+                }
+                reply << "\n";
+                std::string out = reply.str();
+                for (size_t sent = 0; sent < out.size();)
+                {
+                    ssize_t written = write(fds[i].fd, out.data() + sent, out.size() - sent);
+                    if (written <= 0)
+                        break;
+                    sent += written;
+                }
+            }
+        }
+        // drop closed connections
+        for (size_t i = fds.size() - 1; i > 0; --i)
+        {
+            if (fds[i].fd < 0)
+            {
+                fds.erase(fds.begin() + i);
+                buffers.erase(buffers.begin() + i);
+            }
+        }
+    }
+    return 1;
 }
 
-int main()
+int main(int argc, char *argv[])
 {
-    SearchEngine engine(LEXICON_FILE,
-                        INDEX_FILE,
-                        DOC_INFO_FILE,
-                        BLOCK_INFO_FILE,
-                        ORIGINAL_TAR_GZ);
+    // search <index dir> serves the index in a directory, a single or a segmented one, without arguments
+    // the index in the working directory, search --serve <socket path> <shard dir> answers queries of
+    // the aggregator. A ":reload [dir]" query swaps in the index in dir once it is loaded, without dir
+    // a segmented index is loaded again. A single index is rewritten in place by build_index, so a
+    // rebuilt one is only picked up from the new directory it was written to.
+    // --budget-ms <ms> and --budget-postings <count> in front bound every query, --threads <count>
+    // splits long queries into doc_id ranges traversed in parallel
+    int threads = 1;
+    double budget_ms = 0;
+    int64_t budget_postings = 0;
+    std::vector<std::string> args;
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+        if (arg == "--budget-ms" && i + 1 < argc)
+            budget_ms = std::atof(argv[++i]);
+        else if (arg == "--budget-postings" && i + 1 < argc)
+            budget_postings = std::atoll(argv[++i]);
+        else if (arg == "--threads" && i + 1 < argc)
+            threads = std::atoi(argv[++i]);
+        else
+            args.push_back(arg);
+    }
+
+    std::unique_ptr<SearchEngine> engine_ptr;
+    if (args.size() == 3 && args[0] == "--serve")
+    {
+        SearchEngine engine(args[2], ORIGINAL_TAR_GZ);
+        engine.setQueryBudget(budget_ms, budget_postings);
+        engine.setQueryThreads(threads);
+        return serveShard(engine, args[1]);
+    }
+    engine_ptr = std::make_unique<SearchEngine>(args.empty() ? "." : args[0], ORIGINAL_TAR_GZ);
+    SearchEngine &engine = *engine_ptr;
+    engine.setQueryBudget(budget_ms, budget_postings);
+    engine.setQueryThreads(threads);
 
     std::string query;
     bool conjunctive;
@@ -484,21 +2777,37 @@ int main()
         std::getline(std::cin, query);
         if (query == "q")
             break;
+        if (query.rfind(RELOAD_COMMAND, 0) == 0)
+        {
+            std::string dir = query.size() > RELOAD_COMMAND.size() ? query.substr(RELOAD_COMMAND.size() + 1) : "";
+            if (!engine.reloadable(dir))
+                std::cout << "A single index is rewritten in place, build it in another directory and reload that one." << std::endl;
+            else if (engine.reload(dir))
+                std::cout << "Reloading in the background, queries keep using the current index." << std::endl;
+            else
+                std::cout << "A reload is already running." << std::endl;
+            continue;
+        }
 
         std::cout << "Enter search mode (0 for disjunctive, 1 for conjunctive): ";
         std::cin >> conjunctive;
         std::cin.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
 
-        auto results = engine.search(query, conjunctive);
+        auto response = engine.search(query, conjunctive);
 
         std::cout << "Top 10 results:" << std::endl;
-        for (const auto &result : results)
+        for (const auto &result : response.results)
         {
             std::cout << "Doc ID: " << result.doc_id << ", Score: " << result.score << std::endl;
             // find line position of the original file and print the content
             std::string content = engine.getOriginalFileContent(result.doc_id);
             std::cout << content << std::endl;
         }
+        if (response.truncated)
+        {
+            std::cout << "[truncated] query budget ran out after " << response.processed * 100 << "% of the postings" << std::endl;
+        }
+        printQueryStats(response.stats);
     }
 
     return 0;
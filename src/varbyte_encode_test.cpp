@@ -1,7 +1,10 @@
+#undef NDEBUG // checks stay on in release builds
 #include <iostream>
 #include <vector>
 #include <fstream>
+#include <random>
 #include <cassert>
+#include "index_format.h"
 
 // Varbyte encode function
 std::vector<uint8_t> varbyteEncode(int number, int &size)
@@ -17,23 +20,6 @@ std::vector<uint8_t> varbyteEncode(int number, int &size)
     return bytes;
 }
 
-// Varbyte decode function
-int varbyteDecode(const std::vector<uint8_t> &encoded)
-{
-    int number = 0;
-    int shift = 0;
-
-    for (size_t i = 0; i < encoded.size(); ++i)
-    {
-        number |= (encoded[i] & 0x7F) << shift;
-        if (!(encoded[i] & 0x80))
-            break;
-        shift += 7;
-    }
-
-    return number;
-}
-
 // write encoded data to file
 void writeEncodedToFile(const std::vector<uint8_t> &encoded, std::ofstream &outFile)
 {
@@ -60,8 +46,9 @@ void testVarbyteCodec()
 {
     std::vector<int> test_numbers = {0, 127, 128, 255, 256, 16383, 16384, 2097151, 2097152, 268435455};
 
-    // write test
-    std::ofstream outFile("encoded_numbers.bin", std::ios::binary);
+    // write test, to a temp file so runs leave nothing in the working directory
+    std::string path = (std::filesystem::temp_directory_path() / "varbyte_encode_test_numbers.bin").string();
+    std::ofstream outFile(path, std::ios::binary);
     std::vector<int> sizes;
     for (int num : test_numbers)
     {
@@ -73,7 +60,7 @@ void testVarbyteCodec()
     outFile.close();
 
     // read and decode test
-    std::ifstream inFile("encoded_numbers.bin", std::ios::binary);
+    std::ifstream inFile(path, std::ios::binary);
     for (int num : test_numbers)
     {
         auto encoded = readEncodedFromFile(inFile);
@@ -85,12 +72,80 @@ void testVarbyteCodec()
         assert(num == decoded && "encoding/decoding mismatch");
     }
     inFile.close();
+    std::filesystem::remove(path);
 
     std::cout << "all tests passed!" << std::endl;
 }
 
+// block kernels against the values encoded with appendVarbyte, for full and tail blocks of doc_id
+// gaps followed by counts, with the end of the block close enough to take the bounds checked path
+template <int BlockSize, class Codec>
+void testBlockKernels()
+{
+    std::mt19937 rng(3);
+    for (int round = 0; round < 1000; ++round)
+    {
+        int count = round % 2 ? BlockSize : 1 + rng() % BlockSize;
+        int base = rng() % 1000;
+        std::vector<int> doc_ids(count);
+        std::vector<int> counts(count);
+        std::vector<uint8_t> bytes;
+        int doc_id = base;
+        for (int i = 0; i < count; ++i)
+        {
+            int gap = 1 + rng() % (1 << (rng() % 22)); // doc_ids of a 256 posting block stay below INT_MAX
+            doc_id += gap;
+            doc_ids[i] = doc_id;
+            appendVarbyte(bytes, gap);
+        }
+        size_t gaps_size = bytes.size();
+        for (int &freq : counts)
+        {
+            freq = 1 + rng() % (1 << (rng() % 16));
+            appendVarbyte(bytes, freq);
+        }
+
+        std::vector<int> decoded_ids(count);
+        std::vector<int> decoded_counts(count);
+        size_t pos = Codec::template decodeBlock<BlockSize, true>(bytes.data(), bytes.size(), count, base, decoded_ids.data());
+        assert(pos == gaps_size && "gaps decoded to the wrong length");
+        pos += Codec::template decodeBlock<BlockSize, false>(bytes.data() + pos, bytes.size() - pos, count, 0, decoded_counts.data());
+        assert(pos == bytes.size() && "counts decoded to the wrong length");
+        assert(decoded_ids == doc_ids && "doc_id mismatch");
+        assert(decoded_counts == counts && "count mismatch");
+    }
+}
+
+// every block size of visitFormat, and format headers read back as written
+void testFormats()
+{
+    for (int block_size : {64, 128, 256})
+    {
+        IndexFormat format;
+        format.block_size = block_size;
+        bool visited = visitFormat(format, [](auto size, auto codec)
+                                   { testBlockKernels<decltype(size)::value, decltype(codec)>(); });
+        assert(visited && "block size without an instantiation");
+    }
+    std::cout << "block kernel tests passed!" << std::endl;
+
+    std::string dir = (std::filesystem::temp_directory_path() / "varbyte_encode_test_format").string();
+    std::filesystem::create_directories(dir);
+    IndexFormat written{CODEC_VARBYTE, 64, SCORING_IMPACT};
+    writeIndexFormat(dir, written);
+    IndexFormat read;
+    assert(readIndexFormat(dir, read) && read == written && "format header mismatch");
+    std::ofstream(dir + "/" + FORMAT_FILE) << "varbyte 100 bm25\n";
+    assert(!readIndexFormat(dir, read) && "unsupported block size accepted");
+    std::filesystem::remove(dir + "/" + FORMAT_FILE);
+    assert(readIndexFormat(dir, read) && read == IndexFormat() && "missing header is not the default format");
+    std::filesystem::remove_all(dir);
+    std::cout << "format header tests passed!" << std::endl;
+}
+
 int main()
 {
     testVarbyteCodec();
+    testFormats();
     return 0;
 }